@@ -206,7 +206,7 @@ template<class T, class IdxVal> inline void Array<T,IdxVal>::ResetAndDelete()
 {
 	MaxEntryPlus = 0;
 	Allocated = 0;
-	delete TheEntries;
+	delete[] TheEntries;
 	TheEntries = 0;
 }
 
@@ -29,22 +29,193 @@
 // Author: Sam Buss based on work by Sam Buss and Alex Kulungowski
 // Contact: sbuss@math.ucsd.edu
 
+// This tells the Visual C++ compiler to allow use of fopen.
+#define _CRT_SECURE_NO_DEPRECATE 1
+
 #include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <emmintrin.h>			// SSE2, for TraversePacket
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "KdTree.h"
 #include "DoubleRecurse.h"
+#include "ThreadPool.h"
+
+// Totals for the triples in one bin, for the binned split method.
+//    A TT_MAX exactly on a bin boundary goes in the bin below the boundary;
+//	  other triples on a boundary go in the bin above it.
+class KdSplitBin {
+public:
+	double LowerEdge;			// Lower boundary of the bin: a candidate split value.
+	long NumMins, NumMaxs, NumFlats;
+	double CostMins, CostMaxs, CostFlats;
+};
+
+// One piece of the tree build, with all the working storage it needs.
+//    The top task builds the top of the tree directly into TreeNodes,
+//	  numbering the objects as in the tree.  In a parallel build, the top task 
+//	  stops at subtrees with at most MaxTaskObjects objects, and makes a 
+//	  subtree task for each of them.  A subtree task has its own nodes, 
+//	  extent triples and object numbering, so different subtree tasks can
+//	  be built at the same time.  Afterwards their nodes are merged into TreeNodes.
+class KdBuildTask {
+public:
+	KdBuildTask();
+	~KdBuildTask();
+	void DeleteWorkArrays();
+
+	long NextIndex();		// Preallocate the next node ahead of time.  Can trigger memory movement.
+	unsigned long long* SortKeyBuffer( long numKeys );	// Room for sorting the extent triples
+	long GlobalObjectID( long taskObjectID ) const 
+		{ return GlobalIDs ? GlobalIDs[taskObjectID] : taskObjectID; }
+
+	const KdTree* Tree;
+	Array<KdTreeNode>* Nodes;		// The nodes being built: TreeNodes for the top task
+	Array<KdTreeNode> OwnNodes;		// The nodes of a subtree task.  Node 0 is the subtree root.
+	long NumTaskObjects;			// The task numbers its objects 0,...,NumTaskObjects-1
+	long* GlobalIDs;				// Object numbers in the tree, or null if the same as in the task.
+	AABB* ObjectAABBs;				// Holds extents (and extents in boxes) for each object.
+	unsigned char* LeftRightStatus;	// Info on whether objects go left or right in split.
+	ExtentTriple* ET_Lists;			// Tons of storage for extent lists.
+	KdSplitBin* SplitBins;			// Bins for the binned split method.
+	unsigned long long* SortKeys;	// Buffer for the sort keys of the extent triples
+	long SortKeysSize;
+
+	// Only for the top task
+	long MaxTaskObjects;			// Largest subtree to make into a subtree task, or zero for none
+	long* LocalIDs;					// Work array used to renumber the objects of a subtree task
+	Array<KdBuildTask*> SubtreeTasks;
+
+	// Only for a subtree task: the arguments for BuildSubTree
+	long BaseIndex;					// The node in TreeNodes that is the subtree root
+	int Depth;
+	AABB Aabb;
+	double TotalObjectCost;
+	ExtentTripleArrayInfo XExtents, YExtents, ZExtents;
+	long SpaceAvailable;
+
+	// Data used for split-cost-functions.  CF = cost function.  
+	double CF_MinOnAxis;			// Starting value for first axis
+	double CF_MaxOnAxis;			// Ending value for first axis
+	double CF_FirstAxisLenInv;		// One divided by length of first axis
+	double CF_OldCost;				// Cost to beat
+	double CF_TotalNodeObjectCosts;	// Total cost of all objects in current node
+	double CF_LogTNOCinv;			// 1.0 over log(CF_TotalNodeObjectCosts)
+	double CF_Area;					// Area of the node
+	double CF_EndArea;				// Surface area of one end (side face) of the node combined.
+	double CF_Wrap;					// Surface area of "wrap" portion of the node.
+	double CF_C, CF_D;				// C and D coefs for the Buss double recurse method
+	double CF_ExponentToBeat;		// Exponent to beat for double recurse method
+};
+
+KdBuildTask::KdBuildTask()
+{
+	Tree = 0;
+	Nodes = &OwnNodes;
+	NumTaskObjects = 0;
+	GlobalIDs = 0;
+	ObjectAABBs = 0;
+	LeftRightStatus = 0;
+	ET_Lists = 0;
+	SplitBins = 0;
+	SortKeys = 0;
+	SortKeysSize = 0;
+	MaxTaskObjects = 0;
+	LocalIDs = 0;
+}
+
+KdBuildTask::~KdBuildTask()
+{
+	DeleteWorkArrays();
+	delete[] GlobalIDs;
+	delete[] LocalIDs;
+}
 
-Stack<Kd_TraverseNodeData> traverseStack;
-Array<long> Kd_TraverseNodeData::ToCallBackObjectID(10);	// Object ID to be called back
-Array<long> Kd_TraverseNodeData::CalledBackObjectID(10);	// Object ID recently called back
-Array<long> Kd_TraverseNodeData::CalledBackDecay(10);	// How long ago last called back
-Array<long> Kd_TraverseNodeData::CalledBackTemp(10);		// Object ID recently called back
-Array<long> Kd_TraverseNodeData::CalledBackTemp2(10);		// How long ago last called back
+void KdBuildTask::DeleteWorkArrays()
+{
+	delete[] ObjectAABBs;
+	delete[] LeftRightStatus;
+	delete[] ET_Lists;
+	delete[] SplitBins;
+	delete[] SortKeys;
+	ObjectAABBs = 0;
+	LeftRightStatus = 0;
+	ET_Lists = 0;
+	SplitBins = 0;
+	SortKeys = 0;
+	SortKeysSize = 0;
+}
+
+inline long KdBuildTask::NextIndex()
+{
+	long i = Nodes->SizeUsed();
+	Nodes->Touch(i);
+	return i;
+}
+
+// The buffer only grows: the lists to be sorted get shorter as the build goes deeper.
+unsigned long long* KdBuildTask::SortKeyBuffer( long numKeys )
+{
+	if ( numKeys>SortKeysSize ) {
+		delete[] SortKeys;
+		SortKeys = new unsigned long long[numKeys];
+		SortKeysSize = numKeys;
+	}
+	return SortKeys;
+}
+
+// Scratch area for the Traverse forms that do not take one: one copy per thread.
+static thread_local KdTraverseScratch ThreadTraverseScratch;
+
+// Unmaps a file mapped by LoadMapped.  (Defined with KdTreeFileMapping, below.)
+static void DeleteFileMapping( KdTreeFileMapping* mapping );
 
 
 // Destructor
 KdTree::~KdTree()
+{
+	DeleteTree();
+}
+
+// Delete the tree, so that BuildTree or LoadMapped can be called again.
+//	 The build settings are kept.
+void KdTree::DeleteTree()
+{
+	DeleteBuildNodes();
+	if ( FileMapping ) {
+		DeleteFileMapping( FileMapping );	// The packed nodes and object lists are in the mapped file
+		FileMapping = 0;
+	}
+	else {
+		delete[] PackedNodes;
+		delete[] LeafObjectList;
+	}
+	PackedNodes = 0;
+	NumPackedNodes = 0;
+	LeafObjectList = 0;
+	LeafObjectListSize = 0;
+	ExtentsHash = 0;
+}
+
+// Delete the nodes used while building the tree, 
+//	 including the object lists in each non-empty leaf node
+void KdTree::DeleteBuildNodes()
 {
 	if ( TreeSize()==0 ) {
 		return;
@@ -71,6 +242,7 @@ KdTree::~KdTree()
 		}
 		currentNodeIndex = IdxStack.Pop();
 	}
+	TreeNodes.ResetAndDelete();
 }
 
 
@@ -83,24 +255,32 @@ KdTree::~KdTree()
 //	 dir - direction of the ray.
 //   Returns "true" if traversal aborted by the callback function returning "true"
 bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, 
-				PotentialObjectCallback* pocFunc, double seekDistance, bool obeySeekDistance  )
+				PotentialObjectCallback* pocFunc, double seekDistance, bool obeySeekDistance  ) const
 {
-	CallbackFunction = (void*) pocFunc;
-	UseListCallback = false;
-
-	return Traverse( startPos, dir, seekDistance, obeySeekDistance );
+	return Traverse( startPos, dir, (void*) pocFunc, KD_CALLBACK_OBJECT, 0, 
+					 ThreadTraverseScratch, seekDistance, obeySeekDistance );
 }
 
 bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, 
-				PotentialObjectsListCallback* polcFunc, double seekDistance, bool obeySeekDistance  )
+				PotentialObjectsListCallback* polcFunc, double seekDistance, bool obeySeekDistance  ) const
 {
-	CallbackFunction = (void*) polcFunc;
-	UseListCallback = true;
+	return Traverse( startPos, dir, (void*) polcFunc, KD_CALLBACK_OBJECT_LIST, 0, 
+					 ThreadTraverseScratch, seekDistance, obeySeekDistance );
+}
 
-	return Traverse( startPos, dir, seekDistance, obeySeekDistance );
+// The userData pointer is passed back unchanged to each call of podcFunc.
+bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, 
+				PotentialObjectDataCallback* podcFunc, void* userData, KdTraverseScratch& scratch,
+				double seekDistance, bool obeySeekDistance  ) const
+{
+	return Traverse( startPos, dir, (void*) podcFunc, KD_CALLBACK_OBJECT_DATA, userData, 
+					 scratch, seekDistance, obeySeekDistance );
 }
 
-bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double seekDistance, bool obeySeekDistance )
+// callbackType tells which kind of function callbackFunction points to.
+bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, 
+					   void* callbackFunction, CallbackType callbackType, void* userData,
+					   KdTraverseScratch& scratch, double seekDistance, bool obeySeekDistance ) const
 {
 	double entryDist, exitDist;
 	int entryFaceId, exitFaceId;
@@ -120,6 +300,7 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 		dirInv.z = 1.0/dir.z;
 	}
 
+	scratch.BeginTraversal();
 	bool intersectsAABB = BoundingBox.RayEntryExit( startPos, 
 													signDirX, signDirY, signDirZ, dirInv, 
 													&entryDist, &entryFaceId, 
@@ -128,13 +309,13 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 		return false;
 	}
 
-	ResetInvokeCallback();
+	Kd_TraverseNodeData* traverseStack = scratch.NodeStack;	// Nodes still to be traversed
 
 	// Main traversal loop
 
 	long currentNodeIndex = RootIndex();			// The current node in the traversal
 	assert ( currentNodeIndex != -1 ) ;				// The tree should not be empty
-    KdTreeNode* currentNode = &TreeNodes[currentNodeIndex];
+    const KdPackedNode* currentNode = &PackedNodes[currentNodeIndex];
 	double minDistance = Max(0.0, entryDist);					
 	double maxDistance = exitDist;
 	bool hitParallel = false;
@@ -148,18 +329,17 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 		maxDistance = seekDistance;
 	}
 	assert ( minDistance<=maxDistance );
-	traverseStack.Reset();
 
 	while ( true ) {
 		
 		if ( ! currentNode->IsLeaf() ) {
-			Stats_NodeTraversed();
+			scratch.Stats_NodeTraversed();
 			// Handle non-leaf nodes
 			//		These do not contain primitive objects.
 			int thisSign;
 			double thisDirInv;
 			double thisStartPt;
-			switch ( currentNode->NodeType ) 
+			switch ( currentNode->SplitAxis() ) 
 			{
 			case KD_SPLIT_X:
 				thisSign = signDirX;
@@ -172,7 +352,7 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 				thisStartPt = startPos.y;
 				break;
             default: 
-                assert(currentNode->NodeType == KD_SPLIT_Z);
+                assert(currentNode->SplitAxis() == KD_SPLIT_Z);
 				thisSign = signDirZ;
 				thisDirInv = dirInv.z;
 				thisStartPt = startPos.z;
@@ -184,15 +364,15 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 				// Handle hitting exactly parallel to the splitting plane
 				double thisSplitVal = currentNode->SplitValue();
 				if ( thisSplitVal<thisStartPt ) {
-					currentNodeIndex = currentNode->RightChildIndex();
+					currentNodeIndex = NonEmptyChild( currentNode->RightChildIndex() );
 				}
 				else if ( thisSplitVal>thisStartPt ) {
-					currentNodeIndex = currentNode->LeftChildIndex();
+					currentNodeIndex = NonEmptyChild( currentNode->LeftChildIndex() );
 				}
 				else {
 					// Exactly hit the splitting plane (not so good!)
-					int leftIdx = currentNode->LeftChildIndex();
-					int rightIdx = currentNode->RightChildIndex();
+					int leftIdx = NonEmptyChild( currentNode->LeftChildIndex() );
+					int rightIdx = NonEmptyChild( currentNode->RightChildIndex() );
 					if ( leftIdx == -1 ) {
 						currentNodeIndex = rightIdx;
 					}
@@ -200,8 +380,8 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 						currentNodeIndex = leftIdx;
 					}
 					else {
-						traverseStack.Push();
-						traverseStack.Top().Set( rightIdx, minDistance, maxDistance );
+						assert ( scratch.StackSize < MaxTreeDepth );
+						traverseStack[scratch.StackSize++].Set( rightIdx, minDistance, maxDistance );
 						currentNodeIndex = leftIdx;
 						hitParallel = true;
 						UpdateMax(maxDistance,parallelHitMax);
@@ -210,12 +390,12 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 			}
 			else {
 				if ( thisSign>0 ) {
-					nearNodeIdx = currentNode->LeftChildIndex();
-					farNodeIdx = currentNode->RightChildIndex();
+					nearNodeIdx = NonEmptyChild( currentNode->LeftChildIndex() );
+					farNodeIdx = NonEmptyChild( currentNode->RightChildIndex() );
 				}
 				else {
-					nearNodeIdx = currentNode->RightChildIndex();
-					farNodeIdx = currentNode->LeftChildIndex();
+					nearNodeIdx = NonEmptyChild( currentNode->RightChildIndex() );
+					farNodeIdx = NonEmptyChild( currentNode->LeftChildIndex() );
 				}
 				double splitDistance = (currentNode->SplitValue()-thisStartPt)*thisDirInv;
 				if ( splitDistance<minDistance ) {
@@ -233,8 +413,8 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 				else {
 					// Push the far node -- if it exists
 					if ( farNodeIdx != -1 ) {
-						traverseStack.Push();
-						traverseStack.Top().Set( farNodeIdx, splitDistance, maxDistance );
+						assert ( scratch.StackSize < MaxTreeDepth );
+						traverseStack[scratch.StackSize++].Set( farNodeIdx, splitDistance, maxDistance );
 					}
 					// Near node is the new current node
 					maxDistance = splitDistance;
@@ -242,7 +422,7 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 				}
 			}
 			if ( currentNodeIndex != -1 ) {
-				currentNode = &TreeNodes[currentNodeIndex];
+				currentNode = &PackedNodes[currentNodeIndex];
 				continue;
 			}
 			// If we reach here, we are at an empty leaf and can fall through.
@@ -251,15 +431,16 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 
 		else {
 			// Handle leaf nodes by invoking the callback function
-			InvokeCallback(currentNode, stopDistanceActive, stopDistance);
+			InvokeCallback(currentNode, callbackFunction, callbackType, userData, scratch, 
+						   stopDistanceActive, stopDistance);
 		}
 
 		// Get to this point if done with a leaf node (possibly empty, possibly not).
-		if ( traverseStack.IsEmpty() ) {
+		if ( scratch.StackSize==0 ) {
 			return stopDistanceActive;
 		}
 		else {
-			Kd_TraverseNodeData& topNode = traverseStack.Pop();
+			const Kd_TraverseNodeData& topNode = traverseStack[--scratch.StackSize];
 			minDistance = topNode.GetMinDist();
 			if ( stopDistanceActive && minDistance>stopDistance ) {
 				if ( !hitParallel || minDistance>=parallelHitMax ) {
@@ -268,7 +449,7 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 				}
 			}
 			currentNodeIndex = topNode.GetNodeNumber();
-			currentNode = &TreeNodes[currentNodeIndex];
+			currentNode = &PackedNodes[currentNodeIndex];
 			maxDistance = topNode.GetMaxDist(); 
 		}
 
@@ -276,118 +457,646 @@ bool KdTree::Traverse( const VectorR3& startPos, const VectorR3& dir, double see
 
 }
 
-void KdTree::ResetInvokeCallback()
+// Occluded: any-hit traversal.
+//	 The nodes are traversed as by Traverse, but there is no stop distance to update:
+//	 the traversal ends as soon as the callback reports an object blocking the ray.
+//	 For a ray parallel to a splitting plane, only the side(s) holding the ray are traversed.
+bool KdTree::Occluded( const VectorR3& startPos, const VectorR3& dir, double maxDistance,
+					   OcclusionCallback* occlusionFunc, void* userData, KdTraverseScratch& scratch ) const
+{
+	double entryDist, exitDist;
+	int entryFaceId, exitFaceId;
+
+	// Set sign of dir components and inverse values of non-zero entries.
+	VectorR3 dirInv;
+	int signDir[3];
+	signDir[0] = Sign(dir.x);
+	if ( signDir[0]!=0 ) {
+		dirInv.x = 1.0/dir.x;
+	}
+	signDir[1] = Sign(dir.y);
+	if ( signDir[1]!=0 ) {
+		dirInv.y = 1.0/dir.y;
+	}
+	signDir[2] = Sign(dir.z);
+	if ( signDir[2]!=0 ) {
+		dirInv.z = 1.0/dir.z;
+	}
+
+	scratch.BeginTraversal();
+	bool intersectsAABB = BoundingBox.RayEntryExit( startPos, 
+													signDir[0], signDir[1], signDir[2], dirInv, 
+													&entryDist, &entryFaceId, 
+													&exitDist, &exitFaceId );
+	if ( !intersectsAABB || exitDist<0.0 ) {
+		return false;
+	}
+	double minDistance = Max(0.0, entryDist);					
+	double maxDist = Min(exitDist, maxDistance);
+	if ( minDistance>maxDist ) {
+		return false;
+	}
+
+	Kd_TraverseNodeData* traverseStack = scratch.NodeStack;	// Nodes still to be traversed
+	long currentNodeIndex = RootIndex();
+	assert ( currentNodeIndex != -1 ) ;				// The tree should not be empty
+
+	while ( true ) {
+		const KdPackedNode* currentNode = &PackedNodes[currentNodeIndex];
+
+		if ( ! currentNode->IsLeaf() ) {
+			scratch.Stats_NodeTraversed();
+			int axis = currentNode->SplitAxis();
+			double thisStartPt = startPos[axis];
+			long leftIdx = NonEmptyChild( currentNode->LeftChildIndex() );
+			long rightIdx = NonEmptyChild( currentNode->RightChildIndex() );
+			if ( signDir[axis]==0 ) {
+				// Parallel to the splitting plane
+				double thisSplitVal = currentNode->SplitValue();
+				if ( thisSplitVal<thisStartPt ) {
+					currentNodeIndex = rightIdx;
+				}
+				else if ( thisSplitVal>thisStartPt ) {
+					currentNodeIndex = leftIdx;
+				}
+				else {
+					// Exactly in the splitting plane: traverse both sides
+					if ( leftIdx!=-1 && rightIdx!=-1 ) {
+						assert ( scratch.StackSize < MaxTreeDepth );
+						traverseStack[scratch.StackSize++].Set( rightIdx, minDistance, maxDist );
+						currentNodeIndex = leftIdx;
+					}
+					else {
+						currentNodeIndex = (leftIdx==-1) ? rightIdx : leftIdx;
+					}
+				}
+			}
+			else {
+				long nearNodeIdx = (signDir[axis]>0) ? leftIdx : rightIdx;
+				long farNodeIdx = (signDir[axis]>0) ? rightIdx : leftIdx;
+				double splitDistance = (currentNode->SplitValue()-thisStartPt)*dirInv[axis];
+				if ( splitDistance<minDistance ) {
+					currentNodeIndex = farNodeIdx;
+				}
+				else if ( splitDistance>maxDist ) {
+					currentNodeIndex = nearNodeIdx;
+				}
+				else if ( nearNodeIdx == -1 ) {
+					minDistance = splitDistance;
+					currentNodeIndex = farNodeIdx;
+				}
+				else {
+					if ( farNodeIdx != -1 ) {
+						assert ( scratch.StackSize < MaxTreeDepth );
+						traverseStack[scratch.StackSize++].Set( farNodeIdx, splitDistance, maxDist );
+					}
+					maxDist = splitDistance;
+					currentNodeIndex = nearNodeIdx;
+				}
+			}
+			if ( currentNodeIndex != -1 ) {
+				continue;
+			}
+			// If we reach here, we are at an empty leaf and can fall through.
+		}
+
+		else {
+			// Test the objects in the leaf, skipping those tested in recent leaves.
+			scratch.Stats_LeafTraversed();
+			scratch.LeafStamp++;
+			const long* objectIdPtr = GetLeafObjectList(*currentNode);
+			for ( long i = currentNode->GetNumObjects(); i > 0; i--, objectIdPtr++ ) {
+				if ( scratch.RecentlyCalledBack(*objectIdPtr) ) {
+					continue;
+				}
+				scratch.Stats_ObjectsInLeaves();
+				if ( (*occlusionFunc)( *objectIdPtr, userData ) ) {
+					return true;
+				}
+			}
+		}
+
+		if ( scratch.StackSize==0 ) {
+			return false;
+		}
+		const Kd_TraverseNodeData& topNode = traverseStack[--scratch.StackSize];
+		currentNodeIndex = topNode.GetNodeNumber();
+		minDistance = topNode.GetMinDist();
+		maxDist = topNode.GetMaxDist(); 
+	}
+}
+
+// The distances along the rays of a packet, one for each ray.
+//	  Each group of four rays is held in one AVX register when compiling for AVX,
+//	  otherwise in two SSE2 registers.
+class KdPacketDistances {
+public:
+	static const int NumGroups = KdPacketScratch::MaxRays/4;
+
+	static KdPacketDistances Load( const double* d );
+	static KdPacketDistances Splat( double d );
+	static KdPacketDistances Sub( const KdPacketDistances& a, const KdPacketDistances& b );
+	static KdPacketDistances Mul( const KdPacketDistances& a, const KdPacketDistances& b );
+	static KdPacketDistances Min( const KdPacketDistances& a, const KdPacketDistances& b );
+	static KdPacketDistances Max( const KdPacketDistances& a, const KdPacketDistances& b );
+	void Store( double* d ) const;
+	// Bit r of the mask is set if a's r-th value is <= b's r-th value.
+	static int LessEqualMask( const KdPacketDistances& a, const KdPacketDistances& b );
+
+private:
+#if defined(__AVX__)
+	__m256d V[NumGroups];
+#else
+	__m128d Lo[NumGroups], Hi[NumGroups];
+#endif
+};
+
+#if defined(__AVX__)
+
+inline KdPacketDistances KdPacketDistances::Load( const double* d ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.V[g] = _mm256_loadu_pd( d+4*g );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Splat( double d ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.V[g] = _mm256_set1_pd( d );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Sub( const KdPacketDistances& a, const KdPacketDistances& b ) 
 {
-	Kd_TraverseNodeData::CalledBackObjectID.Reset();
-	Kd_TraverseNodeData::CalledBackDecay.Reset();
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.V[g] = _mm256_sub_pd( a.V[g], b.V[g] );
+	}
+	return ret;
 }
 
-void KdTree::InvokeCallback(const KdTreeNode* leafNode, bool& retStopDistanceActive, double& retStopDistance)
+inline KdPacketDistances KdPacketDistances::Mul( const KdPacketDistances& a, const KdPacketDistances& b ) 
 {
-	assert(leafNode->IsLeaf());
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.V[g] = _mm256_mul_pd( a.V[g], b.V[g] );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Min( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.V[g] = _mm256_min_pd( a.V[g], b.V[g] );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Max( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.V[g] = _mm256_max_pd( a.V[g], b.V[g] );
+	}
+	return ret;
+}
+
+inline void KdPacketDistances::Store( double* d ) const
+{
+	for ( int g=0; g<NumGroups; g++ ) {
+		_mm256_storeu_pd( d+4*g, V[g] );
+	}
+}
+
+inline int KdPacketDistances::LessEqualMask( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	int mask = 0;
+	for ( int g=0; g<NumGroups; g++ ) {
+		mask |= _mm256_movemask_pd( _mm256_cmp_pd( a.V[g], b.V[g], _CMP_LE_OQ ) ) << (4*g);
+	}
+	return mask;
+}
+
+#else
 
-	// First create a sublist with only the objects not 
-	//     passed back during the previous three callbacks.
-	//    ToCallBackObjectID -- array of Object ID's to be called back
-	//	  CalledBackObjectID -- array of Object ID's recently called back
-	//    CalledBackDecay -- how long ago they were called back
-	//    CalledBackTemp -- holds a copy of the prior CalledBackObjectID contents.
-	assert(Kd_TraverseNodeData::CalledBackObjectID.SizeUsed() == Kd_TraverseNodeData::CalledBackDecay.SizeUsed());
-	int i = leafNode->Data.Leaf.NumObjects;
-	long* objectIdPtr = leafNode->Data.Leaf.ObjectList;
-	// Extract the new ObjectID's, store in Kd_TraverseNodeData::ToCallBackObjectID
-	Kd_TraverseNodeData::ToCallBackObjectID.Reset();
-	int j = 0;
-	while (i > 0) {
-		assert(j >= Kd_TraverseNodeData::CalledBackObjectID.SizeUsed() - 1
-			|| Kd_TraverseNodeData::CalledBackObjectID[j] < Kd_TraverseNodeData::CalledBackObjectID[j + 1]);
-		if (j >= Kd_TraverseNodeData::CalledBackObjectID.SizeUsed() || *objectIdPtr < Kd_TraverseNodeData::CalledBackObjectID[j]) {
-			// Found new object
-			Kd_TraverseNodeData::ToCallBackObjectID.Push(*objectIdPtr);
+inline KdPacketDistances KdPacketDistances::Load( const double* d ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.Lo[g] = _mm_loadu_pd( d+4*g );
+		ret.Hi[g] = _mm_loadu_pd( d+4*g+2 );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Splat( double d ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.Lo[g] = _mm_set1_pd( d );
+		ret.Hi[g] = ret.Lo[g];
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Sub( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.Lo[g] = _mm_sub_pd( a.Lo[g], b.Lo[g] );
+		ret.Hi[g] = _mm_sub_pd( a.Hi[g], b.Hi[g] );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Mul( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.Lo[g] = _mm_mul_pd( a.Lo[g], b.Lo[g] );
+		ret.Hi[g] = _mm_mul_pd( a.Hi[g], b.Hi[g] );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Min( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.Lo[g] = _mm_min_pd( a.Lo[g], b.Lo[g] );
+		ret.Hi[g] = _mm_min_pd( a.Hi[g], b.Hi[g] );
+	}
+	return ret;
+}
+
+inline KdPacketDistances KdPacketDistances::Max( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	KdPacketDistances ret;
+	for ( int g=0; g<NumGroups; g++ ) {
+		ret.Lo[g] = _mm_max_pd( a.Lo[g], b.Lo[g] );
+		ret.Hi[g] = _mm_max_pd( a.Hi[g], b.Hi[g] );
+	}
+	return ret;
+}
+
+inline void KdPacketDistances::Store( double* d ) const
+{
+	for ( int g=0; g<NumGroups; g++ ) {
+		_mm_storeu_pd( d+4*g, Lo[g] );
+		_mm_storeu_pd( d+4*g+2, Hi[g] );
+	}
+}
+
+inline int KdPacketDistances::LessEqualMask( const KdPacketDistances& a, const KdPacketDistances& b ) 
+{
+	int mask = 0;
+	for ( int g=0; g<NumGroups; g++ ) {
+		mask |= ( _mm_movemask_pd( _mm_cmple_pd( a.Lo[g], b.Lo[g] ) ) 
+				  | (_mm_movemask_pd( _mm_cmple_pd( a.Hi[g], b.Hi[g] ) )<<2) ) << (4*g);
+	}
+	return mask;
+}
+
+#endif
+
+// TraversePacket: traverses a packet of rays together.
+//   Each packet stack entry holds a distance range for every ray.  A ray takes
+//	 part in a node only if its range is non-empty.  Rays that do not take part
+//	 are carried along, with an empty range, and are skipped at the leaves.
+//	 The ranges are updated exactly as Traverse updates the range of a single ray.
+//   Returns a bit mask of the rays for which Traverse would return "true"
+int KdTree::TraversePacket( int numRays, const VectorR3* startPos, const VectorR3* dir,
+							PotentialObjectDataCallback* podcFunc, void* const* userData,
+							KdPacketScratch& scratch, const double* seekDistance ) const
+{
+	const int maxRays = KdPacketScratch::MaxRays;
+	assert ( 1<=numRays && numRays<=maxRays );
+
+	// The packet stays together only if the rays' directions all have the same signs,
+	//	  and no ray is parallel to an axis.
+	int signDir[3];
+	signDir[0] = Sign(dir[0].x);
+	signDir[1] = Sign(dir[0].y);
+	signDir[2] = Sign(dir[0].z);
+	bool coherent = ( signDir[0]!=0 && signDir[1]!=0 && signDir[2]!=0 );
+	for ( int r=1; r<numRays && coherent; r++ ) {
+		coherent = ( Sign(dir[r].x)==signDir[0] && Sign(dir[r].y)==signDir[1] && Sign(dir[r].z)==signDir[2] );
+	}
+	if ( !coherent ) {
+		// Traverse the rays one at a time
+		int stopMask = 0;
+		for ( int r=0; r<numRays; r++ ) {
+			if ( Traverse( startPos[r], dir[r], podcFunc, userData[r], scratch.RayScratch[r],
+						   seekDistance ? seekDistance[r] : 0.0, seekDistance!=0 ) ) {
+				stopMask |= (1<<r);
+			}
 		}
-		else if (*objectIdPtr > Kd_TraverseNodeData::CalledBackObjectID[j]) {
-			// Prior object, not found this time
-			j++;
+		return stopMask;
+	}
+
+	// Per ray values, with the r-th ray's value in the r-th entry.
+	//   The entries past numRays repeat the first ray, but have an empty distance range.
+	double startCoord[3][maxRays];
+	double dirInvCoord[3][maxRays];
+	double minDist[maxRays];
+	double maxDist[maxRays];
+	double stopDist[maxRays];		// Large until the callback returns a stop distance
+	int stopMask = 0;				// Rays whose stop distance is active
+	int activeMask = 0;
+	for ( int r=0; r<maxRays; r++ ) {
+		int rr = (r<numRays) ? r : 0;
+		VectorR3 dirInv( 1.0/dir[rr].x, 1.0/dir[rr].y, 1.0/dir[rr].z );
+		startCoord[0][r] = startPos[rr].x;
+		startCoord[1][r] = startPos[rr].y;
+		startCoord[2][r] = startPos[rr].z;
+		dirInvCoord[0][r] = dirInv.x;
+		dirInvCoord[1][r] = dirInv.y;
+		dirInvCoord[2][r] = dirInv.z;
+		minDist[r] = 1.0;
+		maxDist[r] = 0.0;
+		stopDist[r] = DBL_MAX;
+		if ( r>=numRays ) {
 			continue;
 		}
-		else {
-			// Prior object, just found again
-			Kd_TraverseNodeData::CalledBackDecay[j] = -1;		// Will be incremented to 0
-			j++;
-		}
-		objectIdPtr++;
-		i--;
-	}
-	long numObjects = Kd_TraverseNodeData::ToCallBackObjectID.SizeUsed();
-	// Build the new CalledBackObjectID and CalledBackTemp objects
-	Kd_TraverseNodeData::CalledBackTemp = Kd_TraverseNodeData::CalledBackObjectID;
-	Kd_TraverseNodeData::CalledBackTemp2 = Kd_TraverseNodeData::CalledBackDecay;
-	Kd_TraverseNodeData::CalledBackObjectID.Reset();
-	Kd_TraverseNodeData::CalledBackDecay.Reset();
-	long numPrior = Kd_TraverseNodeData::CalledBackTemp.SizeUsed();
-	for (i = 0, j = 0; i < numObjects || j < numPrior; ) {
-		if (j == numPrior ||
-			(i < numObjects && Kd_TraverseNodeData::ToCallBackObjectID[i] < Kd_TraverseNodeData::CalledBackTemp[j])) {
-			Kd_TraverseNodeData::CalledBackObjectID.Push(Kd_TraverseNodeData::ToCallBackObjectID[i]);
-			Kd_TraverseNodeData::CalledBackDecay.Push(0);
-			i++;
+		scratch.RayScratch[r].BeginTraversal();
+		double entryDist, exitDist;
+		int entryFaceId, exitFaceId;
+		bool intersectsAABB = BoundingBox.RayEntryExit( startPos[r], 
+														signDir[0], signDir[1], signDir[2], dirInv, 
+														&entryDist, &entryFaceId, 
+														&exitDist, &exitFaceId );
+		if ( !intersectsAABB || exitDist<0.0 ) {
+			continue;
 		}
-		else {
-			long priorCount = Kd_TraverseNodeData::CalledBackTemp2[j];
-			if (priorCount < 2) {
-				// Save the prior three only.
-				Kd_TraverseNodeData::CalledBackObjectID.Push(Kd_TraverseNodeData::CalledBackTemp[j]);
-				Kd_TraverseNodeData::CalledBackDecay.Push(priorCount + 1);
+		double minD = Max(0.0, entryDist);
+		double maxD = exitDist;
+		if ( seekDistance ) {
+			if ( seekDistance[r]<minD ) {
+				continue;
 			}
-			j++;
+			stopMask |= (1<<r);
+			stopDist[r] = seekDistance[r];
+			UpdateMin( seekDistance[r], maxD );
 		}
+		minDist[r] = minD;
+		maxDist[r] = maxD;
+		activeMask |= (1<<r);
 	}
-	assert(Kd_TraverseNodeData::ToCallBackObjectID.SizeUsed() == numObjects);
-
-	Stats_LeafTraversed();
-	if (numObjects > 0) {
-		if (UseListCallback) {
-			// Pass whole list of objects back to the user
-			bool stopFlag;
-			double newStopDist;
-			Stats_ObjectsInLeaves(numObjects);
-			stopFlag = (*((PotentialObjectsListCallback*)CallbackFunction))(
-				numObjects,
-				Kd_TraverseNodeData::ToCallBackObjectID.GetFirstEntryPtr(),
-				&newStopDist);
-			if (stopFlag) {
-				retStopDistanceActive = true;
-				retStopDistance = newStopDist;
+	if ( activeMask==0 ) {
+		return stopMask;
+	}
+
+	// Main traversal loop
+
+	KdPacketDistances minDistance = KdPacketDistances::Load( minDist );
+	KdPacketDistances maxDistance = KdPacketDistances::Load( maxDist );
+	int stackSize = 0;
+	long currentNodeIndex = RootIndex();
+	const KdPackedNode* currentNode = &PackedNodes[currentNodeIndex];
+
+	while ( true ) {
+
+		if ( !currentNode->IsLeaf() ) {
+			int active = KdPacketDistances::LessEqualMask( minDistance, maxDistance );
+#if TrackKdTraversals
+			for ( int r=0; r<numRays; r++ ) {
+				if ( active & (1<<r) ) {
+					scratch.RayScratch[r].Stats_NodeTraversed();
+				}
+			}
+#endif
+			int axis = currentNode->SplitAxis();
+			long nearNodeIdx;
+			long farNodeIdx;
+			if ( signDir[axis]>0 ) {
+				nearNodeIdx = NonEmptyChild( currentNode->LeftChildIndex() );
+				farNodeIdx = NonEmptyChild( currentNode->RightChildIndex() );
+			}
+			else {
+				nearNodeIdx = NonEmptyChild( currentNode->RightChildIndex() );
+				farNodeIdx = NonEmptyChild( currentNode->LeftChildIndex() );
 			}
+			KdPacketDistances splitDistance = KdPacketDistances::Mul( 
+						KdPacketDistances::Sub( KdPacketDistances::Splat( currentNode->SplitValue() ), 
+												KdPacketDistances::Load( startCoord[axis] ) ),
+						KdPacketDistances::Load( dirInvCoord[axis] ) );
+			int nearMask = (nearNodeIdx==-1) ? 0 : (active & KdPacketDistances::LessEqualMask( minDistance, splitDistance ));
+			int farMask = (farNodeIdx==-1) ? 0 : (active & KdPacketDistances::LessEqualMask( splitDistance, maxDistance ));
+			if ( farMask!=0 ) {
+				KdPacketDistances farMinDistance = KdPacketDistances::Max( minDistance, splitDistance );
+				if ( nearMask==0 ) {
+					// Far node is the new current node
+					minDistance = farMinDistance;
+					currentNodeIndex = farNodeIdx;
+				}
+				else {
+					// Push the far node
+					assert ( stackSize < MaxTreeDepth );
+					scratch.StackNode[stackSize] = farNodeIdx;
+					farMinDistance.Store( scratch.StackMinDist[stackSize] );
+					maxDistance.Store( scratch.StackMaxDist[stackSize] );
+					stackSize++;
+					// Near node is the new current node
+					maxDistance = KdPacketDistances::Min( maxDistance, splitDistance );
+					currentNodeIndex = nearNodeIdx;
+				}
+			}
+			else if ( nearMask!=0 ) {
+				// Near node is the new current node
+				maxDistance = KdPacketDistances::Min( maxDistance, splitDistance );
+				currentNodeIndex = nearNodeIdx;
+			}
+			else {
+				currentNodeIndex = -1;
+			}
+			if ( currentNodeIndex != -1 ) {
+				currentNode = &PackedNodes[currentNodeIndex];
+				continue;
+			}
+			// If we reach here, no ray goes on into a non-empty child.
 		}
+
 		else {
-			// Pass the objects back to the user one at a time
-			double newStopDist;
-			Stats_ObjectsInLeaves(i);
-			long* objectIdPtr2 = Kd_TraverseNodeData::ToCallBackObjectID.GetFirstEntryPtr();
-			for (int k = numObjects ; k > 0; k--) {
-				if ((*((PotentialObjectCallback*)CallbackFunction))(
-					*objectIdPtr2, &newStopDist))
-				{
+			// Invoke the callback function for each ray in the leaf
+			int active = KdPacketDistances::LessEqualMask( minDistance, maxDistance );
+			for ( int r=0; r<numRays; r++ ) {
+				if ( active & (1<<r) ) {
+					bool stopDistanceActive = ((stopMask & (1<<r))!=0);
+					InvokeCallback( currentNode, (void*)podcFunc, KD_CALLBACK_OBJECT_DATA, userData[r], 
+									scratch.RayScratch[r], stopDistanceActive, stopDist[r] );
+					if ( stopDistanceActive ) {
+						stopMask |= (1<<r);
+					}
+				}
+			}
+		}
+
+		// Pop the next node that some ray still needs.
+		//    A ray is done with the node if the node starts past its stop distance.
+		KdPacketDistances stopDistance = KdPacketDistances::Load( stopDist );
+		while ( true ) {
+			if ( stackSize==0 ) {
+				return stopMask;
+			}
+			stackSize--;
+			minDistance = KdPacketDistances::Load( scratch.StackMinDist[stackSize] );
+			maxDistance = KdPacketDistances::Min( KdPacketDistances::Load( scratch.StackMaxDist[stackSize] ), stopDistance );
+			if ( KdPacketDistances::LessEqualMask( minDistance, maxDistance )!=0 ) {
+				break;
+			}
+		}
+		currentNodeIndex = scratch.StackNode[stackSize];
+		currentNode = &PackedNodes[currentNodeIndex];
+	}
+}
+
+// Calls back the objects in the leaf node that were not called back
+//	  by the previous MailboxLeafWindow leaves in this traversal.
+//    The objects are called back in increasing order of object ID.
+void KdTree::InvokeCallback(const KdPackedNode* leafNode, void* callbackFunction, CallbackType callbackType, void* userData,
+							KdTraverseScratch& scratch, bool& retStopDistanceActive, double& retStopDistance) const
+{
+	assert(leafNode->IsLeaf());
+
+	scratch.Stats_LeafTraversed();
+	scratch.LeafStamp++;
+	const long* objectIdPtr = GetLeafObjectList(*leafNode);
+	bool stopFlag;
+	double newStopDist;
+	if (callbackType == KD_CALLBACK_OBJECT_LIST) {
+		// Pass lists of objects back to the user, 
+		//    in batches of at most ListBufferSize objects.
+		int numInBuffer = 0;
+		for (long i = leafNode->GetNumObjects(); i > 0; i--, objectIdPtr++) {
+			if (!scratch.RecentlyCalledBack(*objectIdPtr)) {
+				scratch.ListBuffer[numInBuffer++] = *objectIdPtr;
+			}
+			if (numInBuffer > 0 && (numInBuffer == KdTraverseScratch::ListBufferSize || i == 1)) {
+				scratch.Stats_ObjectsInLeaves(numInBuffer);
+				stopFlag = (*((PotentialObjectsListCallback*)callbackFunction))(
+					numInBuffer, scratch.ListBuffer, &newStopDist);
+				if (stopFlag) {
 					retStopDistanceActive = true;
 					retStopDistance = newStopDist;
 				}
-				objectIdPtr2++;
+				numInBuffer = 0;
+			}
+		}
+	}
+	else {
+		// Pass the objects back to the user one at a time
+		for (long i = leafNode->GetNumObjects(); i > 0; i--, objectIdPtr++) {
+			if (scratch.RecentlyCalledBack(*objectIdPtr)) {
+				continue;
+			}
+			scratch.Stats_ObjectsInLeaves();
+			if (callbackType == KD_CALLBACK_OBJECT_DATA) {
+				stopFlag = (*((PotentialObjectDataCallback*)callbackFunction))(
+					*objectIdPtr, &newStopDist, userData);
+			}
+			else {
+				stopFlag = (*((PotentialObjectCallback*)callbackFunction))(
+					*objectIdPtr, &newStopDist);
+			}
+			if (stopFlag)
+			{
+				retStopDistanceActive = true;
+				retStopDistance = newStopDist;
 			}
 		}
 	}
 }
 
-
 /***********************************************************************************************
  * Tree building functions.
  ***********************************************************************************************/
+
+// The packed tree stores split values as floats.  The split values are always
+//	 object extents, so the extents are rounded outward to floats while building 
+//	 the tree.  This makes the float split values exact.
+static inline double RoundDownToFloat( double x )
+{
+	float f = (float)x;
+	return ( (double)f > x ) ? (double)nextafterf( f, -FLT_MAX ) : (double)f;
+}
+
+static inline double RoundUpToFloat( double x )
+{
+	float f = (float)x;
+	return ( (double)f < x ) ? (double)nextafterf( f, FLT_MAX ) : (double)f;
+}
+
+static void RoundOutToFloats( AABB& box )
+{
+	VectorR3& boxMin = box.GetBoxMin();
+	VectorR3& boxMax = box.GetBoxMax();
+	boxMin.Set( RoundDownToFloat(boxMin.x), RoundDownToFloat(boxMin.y), RoundDownToFloat(boxMin.z) );
+	boxMax.Set( RoundUpToFloat(boxMax.x), RoundUpToFloat(boxMax.y), RoundUpToFloat(boxMax.z) );
+}
+
+// Same, but stays inside the clipping box (whose faces are already floats).
+static void RoundOutToFloats( AABB& box, const AABB& clippingBox )
+{
+	RoundOutToFloats( box );
+	VectorR3& boxMin = box.GetBoxMin();
+	VectorR3& boxMax = box.GetBoxMax();
+	const VectorR3& clipMin = clippingBox.GetBoxMin();
+	const VectorR3& clipMax = clippingBox.GetBoxMax();
+	boxMin.Set( Max(boxMin.x,clipMin.x), Max(boxMin.y,clipMin.y), Max(boxMin.z,clipMin.z) );
+	boxMax.Set( Min(boxMax.x,clipMax.x), Min(boxMax.y,clipMax.y), Min(boxMax.z,clipMax.z) );
+}
+
+// A 64 bit FNV-1a hash of the object extents, used to check that a saved tree
+//	 is for the same objects.
+static unsigned long long HashExtentsStart( long numObjects )
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = (hash ^ (unsigned long long)numObjects) * 1099511628211ULL;
+	return hash;
+}
+
+static unsigned long long HashExtents( unsigned long long hash, const AABB& box )
+{
+	double values[6] = { box.GetMinX(), box.GetMinY(), box.GetMinZ(), 
+						 box.GetMaxX(), box.GetMaxY(), box.GetMaxZ() };
+	const unsigned char* bytePtr = (const unsigned char*)values;
+	for ( int i=sizeof(values); i>0; i--, bytePtr++ ) {
+		hash = (hash ^ *bytePtr) * 1099511628211ULL;
+	}
+	return hash;
+}
+
 void KdTree::BuildTree(long numObjects, ExtentFunction* extentFunc, ExtentInBoxFunction* extentInBoxFunc )
 {
-	assert (TreeSize() == 0);
-	NumObjects = numObjects;
 	ExtentFunc = extentFunc;
 	ExtentInBoxFunc = extentInBoxFunc;
+	ExtentDataFunc = 0;
+	ExtentInBoxDataFunc = 0;
+	ExtentUserData = 0;
+	BuildTreeWithExtents( numObjects );
+}
+
+void KdTree::BuildTree(long numObjects, ExtentDataFunction* extentFunc, ExtentInBoxDataFunction* extentInBoxFunc,
+					   void* userData )
+{
+	ExtentFunc = 0;
+	ExtentInBoxFunc = 0;
+	ExtentDataFunc = extentFunc;
+	ExtentInBoxDataFunc = extentInBoxFunc;
+	ExtentUserData = userData;
+	BuildTreeWithExtents( numObjects );
+}
+
+void KdTree::BuildTreeWithExtents( long numObjects )
+{
+	assert (TreeSize() == 0 && NumPackedNodes == 0);
+	NumObjects = numObjects;
 
 	// Get total cost of all objects
 	if ( UseConstantCost ) {
@@ -400,21 +1109,35 @@ void KdTree::BuildTree(long numObjects, ExtentFunction* extentFunc, ExtentInBoxF
 		}
 	}
 
+	// The top task builds the tree directly into TreeNodes.
+	KdBuildTask topTask;
+	topTask.Tree = this;
+	topTask.Nodes = &TreeNodes;
+	topTask.NumTaskObjects = NumObjects;
+	int numThreads = (NumBuildThreads>0) ? NumBuildThreads : ThreadPool::HardwareThreads();
+	if ( numThreads>1 ) {
+		topTask.MaxTaskObjects = Max( (long)MinBuildTaskObjects, NumObjects/(8*numThreads) );
+		topTask.LocalIDs = new long[NumObjects];
+	}
+
 	// Allocate space for the AABB's for each object
 	//	This is used only during the tree construction and is then released.
-	ObjectAABBs = new AABB[numObjects];
+	topTask.ObjectAABBs = new AABB[numObjects];
 
 	// Calculate all initial extents
 	long i;
-	AABB* ObjectAabbPtr = ObjectAABBs;
+	AABB* ObjectAabbPtr = topTask.ObjectAABBs;
+	ExtentsHash = HashExtentsStart( numObjects );
 	for (i=0; i<numObjects; i++ ) {
-		(*ExtentFunc)( i, *ObjectAabbPtr );
+		CalcObjectExtents( i, *ObjectAabbPtr );
+		ExtentsHash = HashExtents( ExtentsHash, *ObjectAabbPtr );
+		RoundOutToFloats( *ObjectAabbPtr );
 		ObjectAabbPtr++;
 	}
 
 	// Pick the overall BoundingBox to enclose all the individual bounding boxes.
-	BoundingBox = *ObjectAABBs;
-	ObjectAabbPtr = ObjectAABBs+1;
+	BoundingBox = *topTask.ObjectAABBs;
+	ObjectAabbPtr = topTask.ObjectAABBs+1;
 	for (i=1; i<numObjects; i++ ) {
 		BoundingBox.EnlargeToEnclose( *ObjectAabbPtr );
 		ObjectAabbPtr++;
@@ -422,17 +1145,18 @@ void KdTree::BuildTree(long numObjects, ExtentFunction* extentFunc, ExtentInBoxF
 	BoundingBoxSurfaceArea = BoundingBox.SurfaceArea();
 
 	// Set up the initial extent lists
-	ET_Lists = new ExtentTriple[ (3*2*ExtentTripleStorageMultiplier)*NumObjects ];
-	if ( !ET_Lists ) {
+	topTask.ET_Lists = new ExtentTriple[ (3*2*ExtentTripleStorageMultiplier)*NumObjects ];
+	if ( !topTask.ET_Lists ) {
 		MemoryError();
 	}
-	ExtentTripleArrayInfo XextentList( ET_Lists, 0, 0 );
-	ExtentTripleArrayInfo YextentList( ET_Lists + (2*ExtentTripleStorageMultiplier)*NumObjects, 0, 0 );
-	ExtentTripleArrayInfo ZextentList( ET_Lists + (2*2*ExtentTripleStorageMultiplier)*NumObjects, 0, 0 );
-	LeftRightStatus = new unsigned char[NumObjects];
+	ExtentTripleArrayInfo XextentList( topTask.ET_Lists, 0, 0 );
+	ExtentTripleArrayInfo YextentList( topTask.ET_Lists + (2*ExtentTripleStorageMultiplier)*NumObjects, 0, 0 );
+	ExtentTripleArrayInfo ZextentList( topTask.ET_Lists + (2*2*ExtentTripleStorageMultiplier)*NumObjects, 0, 0 );
+	topTask.LeftRightStatus = new unsigned char[NumObjects];
+	topTask.SplitBins = (NumSplitBins>0) ? new KdSplitBin[NumSplitBins] : 0;
 
 	// Loop over all objects, creating the extent triples.
-	ObjectAabbPtr = ObjectAABBs;
+	ObjectAabbPtr = topTask.ObjectAABBs;
 	for ( i=0; i<numObjects; i++ ) {
 		XextentList.AddToEnd( ObjectAabbPtr->GetMinX(), ObjectAabbPtr->GetMaxX(), i );
 		YextentList.AddToEnd( ObjectAabbPtr->GetMinY(), ObjectAabbPtr->GetMaxY(), i );
@@ -444,19 +1168,156 @@ void KdTree::BuildTree(long numObjects, ExtentFunction* extentFunc, ExtentInBoxF
 	// Need this for memory management of ExtentTriple lists
 	long spaceAvailable = 2*(ExtentTripleStorageMultiplier-1)*NumObjects;
 
-	// Sort the triples
-	XextentList.Sort();
-	YextentList.Sort();
-	ZextentList.Sort();
+	// Sort the triples.  (Not needed by the binned method.)
+	if ( NumSplitBins==0 ) {
+		SortTriples( topTask, XextentList );
+		SortTriples( topTask, YextentList );
+		SortTriples( topTask, ZextentList );
+	}
 		
-	// Recursively build the entire tree!
+	// Recursively build the entire tree!  (In a parallel build, just the top of the tree.)
 	KdTreeNode& RootNode = TreeNodes[RootIndex()];
 	RootNode.ParentIdx = -1;				// No parent, it is the root node
-	BuildSubTree ( RootIndex(), BoundingBox, TotalObjectCosts, XextentList, YextentList, ZextentList, spaceAvailable );
+	BuildSubTree ( topTask, RootIndex(), 0, BoundingBox, TotalObjectCosts, XextentList, YextentList, ZextentList, spaceAvailable );
+	topTask.DeleteWorkArrays();
+
+	// Build the subtree tasks, and merge them into the tree.
+	long numTasks = topTask.SubtreeTasks.SizeUsed();
+	if ( numTasks>0 ) {
+		ThreadPool buildPool( numThreads );
+		buildPool.Run( numTasks, RunBuildTask, (void*)&topTask );
+		for ( long k=0; k<numTasks; k++ ) {
+			MergeSubtreeTask( *topTask.SubtreeTasks[k] );
+			delete topTask.SubtreeTasks[k];
+		}
+	}
 
-	delete[] ObjectAABBs;
-	delete[] ET_Lists;
-	delete[] LeftRightStatus;
+	FinalizeTree();
+}
+
+// Build one of the subtree tasks.  This is a ThreadPoolJobFunction.
+//	 The userData is the top task.
+void KdTree::RunBuildTask( long jobNum, int /*threadNum*/, void* userData )
+{
+	KdBuildTask& topTask = *(KdBuildTask*)userData;
+	KdBuildTask& task = *topTask.SubtreeTasks[jobNum];
+	const KdTree& tree = *task.Tree;
+	task.ObjectAABBs = new AABB[task.NumTaskObjects];
+	task.LeftRightStatus = new unsigned char[task.NumTaskObjects];
+	task.SplitBins = (tree.NumSplitBins>0) ? new KdSplitBin[tree.NumSplitBins] : 0;
+	if ( !task.ObjectAABBs || !task.LeftRightStatus ) {
+		tree.MemoryError();
+	}
+	long rootIndex = task.NextIndex();
+	(*task.Nodes)[rootIndex].ParentIdx = -1;
+	tree.BuildSubTree( task, rootIndex, task.Depth, task.Aabb, task.TotalObjectCost,
+						task.XExtents, task.YExtents, task.ZExtents, task.SpaceAvailable );
+	task.DeleteWorkArrays();
+}
+
+// Move the nodes of a finished subtree task into TreeNodes.
+//	 The subtree root goes in the node saved for it by the top task, 
+//	 and the other nodes go at the end of TreeNodes.  
+//	 The leaves' object lists are handed over to TreeNodes.
+void KdTree::MergeSubtreeTask( const KdBuildTask& subtreeTask )
+{
+	const Array<KdTreeNode>& fromNodes = subtreeTask.OwnNodes;
+	long n = fromNodes.SizeUsed();
+	long offset = TreeSize()-1;		// Node i>0 of the task becomes node offset+i
+	long baseIndex = subtreeTask.BaseIndex;
+	if ( n>1 ) {
+		TreeNodes.Touch( offset+n-1 );
+	}
+	for ( long i=0; i<n; i++ ) {
+		const KdTreeNode& fromNode = fromNodes[i];
+		KdTreeNode& toNode = TreeNodes[ (i==0) ? baseIndex : offset+i ];
+		toNode.NodeType = fromNode.NodeType;
+		if ( i>0 ) {
+			toNode.ParentIdx = (fromNode.ParentIdx==0) ? baseIndex : offset+fromNode.ParentIdx;
+		}
+		if ( fromNode.IsLeaf() ) {
+			toNode.Data.Leaf = fromNode.Data.Leaf;
+		}
+		else {
+			long leftIdx = fromNode.Data.Split.LeftChildIdx;
+			long rightIdx = fromNode.Data.Split.RightChildIdx;
+			toNode.Data.Split.LeftChildIdx = (leftIdx==-1) ? -1 : offset+leftIdx;
+			toNode.Data.Split.RightChildIdx = (rightIdx==-1) ? -1 : offset+rightIdx;
+			toNode.Data.Split.SplitValue = fromNode.Data.Split.SplitValue;
+		}
+	}
+}
+
+// Pack the tree into the compact form used for traversal, 
+//	 and then release the nodes used for building it.
+void KdTree::FinalizeTree()
+{
+	// Count the packed nodes and the total length of the leaf object lists.
+	// Every internal node has two packed children, even if one is empty.
+	long numInternal = 0;
+	long numLeafObjects = 0;
+	long n = TreeSize();
+	for ( long i=0; i<n; i++ ) {
+		const KdTreeNode& node = TreeNodes[i];
+		if ( node.IsLeaf() ) {
+			numLeafObjects += node.GetNumObjects();
+		}
+		else {
+			numInternal++;
+		}
+	}
+	NumPackedNodes = 1 + 2*numInternal;
+	LeafObjectListSize = numLeafObjects;
+	PackedNodes = new KdPackedNode[NumPackedNodes];
+	LeafObjectList = new long[Max(LeafObjectListSize,1L)];
+	if ( !PackedNodes || !LeafObjectList ) {
+		MemoryError();
+	}
+
+	long nextPackedIdx = 1;
+	long nextObjectIdx = 0;
+	PackSubtree( RootIndex(), 0, &nextPackedIdx, &nextObjectIdx );
+	assert ( nextPackedIdx == NumPackedNodes && nextObjectIdx == LeafObjectListSize );
+
+	DeleteBuildNodes();
+}
+
+// Copy the subtree with root TreeNodes[buildIdx] into the packed tree,
+//	 with its root at PackedNodes[packedIdx].  
+// The subtrees are laid out depth first, so that each node's children are 
+//	 near to it in memory.
+void KdTree::PackSubtree( long buildIdx, long packedIdx, long* nextPackedIdx, long* nextObjectIdx )
+{
+	const KdTreeNode& node = TreeNodes[buildIdx];
+	KdPackedNode& packedNode = PackedNodes[packedIdx];
+	if ( node.IsLeaf() ) {
+		long numInLeaf = node.GetNumObjects();
+		packedNode.SetLeaf( numInLeaf, *nextObjectIdx );
+		long* toPtr = LeafObjectList + *nextObjectIdx;
+		const long* fromPtr = node.Data.Leaf.ObjectList;
+		for ( long i=numInLeaf; i>0; i-- ) {
+			*(toPtr++) = *(fromPtr++);
+		}
+		*nextObjectIdx += numInLeaf;
+		return;
+	}
+
+	assert ( (float)node.SplitValue() == node.SplitValue() );	// Extents were rounded to floats
+	long leftIdx = *nextPackedIdx;
+	*nextPackedIdx += 2;
+	packedNode.SetSplit( node.SplitAxis(), (float)node.SplitValue(), leftIdx );
+	if ( node.LeftChildEmpty() ) {
+		PackedNodes[leftIdx].SetLeaf( 0, 0 );
+	}
+	else {
+		PackSubtree( node.LeftChildIndex(), leftIdx, nextPackedIdx, nextObjectIdx );
+	}
+	if ( node.RightChildEmpty() ) {
+		PackedNodes[leftIdx+1].SetLeaf( 0, 0 );
+	}
+	else {
+		PackSubtree( node.RightChildIndex(), leftIdx+1, nextPackedIdx, nextObjectIdx );
+	}
 }
 
 // Recursively build a subtree.
@@ -464,10 +1325,17 @@ void KdTree::BuildTree(long numObjects, ExtentFunction* extentFunc, ExtentInBoxF
 // Then call the routine recursively twice, once for each child
 //		as appropriate
 // spaceAvailable gives the amount of room for growth of the ExtentTripleLists.
-void KdTree::BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
+// depth is the depth of the node baseIndex: at MaxTreeDepth the node is always a leaf.
+void KdTree::BuildSubTree( KdBuildTask& task, long baseIndex, int depth, AABB& aabb, double totalObjectCost,
 					ExtentTripleArrayInfo& xExtents, ExtentTripleArrayInfo& yExtents, 
-					ExtentTripleArrayInfo& zExtents, long spaceAvailable )
+					ExtentTripleArrayInfo& zExtents, long spaceAvailable ) const
 {
+	// In a parallel build, the top task leaves small enough subtrees to subtree tasks.
+	if ( task.MaxTaskObjects>0 && xExtents.NumObjects()<=task.MaxTaskObjects 
+			&& depth>0 && depth<MaxTreeDepth ) {
+		DeferSubTree( task, baseIndex, depth, aabb, totalObjectCost, xExtents, yExtents, zExtents, spaceAvailable );
+		return;
+	}
 
 	VectorR3 deltaAABB = aabb.GetBoxMax();
 	deltaAABB -= aabb.GetBoxMin();
@@ -482,34 +1350,27 @@ void KdTree::BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
 	long numObjectsToRight;			// Number of objects on right side of split
 	double costObjectsToLeft;		// Total cost of objects on the left side of split
 	double costObjectsToRight;		// Total cost of objects on the right side of split
-	CalcBestSplit( aabb, deltaAABB, totalObjectCost, xExtents, yExtents, zExtents,
-					&splitAxisID, &splitValue, 
-					&numTriplesToLeft, &numObjectsToLeft, &numObjectsToRight, 
-					&costObjectsToLeft, &costObjectsToRight );
+	// The binned method is used only for nodes with many objects.  Smaller nodes 
+	//	 use the exact method, and their extent lists are sorted first.
+	bool useBins = ( NumSplitBins>0 && xExtents.NumTriples()>BinnedMinTriplesPerBin*NumSplitBins );
+	if ( NumSplitBins>0 && !useBins && depth < MaxTreeDepth ) {
+		SortTriples( task, xExtents );
+		SortTriples( task, yExtents );
+		SortTriples( task, zExtents );
+	}
+	if ( depth < MaxTreeDepth ) {
+		CalcBestSplit( task, aabb, deltaAABB, totalObjectCost, xExtents, yExtents, zExtents, useBins,
+						&splitAxisID, &splitValue, 
+						&numTriplesToLeft, &numObjectsToLeft, &numObjectsToRight, 
+						&costObjectsToLeft, &costObjectsToRight );
+	}
+	else {
+		splitAxisID = KD_LEAF;		// Too deep for the traversal stack
+	}
 	switch ( splitAxisID ) {
 		case KD_LEAF:
-			{
-				// No splitting occurs
-				// Copy object triples into an array
-				KdTreeNode& baseNode = TreeNodes.GetEntry(baseIndex);
-				baseNode.NodeType = KD_LEAF;
-				long numInLeaf = xExtents.NumObjects();
-				assert ( yExtents.NumObjects() == numInLeaf && zExtents.NumObjects() == numInLeaf );
-				baseNode.Data.Leaf.NumObjects = numInLeaf;
-				long* objectArray = new long[numInLeaf];	
-				if ( !objectArray ) {
-					MemoryError();
-				}
-				baseNode.Data.Leaf.ObjectList = objectArray;
-				ExtentTriple* triple = xExtents.TripleArray;		// Pick any one of the three axes
-				for ( long i=0; i<numInLeaf; triple++ ) {
-					if ( !( triple->IsMax() ) ) {
-						*(objectArray++) = triple->ObjectID;
-						i++;
-					}
-				}
-				ShellSort(baseNode.Data.Leaf.ObjectList, numInLeaf);
-			}
+			// No splitting occurs
+			MakeLeaf( task, baseIndex, xExtents, yExtents, zExtents );
 			return;									// Finished: leaf is completely set
 		case KD_SPLIT_X:
 			splitExtentList = &xExtents;
@@ -527,9 +1388,9 @@ void KdTree::BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
 	if ( numObjectsToLeft==0 || numObjectsToRight==0 ) {
 		assert ( numObjectsToLeft!=0 || numObjectsToRight!=0 );
 		// One child is empty
-		long childIndex = NextIndex();		// WARNING: NextIndex() can trigger memory movement
-		KdTreeNode& baseNode = TreeNodes.GetEntry(baseIndex);
-		KdTreeNode& childNode = TreeNodes[childIndex];
+		long childIndex = task.NextIndex();		// WARNING: task.NextIndex() can trigger memory movement
+		KdTreeNode& baseNode = task.Nodes->GetEntry(baseIndex);
+		KdTreeNode& childNode = (*task.Nodes)[childIndex];
 		childNode.ParentIdx = baseIndex;
 		baseNode.NodeType = splitAxisID;
 		baseNode.Data.Split.SplitValue = splitValue;
@@ -544,29 +1405,53 @@ void KdTree::BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
 			baseNode.Data.Split.RightChildIdx = -1;
 			childAabb.SetNewAxisMax( splitAxisID, splitValue );
 		}
-		BuildSubTree( childIndex, childAabb, totalObjectCost,
+		BuildSubTree( task, childIndex, depth+1, childAabb, totalObjectCost,
 						xExtents, yExtents, zExtents, spaceAvailable );
 		return;
 	}
 	
+	// If there is not enough room left to store the extent triples
+	//	 for the smaller subtree, make a leaf instead.
+	if ( spaceAvailable < 2*Min(numObjectsToLeft,numObjectsToRight) ) {
+		MakeLeaf( task, baseIndex, xExtents, yExtents, zExtents );
+		return;
+	}
+
 	// Step 3. 
 	// Two subtrees must be formed.
-	// Decide which objects go left and right - Store info in LeftRightStatus[]
+	// Decide which objects go left and right - Store info in task.LeftRightStatus[]
 	ExtentTriple* etPtr = splitExtentList->TripleArray;
 	long i;
-	for ( i=0; i<numTriplesToLeft; i++, etPtr++ ) {
-		// It is on the left, don't know if on right yet, so set as not.
-		LeftRightStatus[ etPtr->ObjectID ] = 1;			// Set first bit, reset second bit
-	}
 	long n = splitExtentList->NumTriples();
-	for ( ; i<n; i++, etPtr++ ) {
-		if ( etPtr->ExtentType == ExtentTriple::TT_MAX ) {
-			// On right side.  Maybe on left side too.
-			LeftRightStatus[ etPtr->ObjectID ] |= 2;		// Set second bit
+	if ( !useBins ) {
+		for ( i=0; i<numTriplesToLeft; i++, etPtr++ ) {
+			// It is on the left, don't know if on right yet, so set as not.
+			task.LeftRightStatus[ etPtr->ObjectID ] = 1;			// Set first bit, reset second bit
 		}
-		else {
-			// On right side only
-			LeftRightStatus[ etPtr->ObjectID ] = 2;			// Set second bit, reset first bit
+		for ( ; i<n; i++, etPtr++ ) {
+			if ( etPtr->ExtentType == ExtentTriple::TT_MAX ) {
+				// On right side.  Maybe on left side too.
+				task.LeftRightStatus[ etPtr->ObjectID ] |= 2;		// Set second bit
+			}
+			else {
+				// On right side only
+				task.LeftRightStatus[ etPtr->ObjectID ] = 2;			// Set second bit, reset first bit
+			}
+		}
+	}
+	else {
+		// The triples are not sorted, so compare each against the split value.
+		// First the min's and flats, then the max's.
+		for ( i=0; i<n; i++, etPtr++ ) {
+			if ( etPtr->ExtentType != ExtentTriple::TT_MAX ) {
+				task.LeftRightStatus[ etPtr->ObjectID ] = (etPtr->ExtentValue<splitValue) ? 1 : 2;
+			}
+		}
+		etPtr = splitExtentList->TripleArray;
+		for ( i=0; i<n; i++, etPtr++ ) {
+			if ( etPtr->ExtentType == ExtentTriple::TT_MAX && etPtr->ExtentValue>splitValue ) {
+				task.LeftRightStatus[ etPtr->ObjectID ] |= 2;
+			}
 		}
 	}
 
@@ -582,11 +1467,11 @@ void KdTree::BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
 	// Allocate the left and right children
 	// Set entries in baseNode for internal node
 	// Set all other tree pointers. (Indices)
-	long leftChildIndex = NextIndex();		// Warning: NextIndex() can trigger memory movement
-	long rightChildIndex = NextIndex();
-	KdTreeNode& baseNode = TreeNodes.GetEntry(baseIndex);
-	KdTreeNode& leftChildNode = TreeNodes[leftChildIndex];
-	KdTreeNode& rightChildNode = TreeNodes[rightChildIndex];
+	long leftChildIndex = task.NextIndex();		// Warning: task.NextIndex() can trigger memory movement
+	long rightChildIndex = task.NextIndex();
+	KdTreeNode& baseNode = task.Nodes->GetEntry(baseIndex);
+	KdTreeNode& leftChildNode = (*task.Nodes)[leftChildIndex];
+	KdTreeNode& rightChildNode = (*task.Nodes)[rightChildIndex];
 	baseNode.NodeType = splitAxisID;
 	baseNode.Data.Split.LeftChildIdx = leftChildIndex;
 	baseNode.Data.Split.RightChildIdx = rightChildIndex;
@@ -636,46 +1521,132 @@ void KdTree::BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
 	ExtentTripleArrayInfo newYextents( yExtents.EndOfArray, 0, 0 );
 	ExtentTripleArrayInfo newZextents( zExtents.EndOfArray, 0, 0 );
 	// Create the AABB's for the smaller subtree
-	MakeAabbsForSubtree( leftRightFlag, xExtents, *smallerChildAabb );
+	MakeAabbsForSubtree( task, leftRightFlag, xExtents, *smallerChildAabb );
 	// Copy the extent triples for the smaller subtree
-	CopyTriplesForSubtree( leftRightFlag, 0, xExtents, newXextents ); 
-	CopyTriplesForSubtree( leftRightFlag, 1, yExtents, newYextents ); 
-	CopyTriplesForSubtree( leftRightFlag, 2, zExtents, newZextents ); 
+	CopyTriplesForSubtree( task, leftRightFlag, 0, xExtents, newXextents ); 
+	CopyTriplesForSubtree( task, leftRightFlag, 1, yExtents, newYextents ); 
+	CopyTriplesForSubtree( task, leftRightFlag, 2, zExtents, newZextents ); 
 	// Recalculate total cost if necessary, i.e., if some objects go missing
 	if ( newXextents.NumObjects()!=smallerNumObjects ) {
-		smallerTotalCost = CalcTotalCosts( newXextents );
+		smallerTotalCost = CalcTotalCosts( task, newXextents );
 	}
 	
 	// Step 8.
 	leftRightFlag = 3-leftRightFlag;
 	// Create the AABB's for the larger subtree
-	MakeAabbsForSubtree( leftRightFlag, xExtents, *largerChildAabb );
+	MakeAabbsForSubtree( task, leftRightFlag, xExtents, *largerChildAabb );
 	// Copy the extent triples for the larger subtree
-	CopyTriplesForSubtree( leftRightFlag, 0, xExtents, xExtents ); 
-	CopyTriplesForSubtree( leftRightFlag, 1, yExtents, yExtents ); 
-	CopyTriplesForSubtree( leftRightFlag, 2, zExtents, zExtents ); 
+	CopyTriplesForSubtree( task, leftRightFlag, 0, xExtents, xExtents ); 
+	CopyTriplesForSubtree( task, leftRightFlag, 1, yExtents, yExtents ); 
+	CopyTriplesForSubtree( task, leftRightFlag, 2, zExtents, zExtents ); 
 	leftRightFlag = 3-leftRightFlag;		// Reset to smaller subtree again
 	// Recalculate total cost if necessary, i.e., if some objects go missing
 	if ( xExtents.NumObjects()!=largerNumObjects ) {
-		largerTotalCost = CalcTotalCosts( xExtents );
+		largerTotalCost = CalcTotalCosts( task, xExtents );
 	}
 
 	// Step 9.
 	// Invoke BuildSubTree recursively for the two subtrees
-	BuildSubTree(smallerChildIdx, *smallerChildAabb, smallerTotalCost,
+	BuildSubTree( task, smallerChildIdx, depth+1, *smallerChildAabb, smallerTotalCost,
 					newXextents, newYextents, newZextents, newSpaceAvailable);
-	BuildSubTree(largerChildIdx, *largerChildAabb, largerTotalCost,
+	BuildSubTree( task, largerChildIdx, depth+1, *largerChildAabb, largerTotalCost,
 					xExtents, yExtents, zExtents, spaceAvailable );
 
 }
 
+// Make the node a leaf, holding all the objects in the extent lists.
+void KdTree::MakeLeaf( KdBuildTask& task, long baseIndex, const ExtentTripleArrayInfo& xExtents, 
+						const ExtentTripleArrayInfo& yExtents, const ExtentTripleArrayInfo& zExtents ) const
+{
+	// Copy object triples into an array
+	KdTreeNode& baseNode = task.Nodes->GetEntry(baseIndex);
+	baseNode.NodeType = KD_LEAF;
+	long numInLeaf = xExtents.NumObjects();
+	assert ( yExtents.NumObjects() == numInLeaf && zExtents.NumObjects() == numInLeaf );
+	baseNode.Data.Leaf.NumObjects = numInLeaf;
+	long* objectArray = new long[numInLeaf];	
+	if ( !objectArray ) {
+		MemoryError();
+	}
+	baseNode.Data.Leaf.ObjectList = objectArray;
+	ExtentTriple* triple = xExtents.TripleArray;		// Pick any one of the three axes
+	for ( long i=0; i<numInLeaf; triple++ ) {
+		if ( !( triple->IsMax() ) ) {
+			*(objectArray++) = triple->ObjectID;
+			i++;
+		}
+	}
+	ShellSort(baseNode.Data.Leaf.ObjectList, numInLeaf);
+	if ( task.GlobalIDs ) {
+		// Renumbering keeps the order, so the list stays sorted.
+		objectArray = baseNode.Data.Leaf.ObjectList;
+		for ( long i=0; i<numInLeaf; i++ ) {
+			objectArray[i] = task.GlobalIDs[objectArray[i]];
+		}
+	}
+}
+
+// Make a subtree task to build the subtree later.
+//	 The objects are renumbered 0,1,2,... in the same order as their numbers 
+//	 in the tree, and the extent triples are copied into the task's own storage.  
+//	 Since the order is kept, the subtree built is the same as BuildSubTree would build.
+void KdTree::DeferSubTree( KdBuildTask& task, long baseIndex, int depth, const AABB& aabb, double totalObjectCost,
+					const ExtentTripleArrayInfo& xExtents, const ExtentTripleArrayInfo& yExtents, 
+					const ExtentTripleArrayInfo& zExtents, long spaceAvailable ) const
+{
+	assert ( task.GlobalIDs==0 && task.LocalIDs!=0 );
+	long n = xExtents.NumObjects();
+	KdBuildTask* subtreeTask = new KdBuildTask();
+	subtreeTask->Tree = this;
+	subtreeTask->NumTaskObjects = n;
+	subtreeTask->GlobalIDs = new long[n];
+	subtreeTask->BaseIndex = baseIndex;
+	subtreeTask->Depth = depth;
+	subtreeTask->Aabb = aabb;
+	subtreeTask->TotalObjectCost = totalObjectCost;
+	// Give the subtree at most the space it would get in a tree built on its own.
+	subtreeTask->SpaceAvailable = Min( spaceAvailable, 2*(ExtentTripleStorageMultiplier-1)*n );
+	long axisSize = 2*n + subtreeTask->SpaceAvailable;
+	subtreeTask->ET_Lists = new ExtentTriple[3*axisSize];
+	if ( !subtreeTask->GlobalIDs || !subtreeTask->ET_Lists ) {
+		MemoryError();
+	}
+
+	// Each object has exactly one min or flat triple.
+	long* idPtr = subtreeTask->GlobalIDs;
+	ExtentTriple* etPtr = xExtents.TripleArray;
+	for ( long i=xExtents.NumTriples(); i>0; i--, etPtr++ ) {
+		if ( !etPtr->IsMax() ) {
+			*(idPtr++) = etPtr->ObjectID;
+		}
+	}
+	assert ( idPtr == subtreeTask->GlobalIDs+n );
+	ShellSort( subtreeTask->GlobalIDs, n );
+	for ( long i=0; i<n; i++ ) {
+		task.LocalIDs[subtreeTask->GlobalIDs[i]] = i;
+	}
 
-void KdTree::CalcBestSplit( const AABB& aabb, const VectorR3& deltaBox, double totalObjectCost, 
+	const ExtentTripleArrayInfo* fromExtents[3] = { &xExtents, &yExtents, &zExtents };
+	ExtentTripleArrayInfo* toExtents[3] = { &subtreeTask->XExtents, &subtreeTask->YExtents, &subtreeTask->ZExtents };
+	for ( int axis=0; axis<3; axis++ ) {
+		const ExtentTripleArrayInfo& from = *fromExtents[axis];
+		ExtentTriple* toET = subtreeTask->ET_Lists + axis*axisSize;
+		toExtents[axis]->Init( toET, from.NumMaxMins, from.NumFlats );
+		const ExtentTriple* fromET = from.TripleArray;
+		for ( long i=from.NumTriples(); i>0; i--, fromET++, toET++ ) {
+			toET->Set( fromET->ExtentType, fromET->ExtentValue, task.LocalIDs[fromET->ObjectID] );
+		}
+	}
+
+	task.SubtreeTasks.Push( subtreeTask );
+}
+
+void KdTree::CalcBestSplit( KdBuildTask& task, const AABB& aabb, const VectorR3& deltaBox, double totalObjectCost, 
 					const ExtentTripleArrayInfo& xExtents, const ExtentTripleArrayInfo& yExtents, 
-					const ExtentTripleArrayInfo& zExtents,
+					const ExtentTripleArrayInfo& zExtents, bool useBins,
 					KD_SplittingAxis* splitAxisID, double* splitValue, 
 					long* numTriplesToLeft, long* numObjectsToLeft, long* numObjectsToRight, 
-					double* costObjectsToLeft, double* costObjectsToRight )
+					double* costObjectsToLeft, double* costObjectsToRight ) const
 {
 	assert( xExtents.NumObjects() == yExtents.NumObjects() );
 	assert( yExtents.NumObjects() == zExtents.NumObjects() );
@@ -692,7 +1663,7 @@ void KdTree::CalcBestSplit( const AABB& aabb, const VectorR3& deltaBox, double t
 	// Try each of the three axes in turn.
 	bool foundBetter = false;
 	double bestCostSoFar = totalObjectCost; 
-	if ( CalcBestSplit( totalObjectCost, costToBeat, xExtents, 
+	if ( CalcBestSplit( task, totalObjectCost, costToBeat, xExtents, useBins,
 						aabb.GetMinX(), aabb.GetMaxX(), deltaBox.y, deltaBox.z,
 						&bestCostSoFar, splitValue, 
 						numTriplesToLeft, numObjectsToLeft, numObjectsToRight,
@@ -702,7 +1673,7 @@ void KdTree::CalcBestSplit( const AABB& aabb, const VectorR3& deltaBox, double t
 		*splitAxisID = KD_SPLIT_X;
 		costToBeat = bestCostSoFar;
 	}
-	if ( CalcBestSplit( totalObjectCost, costToBeat, yExtents, 
+	if ( CalcBestSplit( task, totalObjectCost, costToBeat, yExtents, useBins,
 						aabb.GetMinY(), aabb.GetMaxY(), deltaBox.x, deltaBox.z,
 						&bestCostSoFar, splitValue, 
 						numTriplesToLeft, numObjectsToLeft, numObjectsToRight,
@@ -712,7 +1683,7 @@ void KdTree::CalcBestSplit( const AABB& aabb, const VectorR3& deltaBox, double t
 		*splitAxisID = KD_SPLIT_Y;
 		costToBeat = bestCostSoFar;
 	}
-	if ( CalcBestSplit( totalObjectCost, costToBeat, zExtents, 
+	if ( CalcBestSplit( task, totalObjectCost, costToBeat, zExtents, useBins,
 						aabb.GetMinZ(), aabb.GetMaxZ(), deltaBox.x, deltaBox.y,
 						&bestCostSoFar, splitValue, 
 						numTriplesToLeft, numObjectsToLeft, numObjectsToRight,
@@ -726,20 +1697,26 @@ void KdTree::CalcBestSplit( const AABB& aabb, const VectorR3& deltaBox, double t
 
 // Returns true if a new better split is found on the axis.
 // The other return values will NOT be changed unless "true" is returned.
-bool KdTree::CalcBestSplit( double totalObjectCosts, double costToBeat, 
-						const ExtentTripleArrayInfo& extents, 
+bool KdTree::CalcBestSplit( KdBuildTask& task, double totalObjectCosts, double costToBeat, 
+						const ExtentTripleArrayInfo& extents, bool useBins,
 						double minOnAxis, double maxOnAxis, 
 						double secondAxisLen, double thirdAxisLen,
 						double* retNewBestCost, double* retSplitValue, 
 						long* retNumTriplesToLeft, long* retNumObjectsToLeft, long* retNumObjectsToRight,
-						double* retCostObjectsToLeft, double* retCostObjectsToRight )
+						double* retCostObjectsToLeft, double* retCostObjectsToRight ) const
 {
 	if ( minOnAxis>=maxOnAxis ) {
 		return false;		// We do not support splitting a zero length axis.
 	}
 
-	InitSplitCostFunction( minOnAxis, maxOnAxis, secondAxisLen, thirdAxisLen,
+	InitSplitCostFunction( task, minOnAxis, maxOnAxis, secondAxisLen, thirdAxisLen,
 							costToBeat, totalObjectCosts );
+	if ( useBins ) {
+		return CalcBestSplitBinned( task, totalObjectCosts, extents, minOnAxis, maxOnAxis, 
+									retNewBestCost, retSplitValue, 
+									retNumTriplesToLeft, retNumObjectsToLeft, retNumObjectsToRight,
+									retCostObjectsToLeft, retCostObjectsToRight );
+	}
 
 	bool foundBetter = false;
 	double bestCost = costToBeat;			// Cost to beat
@@ -769,7 +1746,7 @@ bool KdTree::CalcBestSplit( double totalObjectCosts, double costToBeat,
 			{
 				break;
 			}
-            UpdateLeftRightCosts( *etPtr, &numObjectsLeft, &numObjectsRight, &costLeft, &costRight );
+            UpdateLeftRightCosts( task, *etPtr, &numObjectsLeft, &numObjectsRight, &costLeft, &costRight );
 			etPtr++;
 			numTriplesLeft++;
 			thisType = etPtr->ExtentType;
@@ -778,7 +1755,7 @@ bool KdTree::CalcBestSplit( double totalObjectCosts, double costToBeat,
 
 		// Ready to call the cost function
 		// If the cost function gives better value, save everything appropriately
-		if ( CalcSplitCost( thisSplitValue, costLeft, costRight, &bestCost ) ) {
+		if ( CalcSplitCost( task, thisSplitValue, costLeft, costRight, &bestCost ) ) {
 			foundBetter = true;
 			*retNewBestCost = bestCost;
 			*retSplitValue = thisSplitValue;
@@ -798,7 +1775,7 @@ bool KdTree::CalcBestSplit( double totalObjectCosts, double costToBeat,
 				break;
 			}
 			// Move rightward a triple
-			UpdateLeftRightCosts( *etPtr, &numObjectsLeft, &numObjectsRight, &costLeft, &costRight );
+			UpdateLeftRightCosts( task, *etPtr, &numObjectsLeft, &numObjectsRight, &costLeft, &costRight );
 			etPtr++;
 			numTriplesLeft++;
 			thisType = etPtr->ExtentType;
@@ -810,15 +1787,112 @@ bool KdTree::CalcBestSplit( double totalObjectCosts, double costToBeat,
 	return foundBetter;
 }
 
-void KdTree::UpdateLeftRightCosts( const ExtentTriple& et, long* numObjectsLeft, long* numObjectsRight, 
-							   double *costLeft, double *costRight )
+// Binned version of CalcBestSplit.  
+// The extents need not be sorted.  The cost function has already been initialized.
+// The candidate split values are the boundaries between NumSplitBins equal 
+//	 sized bins, rounded to floats.
+bool KdTree::CalcBestSplitBinned( KdBuildTask& task, double totalObjectCosts, const ExtentTripleArrayInfo& extents, 
+						double minOnAxis, double maxOnAxis,
+						double* retNewBestCost, double* retSplitValue, 
+						long* retNumTriplesToLeft, long* retNumObjectsToLeft, long* retNumObjectsToRight,
+						double* retCostObjectsToLeft, double* retCostObjectsToRight ) const
+{
+	int numBins = NumSplitBins;
+	double binWidth = (maxOnAxis-minOnAxis)/(double)numBins;
+	double binWidthInv = 1.0/binWidth;
+	KdSplitBin* bin = task.SplitBins;
+	for ( int k=0; k<numBins; k++, bin++ ) {
+		bin->LowerEdge = (double)(float)(minOnAxis + k*binWidth);
+		bin->NumMins = bin->NumMaxs = bin->NumFlats = 0;
+		bin->CostMins = bin->CostMaxs = bin->CostFlats = 0.0;
+	}
+	task.SplitBins[0].LowerEdge = minOnAxis;
+
+	// Put each triple into its bin.
+	ExtentTriple* etPtr = extents.TripleArray;
+	for ( long n = extents.NumTriples(); n>0; n--, etPtr++ ) {
+		double value = etPtr->ExtentValue;
+		int k = (int)((value-minOnAxis)*binWidthInv);
+		ClampRange( &k, 0, numBins-1 );
+		// Correct for the bin boundaries having been rounded to floats
+		if ( etPtr->ExtentType == ExtentTriple::TT_MAX ) {
+			while ( k>0 && value<=task.SplitBins[k].LowerEdge ) {
+				k--;
+			}
+			while ( k<numBins-1 && value>task.SplitBins[k+1].LowerEdge ) {
+				k++;
+			}
+		}
+		else {
+			while ( k>0 && value<task.SplitBins[k].LowerEdge ) {
+				k--;
+			}
+			while ( k<numBins-1 && value>=task.SplitBins[k+1].LowerEdge ) {
+				k++;
+			}
+		}
+		bin = task.SplitBins+k;
+		double cost = ObjectCost( task.GlobalObjectID(etPtr->ObjectID) );
+		switch ( etPtr->ExtentType ) {
+		case ExtentTriple::TT_MIN:
+			bin->NumMins++;
+			bin->CostMins += cost;
+			break;
+		case ExtentTriple::TT_MAX:
+			bin->NumMaxs++;
+			bin->CostMaxs += cost;
+			break;
+		default:
+			bin->NumFlats++;
+			bin->CostFlats += cost;
+			break;
+		}
+	}
+
+	// Sweep the bin boundaries from left to right.
+	bool foundBetter = false;
+	double bestCost;
+	long numTriplesLeft = 0;
+	long numObjectsLeft = 0;
+	long numObjectsRight = extents.NumObjects();
+	double costLeft = 0.0;
+	double costRight = totalObjectCosts;
+	bin = task.SplitBins;
+	for ( int k=1; k<numBins; k++, bin++ ) {
+		numTriplesLeft += bin->NumMins + bin->NumMaxs + bin->NumFlats;
+		numObjectsLeft += bin->NumMins + bin->NumFlats;
+		costLeft += bin->CostMins + bin->CostFlats;
+		numObjectsRight -= bin->NumMaxs + bin->NumFlats;
+		costRight -= bin->CostMaxs + bin->CostFlats;
+		double thisSplitValue = task.SplitBins[k].LowerEdge;
+		if ( thisSplitValue<=minOnAxis || thisSplitValue>=maxOnAxis 
+				|| thisSplitValue<=task.SplitBins[k-1].LowerEdge ) {
+			continue;			// Not a usable split value
+		}
+		if ( CalcSplitCost( task, thisSplitValue, costLeft, costRight, &bestCost ) ) {
+			foundBetter = true;
+			*retNewBestCost = bestCost;
+			*retSplitValue = thisSplitValue;
+			*retNumTriplesToLeft = numTriplesLeft;
+			*retNumObjectsToLeft = numObjectsLeft;
+			*retNumObjectsToRight = numObjectsRight;
+			*retCostObjectsToLeft = costLeft;
+			*retCostObjectsToRight = costRight;
+		}
+	}
+
+	return foundBetter;
+}
+
+void KdTree::UpdateLeftRightCosts( const KdBuildTask& task, const ExtentTriple& et, long* numObjectsLeft, long* numObjectsRight, 
+							   double *costLeft, double *costRight ) const
 {
 	double cost;
 	if ( UseConstantCost ) {
 		cost = ObjectConstantCost;
 	}
 	else {
-		cost = (*UserCostFunction)(et.ObjectID);
+		cost = (*UserCostFunction)( task.GlobalObjectID(et.ObjectID) );
 	}
 
 	switch ( et.ExtentType ) {
@@ -841,28 +1915,29 @@ void KdTree::UpdateLeftRightCosts( const ExtentTriple& et, long* numObjectsLeft,
 
 
 // Create the Aabb's for one of the subtrees
-void KdTree::MakeAabbsForSubtree( unsigned char leftRightFlag, const ExtentTripleArrayInfo& theExtents,
-									const AABB& theAabb )
+void KdTree::MakeAabbsForSubtree( KdBuildTask& task, unsigned char leftRightFlag, const ExtentTripleArrayInfo& theExtents,
+									const AABB& theAabb ) const
 {
 	ExtentTriple* etPtr = theExtents.TripleArray;
 	long i;
 	long n = theExtents.NumTriples();
 	for ( i=0; i<n; i++, etPtr++ ) {
 		long objectID = etPtr->ObjectID;
-		if ( (LeftRightStatus[ objectID ] & leftRightFlag) != 0 ) {
+		if ( (task.LeftRightStatus[ objectID ] & leftRightFlag) != 0 ) {
 			// Don't bother if a Max on the left, or a Min on the right.
 			//		In these cases, the extent will be computed anyway
 			if ( !((etPtr->ExtentType==(ExtentTriple::TT_MIN) && leftRightFlag==2)
 				|| (etPtr->ExtentType==(ExtentTriple::TT_MAX) && leftRightFlag==1)) )
 			{
-				assert ( 0<=objectID && objectID<NumObjects );
-				bool stillIn = (*ExtentInBoxFunc)( objectID, theAabb, ObjectAABBs[objectID] );
-				bool flatX = ObjectAABBs[objectID].IsFlatX();
-				bool flatY = ObjectAABBs[objectID].IsFlatY();
-				bool flatZ = ObjectAABBs[objectID].IsFlatZ();
+				assert ( 0<=objectID && objectID<task.NumTaskObjects );
+				bool stillIn = CalcObjectExtentsInBox( task.GlobalObjectID(objectID), theAabb, task.ObjectAABBs[objectID] );
+				RoundOutToFloats( task.ObjectAABBs[objectID], theAabb );
+				bool flatX = task.ObjectAABBs[objectID].IsFlatX();
+				bool flatY = task.ObjectAABBs[objectID].IsFlatY();
+				bool flatZ = task.ObjectAABBs[objectID].IsFlatZ();
 				if ( !stillIn ||(flatX&&flatY) || (flatY&&flatZ) || (flatX&&flatZ) ) {
 					// Remove from being in this subtree (bitwise OR with complement of leftRightFlag)
-					LeftRightStatus[objectID] &= ~leftRightFlag;
+					task.LeftRightStatus[objectID] &= ~leftRightFlag;
 				}
 			}
 		}
@@ -877,9 +1952,9 @@ void KdTree::MakeAabbsForSubtree( unsigned char leftRightFlag, const ExtentTripl
 //  The new triples are created and copied in an order that promises to 
 //		be as sorted as possible, but they are not fully sorted yet.  
 //		After that, they are ShellSorted.
-void KdTree::CopyTriplesForSubtree( unsigned char leftRightFlag, int axisNumber,
+void KdTree::CopyTriplesForSubtree( KdBuildTask& task, unsigned char leftRightFlag, int axisNumber,
 											ExtentTripleArrayInfo& fromExtents, 
-											ExtentTripleArrayInfo& toExtents )
+											ExtentTripleArrayInfo& toExtents ) const
 {
 	ExtentTriple* fromET = fromExtents.TripleArray;
 	ExtentTriple* toET = toExtents.TripleArray;
@@ -888,15 +1963,15 @@ void KdTree::CopyTriplesForSubtree( unsigned char leftRightFlag, int axisNumber,
 	long iM = 0;								// Number of "to" max/mins created
 	for ( ; n>0; n--, fromET++ ) {
 		long objectID = fromET->ObjectID;
-		assert ( 0<=objectID && objectID<NumObjects );
-		if ( LeftRightStatus[objectID] & leftRightFlag ) {
+		assert ( 0<=objectID && objectID<task.NumTaskObjects );
+		if ( task.LeftRightStatus[objectID] & leftRightFlag ) {
 			toET->ObjectID = objectID;
 			toET->ExtentType = fromET->ExtentType;
 			switch ( fromET->ExtentType ) 
 			{
 			case ExtentTriple::TT_MIN:
 				{
-					const AABB& theAABB = ObjectAABBs[objectID];
+					const AABB& theAABB = task.ObjectAABBs[objectID];
 					double newMinExtent = theAABB.GetBoxMin()[axisNumber];
 					double newMaxExtent = theAABB.GetBoxMax()[axisNumber];
 					toET->ExtentValue = newMinExtent;
@@ -918,7 +1993,7 @@ void KdTree::CopyTriplesForSubtree( unsigned char leftRightFlag, int axisNumber,
 				break;
 			case ExtentTriple::TT_MAX:
 				{
-					const AABB& theAABB = ObjectAABBs[objectID];
+					const AABB& theAABB = task.ObjectAABBs[objectID];
 					double newMinExtent = theAABB.GetBoxMin()[axisNumber];
 					double newMaxExtent = theAABB.GetBoxMax()[axisNumber];
 					toET->ExtentValue = newMaxExtent;
@@ -938,11 +2013,40 @@ void KdTree::CopyTriplesForSubtree( unsigned char leftRightFlag, int axisNumber,
 	assert ( (iM&0x01) == 0 );
 	toExtents.SetNumbers( iM>>1, iF );
 	
-	// Now sort the new array of triples
-	toExtents.Sort();
+	// Now sort the new array of triples.  (Not needed by the binned method.)
+	if ( NumSplitBins==0 ) {
+		SortTriples( task, toExtents );
+	}
 }
 
-double KdTree::CalcTotalCosts( const ExtentTripleArrayInfo& extents ) const
+void KdTree::SortTriples( KdBuildTask& task, ExtentTripleArrayInfo& extents ) const
+{
+	long n = extents.NumTriples();
+	extents.Sort( (n<ExtentTripleArrayInfo::RadixSortMinTriples) ? 0 : task.SortKeyBuffer(2*n) );
+}
+
+void ExtentTripleArrayInfo::Sort( unsigned long long* keyBuffer )
+{
+	long n = NumTriples();
+	if ( n<RadixSortMinTriples ) {
+		ShellSort( TripleArray, n );
+		return;
+	}
+	assert ( keyBuffer!=0 );
+	unsigned long long* keyPtr = keyBuffer;
+	ExtentTriple* etPtr = TripleArray;
+	for ( long i=n; i>0; i--, etPtr++, keyPtr++ ) {
+		*keyPtr = etPtr->SortKey();
+	}
+	RadixSort( keyBuffer, n, keyBuffer+n );
+	keyPtr = keyBuffer;
+	etPtr = TripleArray;
+	for ( long i=n; i>0; i--, etPtr++, keyPtr++ ) {
+		etPtr->SetFromSortKey( *keyPtr );
+	}
+}
+
+double KdTree::CalcTotalCosts( const KdBuildTask& task, const ExtentTripleArrayInfo& extents ) const
 {
 	long n = extents.NumObjects();
 	if ( UseConstantCost ) {
@@ -953,7 +2057,7 @@ double KdTree::CalcTotalCosts( const ExtentTripleArrayInfo& extents ) const
 		ExtentTriple* etPtr = extents.TripleArray;
 		for ( long i=0; i<n; i++, etPtr++ ) {
 			if ( etPtr->ExtentType != ExtentTriple::TT_MAX ) {
-				totalCosts += (*UserCostFunction)(  etPtr->ObjectID );
+				totalCosts += (*UserCostFunction)( task.GlobalObjectID(etPtr->ObjectID) );
 			}
 		}
 		return totalCosts;
@@ -964,78 +2068,78 @@ double KdTree::CalcTotalCosts( const ExtentTripleArrayInfo& extents ) const
 // ****************************************************************************
 // Code for cost functions
 // ****************************************************************************
-inline void KdTree::InitSplitCostFunction( double minOnAxis, double maxOnAxis, 
+inline void KdTree::InitSplitCostFunction( KdBuildTask& task, double minOnAxis, double maxOnAxis, 
 											double secondAxisLen, double thirdAxisLen,
-											double costToBeat, double totalObjectCosts )
+											double costToBeat, double totalObjectCosts ) const
 {
 	switch ( SplitAlgorithm ) {
 	case MacDonaldBooth:
 	case MacDonaldBoothModifiedCoefs:
 		// MacDonald-Booth method
-		InitMacdonaldBooth( minOnAxis, maxOnAxis, secondAxisLen, thirdAxisLen,
+		InitMacdonaldBooth( task, minOnAxis, maxOnAxis, secondAxisLen, thirdAxisLen,
 							costToBeat,totalObjectCosts);
 		break;
 	case DoubleRecurseGS:
 	case DoubleRecurseModifiedCoefs:
-		InitDoubleRecurse( minOnAxis, maxOnAxis, secondAxisLen, thirdAxisLen,
+		InitDoubleRecurse( task, minOnAxis, maxOnAxis, secondAxisLen, thirdAxisLen,
 							 costToBeat, totalObjectCosts );
 		break;
 	}
 }
 
-inline void KdTree::InitMacdonaldBooth( double minOnAxis, double maxOnAxis, 
+inline void KdTree::InitMacdonaldBooth( KdBuildTask& task, double minOnAxis, double maxOnAxis, 
 										double secondAxisLen, double thirdAxisLen,
-										double costToBeat, double totalObjectCosts )
+										double costToBeat, double totalObjectCosts ) const
 {
-	CF_MinOnAxis = minOnAxis;
-	CF_MaxOnAxis = maxOnAxis;
-	CF_FirstAxisLenInv = 1.0/(maxOnAxis-minOnAxis);
-	CF_OldCost = costToBeat;
-	CF_TotalNodeObjectCosts = totalObjectCosts;
-	CF_EndArea = secondAxisLen*thirdAxisLen;
-	CF_Wrap = 2.0*(maxOnAxis-minOnAxis)*(secondAxisLen+thirdAxisLen);
-	CF_Area = 2.0*CF_EndArea + CF_Wrap;
+	task.CF_MinOnAxis = minOnAxis;
+	task.CF_MaxOnAxis = maxOnAxis;
+	task.CF_FirstAxisLenInv = 1.0/(maxOnAxis-minOnAxis);
+	task.CF_OldCost = costToBeat;
+	task.CF_TotalNodeObjectCosts = totalObjectCosts;
+	task.CF_EndArea = secondAxisLen*thirdAxisLen;
+	task.CF_Wrap = 2.0*(maxOnAxis-minOnAxis)*(secondAxisLen+thirdAxisLen);
+	task.CF_Area = 2.0*task.CF_EndArea + task.CF_Wrap;
 }
 
-inline void KdTree::InitDoubleRecurse( double minOnAxis, double maxOnAxis, 
+inline void KdTree::InitDoubleRecurse( KdBuildTask& task, double minOnAxis, double maxOnAxis, 
 										double secondAxisLen, double thirdAxisLen,
-										double costToBeat, double totalObjectCosts )
-{
-	CF_MinOnAxis = minOnAxis;
-	CF_MaxOnAxis = maxOnAxis;
-	CF_FirstAxisLenInv = 1.0/(maxOnAxis-minOnAxis);
-	CF_OldCost = costToBeat;
-	CF_TotalNodeObjectCosts = totalObjectCosts;
-	CF_LogTNOCinv = 1.0/log(CF_TotalNodeObjectCosts);
-	CF_EndArea = secondAxisLen*thirdAxisLen;
-	CF_Wrap = 2.0*(maxOnAxis-minOnAxis)*(secondAxisLen+thirdAxisLen);
-	CF_Area = 2.0*CF_EndArea + CF_Wrap;
+										double costToBeat, double totalObjectCosts ) const
+{
+	task.CF_MinOnAxis = minOnAxis;
+	task.CF_MaxOnAxis = maxOnAxis;
+	task.CF_FirstAxisLenInv = 1.0/(maxOnAxis-minOnAxis);
+	task.CF_OldCost = costToBeat;
+	task.CF_TotalNodeObjectCosts = totalObjectCosts;
+	task.CF_LogTNOCinv = 1.0/log(task.CF_TotalNodeObjectCosts);
+	task.CF_EndArea = secondAxisLen*thirdAxisLen;
+	task.CF_Wrap = 2.0*(maxOnAxis-minOnAxis)*(secondAxisLen+thirdAxisLen);
+	task.CF_Area = 2.0*task.CF_EndArea + task.CF_Wrap;
 
 	// Calculate double recurse cost exponent to beat
-	if ( CF_EndArea > 1.0e-14*CF_Area ) {
-		CF_D = -CF_Area/(2.0*CF_EndArea);
-		CF_C = 1.0 - CF_D;
-		CF_ExponentToBeat = log((costToBeat-CF_D)/CF_C) * CF_LogTNOCinv;
-		assert ( 0<CF_ExponentToBeat && CF_ExponentToBeat<1.0 );
+	if ( task.CF_EndArea > 1.0e-14*task.CF_Area ) {
+		task.CF_D = -task.CF_Area/(2.0*task.CF_EndArea);
+		task.CF_C = 1.0 - task.CF_D;
+		task.CF_ExponentToBeat = log((costToBeat-task.CF_D)/task.CF_C) * task.CF_LogTNOCinv;
+		assert ( 0<task.CF_ExponentToBeat && task.CF_ExponentToBeat<1.0 );
 	}
 	else {
-		CF_EndArea = 0.0;		// End area is small enough to treat as being exactly zero
+		task.CF_EndArea = 0.0;		// End area is small enough to treat as being exactly zero
 	}
 }
 
-bool KdTree::CalcSplitCost( double splitValue, double costLeft, double costRight, double* retCost )
+bool KdTree::CalcSplitCost( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const
 {
 	switch ( SplitAlgorithm ) {
 	case MacDonaldBooth:
 		// MacDonald-Booth method
-		return CalcMacdonaldBooth( splitValue, costLeft, costRight, retCost );
+		return CalcMacdonaldBooth( task, splitValue, costLeft, costRight, retCost );
 	case MacDonaldBoothModifiedCoefs:
 		// MacDonald-Booth method with modified coefs
-		return CalcMacdonaldBoothModifiedCoefs( splitValue, costLeft, costRight, retCost );
+		return CalcMacdonaldBoothModifiedCoefs( task, splitValue, costLeft, costRight, retCost );
 	case DoubleRecurseGS:
 	case DoubleRecurseModifiedCoefs:
 		// Buss double-recurse method
-		return CalcDoubleRecurseGS( splitValue, costLeft, costRight, retCost );
+		return CalcDoubleRecurseGS( task, splitValue, costLeft, costRight, retCost );
 		break;
 	default:
 		assert(0);
@@ -1043,15 +2147,15 @@ bool KdTree::CalcSplitCost( double splitValue, double costLeft, double costRight
 	}
 }
 
-bool KdTree::CalcMacdonaldBooth( double splitValue, double costLeft, double costRight, double* retCost )
+bool KdTree::CalcMacdonaldBooth( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const
 {
-	double gamma = (splitValue-CF_MinOnAxis)*CF_FirstAxisLenInv;
-	double surfaceAreaLeft = 2.0*CF_EndArea + gamma*CF_Wrap;
-	double surfaceAreaRight = 2.0*CF_EndArea + (1.0-gamma)*CF_Wrap;
-	double newCost = 1.0 + (surfaceAreaLeft*costLeft + surfaceAreaRight*costRight)/CF_Area;
-	if ( newCost<CF_OldCost ) {
+	double gamma = (splitValue-task.CF_MinOnAxis)*task.CF_FirstAxisLenInv;
+	double surfaceAreaLeft = 2.0*task.CF_EndArea + gamma*task.CF_Wrap;
+	double surfaceAreaRight = 2.0*task.CF_EndArea + (1.0-gamma)*task.CF_Wrap;
+	double newCost = 1.0 + (surfaceAreaLeft*costLeft + surfaceAreaRight*costRight)/task.CF_Area;
+	if ( newCost<task.CF_OldCost ) {
 		*retCost = newCost;
-		CF_OldCost = newCost;
+		task.CF_OldCost = newCost;
 		return true;
 	}
 	else {
@@ -1059,22 +2163,22 @@ bool KdTree::CalcMacdonaldBooth( double splitValue, double costLeft, double cost
 	}
 }
 
-bool KdTree::CalcMacdonaldBoothModifiedCoefs( double splitValue, double costLeft, double costRight, double* retCost )
+bool KdTree::CalcMacdonaldBoothModifiedCoefs( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const
 {
-	double gamma = (splitValue-CF_MinOnAxis)*CF_FirstAxisLenInv;
-	double surfaceAreaLeft = 2.0*CF_EndArea + gamma*CF_Wrap;
-	double surfaceAreaRight = 2.0*CF_EndArea + (1.0-gamma)*CF_Wrap;
-	double modFade = CF_TotalNodeObjectCosts/TotalObjectCosts;
+	double gamma = (splitValue-task.CF_MinOnAxis)*task.CF_FirstAxisLenInv;
+	double surfaceAreaLeft = 2.0*task.CF_EndArea + gamma*task.CF_Wrap;
+	double surfaceAreaRight = 2.0*task.CF_EndArea + (1.0-gamma)*task.CF_Wrap;
+	double modFade = task.CF_TotalNodeObjectCosts/TotalObjectCosts;
 	double fracLeft = costLeft/(costLeft+costRight);
 	double fracRight = 1.0-fracLeft;
 	double newCost = 1.0;
-	newCost += (1.0-modFade)*(surfaceAreaLeft*costLeft + surfaceAreaRight*costRight)/CF_Area;
-	newCost += modFade*((fracLeft+fracRight*CF_EndArea/surfaceAreaRight)*costLeft
-						+(fracRight+fracLeft*CF_EndArea/surfaceAreaLeft)*costRight);
+	newCost += (1.0-modFade)*(surfaceAreaLeft*costLeft + surfaceAreaRight*costRight)/task.CF_Area;
+	newCost += modFade*((fracLeft+fracRight*task.CF_EndArea/surfaceAreaRight)*costLeft
+						+(fracRight+fracLeft*task.CF_EndArea/surfaceAreaLeft)*costRight);
 
-	if ( newCost<CF_OldCost ) {
+	if ( newCost<task.CF_OldCost ) {
 		*retCost = newCost;
-		CF_OldCost = newCost;
+		task.CF_OldCost = newCost;
 		return true;
 	}
 	else {
@@ -1082,21 +2186,21 @@ bool KdTree::CalcMacdonaldBoothModifiedCoefs( double splitValue, double costLeft
 	}
 }
 
-bool KdTree::CalcDoubleRecurseGS( double splitValue, double costLeft, double costRight, double* retCost )
+bool KdTree::CalcDoubleRecurseGS( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const
 {
-	double gamma = (splitValue-CF_MinOnAxis)*CF_FirstAxisLenInv;
-	double surfaceAreaLeft = 2.0*CF_EndArea + gamma*CF_Wrap;
-	double surfaceAreaRight = 2.0*CF_EndArea + (1.0-gamma)*CF_Wrap;
-	double A = surfaceAreaLeft/CF_Area;
-	double B = surfaceAreaRight/CF_Area;
-	double alpha = costLeft/CF_TotalNodeObjectCosts;
-	double beta = costRight/CF_TotalNodeObjectCosts;
+	double gamma = (splitValue-task.CF_MinOnAxis)*task.CF_FirstAxisLenInv;
+	double surfaceAreaLeft = 2.0*task.CF_EndArea + gamma*task.CF_Wrap;
+	double surfaceAreaRight = 2.0*task.CF_EndArea + (1.0-gamma)*task.CF_Wrap;
+	double A = surfaceAreaLeft/task.CF_Area;
+	double B = surfaceAreaRight/task.CF_Area;
+	double alpha = costLeft/task.CF_TotalNodeObjectCosts;
+	double beta = costRight/task.CF_TotalNodeObjectCosts;
 	if ( SplitAlgorithm==DoubleRecurseModifiedCoefs ) {
-		double modFade = CF_TotalNodeObjectCosts/TotalObjectCosts;
+		double modFade = task.CF_TotalNodeObjectCosts/TotalObjectCosts;
 		double fracLeft = costLeft/(costLeft+costRight);
 		double fracRight = 1.0-fracLeft;
-		A = Lerp(A, fracLeft+fracRight*CF_EndArea/surfaceAreaRight, modFade);
-		B = Lerp(B, fracRight+fracLeft*CF_EndArea/surfaceAreaLeft, modFade);
+		A = Lerp(A, fracLeft+fracRight*task.CF_EndArea/surfaceAreaRight, modFade);
+		B = Lerp(B, fracRight+fracLeft*task.CF_EndArea/surfaceAreaLeft, modFade);
 	}
 
 	if ( costLeft==0.0 || costRight==0.0 ) {
@@ -1110,24 +2214,24 @@ bool KdTree::CalcDoubleRecurseGS( double splitValue, double costLeft, double cos
 		else {
 			return false;
 		}
-		if ( newCost<CF_OldCost ) {
+		if ( newCost<task.CF_OldCost ) {
 			*retCost = newCost;
-			CF_OldCost = newCost;
-			if ( CF_EndArea!=0.0 ) {
-				CF_ExponentToBeat = log( (newCost-CF_D)/CF_C ) * CF_LogTNOCinv;
-				assert ( 0<CF_ExponentToBeat && CF_ExponentToBeat<1.0 );
+			task.CF_OldCost = newCost;
+			if ( task.CF_EndArea!=0.0 ) {
+				task.CF_ExponentToBeat = log( (newCost-task.CF_D)/task.CF_C ) * task.CF_LogTNOCinv;
+				assert ( 0<task.CF_ExponentToBeat && task.CF_ExponentToBeat<1.0 );
 			}
 			return true;
 		}
 		return false;
 	} 
 
-	if ( CF_EndArea==0.0 ) {
+	if ( task.CF_EndArea==0.0 ) {
 		if ( alpha!=0.0 && beta!=0.0 ) {
-			double newCost = 1.0 - log(CF_TotalNodeObjectCosts)/(A*log(alpha)+B*log(beta));
-			if ( newCost<CF_OldCost ) {
+			double newCost = 1.0 - log(task.CF_TotalNodeObjectCosts)/(A*log(alpha)+B*log(beta));
+			if ( newCost<task.CF_OldCost ) {
 				*retCost = newCost;
-				CF_OldCost = newCost;
+				task.CF_OldCost = newCost;
 				return true;
 			}
 		}
@@ -1136,26 +2240,320 @@ bool KdTree::CalcDoubleRecurseGS( double splitValue, double costLeft, double cos
 
 	double C, D;
 	double newExponent;
-	bool betterCost = FindDoubleRecurseSoln( A, B, alpha, beta, &C, &newExponent, &D, CF_ExponentToBeat );
+	bool betterCost = FindDoubleRecurseSoln( A, B, alpha, beta, &C, &newExponent, &D, task.CF_ExponentToBeat );
 	if ( betterCost ) {
-		CF_ExponentToBeat = newExponent;
-		assert ( 0<CF_ExponentToBeat && CF_ExponentToBeat<1.0 );
-		CF_OldCost = C * pow(CF_TotalNodeObjectCosts,newExponent) + D;
-		*retCost = CF_OldCost;
+		task.CF_ExponentToBeat = newExponent;
+		assert ( 0<task.CF_ExponentToBeat && task.CF_ExponentToBeat<1.0 );
+		task.CF_OldCost = C * pow(task.CF_TotalNodeObjectCosts,newExponent) + D;
+		*retCost = task.CF_OldCost;
 		return true;
 	}
 
 	return false;
 }
 
-void KdTree::MemoryError()
+/***********************************************************************************************
+ * Saving and loading the tree.
+ *   The file has a KdTreeFileHeader, followed by the packed nodes,
+ *	 followed by the leaf object list.
+ ***********************************************************************************************/
+
+class KdTreeFileHeader {
+public:
+	char Magic[8];					// "KdTree" followed by two zero bytes
+	unsigned int Version;			// KdTree::FileVersion
+	unsigned int NodeSize;			// sizeof(KdPackedNode)
+	unsigned int ObjectIdSize;		// sizeof(long)
+	int SplitAlgorithm;
+	int NumSplitBins;
+	int UseConstantCost;
+	double ObjectConstantCost;
+	double StoppingCostPerRay;
+	unsigned long long ExtentsHash;
+	long long NumObjects;
+	long long NumPackedNodes;
+	long long LeafObjectListSize;
+	double TotalObjectCosts;
+	double BoundingBox[6];			// Min x,y,z then max x,y,z
+};
+
+static const char KdTreeFileMagic[8] = { 'K', 'd', 'T', 'r', 'e', 'e', 0, 0 };
+
+// A read-only mapping of an entire file into memory.
+class KdTreeFileMapping {
+public:
+	KdTreeFileMapping();
+	~KdTreeFileMapping();
+	bool Open( const char* fileName );		// Returns false if the file cannot be mapped.
+
+	const char* Data;			// Start of the mapped file
+	size_t Size;				// Size of the file in bytes
+
+private:
+#if defined(_WIN32)
+	HANDLE FileHandle;
+	HANDLE MappingHandle;
+#endif
+};
+
+KdTreeFileMapping::KdTreeFileMapping()
+{
+	Data = 0;
+	Size = 0;
+#if defined(_WIN32)
+	FileHandle = INVALID_HANDLE_VALUE;
+	MappingHandle = 0;
+#endif
+}
+
+#if defined(_WIN32)
+
+bool KdTreeFileMapping::Open( const char* fileName )
+{
+	FileHandle = CreateFileA( fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 
+							  FILE_ATTRIBUTE_NORMAL, 0 );
+	if ( FileHandle == INVALID_HANDLE_VALUE ) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( FileHandle, &fileSize ) || fileSize.QuadPart==0 ) {
+		return false;
+	}
+	MappingHandle = CreateFileMappingA( FileHandle, 0, PAGE_READONLY, 0, 0, 0 );
+	if ( MappingHandle == 0 ) {
+		return false;
+	}
+	Data = (const char*)MapViewOfFile( MappingHandle, FILE_MAP_READ, 0, 0, 0 );
+	Size = (size_t)fileSize.QuadPart;
+	return ( Data != 0 );
+}
+
+KdTreeFileMapping::~KdTreeFileMapping()
+{
+	if ( Data ) {
+		UnmapViewOfFile( Data );
+	}
+	if ( MappingHandle ) {
+		CloseHandle( MappingHandle );
+	}
+	if ( FileHandle != INVALID_HANDLE_VALUE ) {
+		CloseHandle( FileHandle );
+	}
+}
+
+#else
+
+bool KdTreeFileMapping::Open( const char* fileName )
+{
+	int fd = open( fileName, O_RDONLY );
+	if ( fd<0 ) {
+		return false;
+	}
+	struct stat fileStat;
+	if ( fstat( fd, &fileStat )!=0 || fileStat.st_size==0 ) {
+		close( fd );
+		return false;
+	}
+	void* mapped = mmap( 0, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );				// The mapping stays valid after the file is closed.
+	if ( mapped == MAP_FAILED ) {
+		return false;
+	}
+	Data = (const char*)mapped;
+	Size = (size_t)fileStat.st_size;
+	return true;
+}
+
+KdTreeFileMapping::~KdTreeFileMapping()
+{
+	if ( Data ) {
+		munmap( (void*)Data, Size );
+	}
+}
+
+#endif  // defined(_WIN32)
+
+static void DeleteFileMapping( KdTreeFileMapping* mapping )
+{
+	delete mapping;
+}
+
+// Checks the packed nodes and object list of a mapped file before they are used:  the
+//	 traversals index them without checking.  Every node must be reached from the root
+//	 exactly once, at a depth of at most MaxTreeDepth (so the traversal stacks cannot
+//	 overflow), and every leaf's objects must lie in the object list and be valid object numbers.
+static bool CheckMappedTree( const KdPackedNode* nodes, long numNodes, 
+							 const long* objectList, long objectListSize, long numObjects )
+{
+	for ( long i=0; i<objectListSize; i++ ) {
+		if ( objectList[i]<0 || objectList[i]>=numObjects ) {
+			return false;
+		}
+	}
+
+	unsigned char* reached = new unsigned char[numNodes];
+	memset( reached, 0, numNodes );
+	long stackNode[KdTree::MaxTreeDepth+1];		// Depth first:  at most one pending node per depth, plus one
+	int stackDepth[KdTree::MaxTreeDepth+1];
+	int stackSize = 1;
+	stackNode[0] = 0;
+	stackDepth[0] = 0;
+	bool ok = true;
+	while ( ok && stackSize>0 ) {
+		stackSize--;
+		long nodeIdx = stackNode[stackSize];
+		int depth = stackDepth[stackSize];
+		if ( reached[nodeIdx] ) {
+			ok = false;
+			break;
+		}
+		reached[nodeIdx] = 1;
+		const KdPackedNode& node = nodes[nodeIdx];
+		if ( node.IsLeaf() ) {
+			long numLeafObjects = node.GetNumObjects();
+			long firstIdx = node.FirstObjectIndex();
+			ok = ( numLeafObjects>=0 && firstIdx<=objectListSize && numLeafObjects<=objectListSize-firstIdx );
+		}
+		else {
+			long leftIdx = node.LeftChildIndex();
+			ok = ( depth<KdTree::MaxTreeDepth && leftIdx<numNodes-1 );
+			if ( ok ) {
+				assert ( stackSize+2 <= KdTree::MaxTreeDepth+1 );
+				stackNode[stackSize] = leftIdx+1;
+				stackDepth[stackSize] = depth+1;
+				stackNode[stackSize+1] = leftIdx;
+				stackDepth[stackSize+1] = depth+1;
+				stackSize += 2;
+			}
+		}
+	}
+	delete[] reached;
+	return ok;
+}
+
+bool KdTree::Save( const char* fileName ) const
+{
+	assert ( NumPackedNodes>0 );
+	KdTreeFileHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.Magic, KdTreeFileMagic, sizeof(header.Magic) );
+	header.Version = FileVersion;
+	header.NodeSize = sizeof(KdPackedNode);
+	header.ObjectIdSize = sizeof(long);
+	header.SplitAlgorithm = (int)SplitAlgorithm;
+	header.NumSplitBins = NumSplitBins;
+	header.UseConstantCost = UseConstantCost ? 1 : 0;
+	header.ObjectConstantCost = UseConstantCost ? ObjectConstantCost : 0.0;
+	header.StoppingCostPerRay = StoppingCostPerRay;
+	header.ExtentsHash = ExtentsHash;
+	header.NumObjects = NumObjects;
+	header.NumPackedNodes = NumPackedNodes;
+	header.LeafObjectListSize = LeafObjectListSize;
+	header.TotalObjectCosts = TotalObjectCosts;
+	for ( int i=0; i<3; i++ ) {
+		header.BoundingBox[i] = BoundingBox.GetBoxMin()[i];
+		header.BoundingBox[i+3] = BoundingBox.GetBoxMax()[i];
+	}
+
+	// Write a temporary file, then rename it to fileName.  A tree already loaded from fileName
+	//	 keeps the old file mapped:  truncating the old file in place would fault its readers.
+	size_t nameLength = strlen( fileName );
+	char* tempName = new char[nameLength+5];
+	memcpy( tempName, fileName, nameLength );
+	memcpy( tempName+nameLength, ".tmp", 5 );
+	FILE* outFile = fopen( tempName, "wb" );
+	if ( !outFile ) {
+		delete[] tempName;
+		return false;
+	}
+	bool ok = ( fwrite( &header, sizeof(header), 1, outFile ) == 1 )
+			&& ( fwrite( PackedNodes, sizeof(KdPackedNode), NumPackedNodes, outFile ) == (size_t)NumPackedNodes )
+			&& ( fwrite( LeafObjectList, sizeof(long), LeafObjectListSize, outFile ) == (size_t)LeafObjectListSize );
+	ok = ( fclose( outFile ) == 0 ) && ok;
+#if defined(_WIN32)
+	ok = ok && MoveFileExA( tempName, fileName, MOVEFILE_REPLACE_EXISTING );
+#else
+	ok = ok && ( rename( tempName, fileName ) == 0 );
+#endif
+	if ( !ok ) {
+		remove( tempName );
+	}
+	delete[] tempName;
+	return ok;
+}
+
+bool KdTree::LoadMapped( const char* fileName, long numObjects, ExtentFunction* extentFunc )
+{
+	assert ( TreeSize() == 0 && NumPackedNodes == 0 );
+	KdTreeFileMapping* mapping = new KdTreeFileMapping();
+	if ( !mapping->Open( fileName ) || mapping->Size < sizeof(KdTreeFileHeader) ) {
+		delete mapping;
+		return false;
+	}
+
+	// Check that the file is a tree for the same objects, built with the same settings.
+	const KdTreeFileHeader& header = *(const KdTreeFileHeader*)mapping->Data;
+	// The counts are checked against the file size before they are multiplied, so nothing overflows.
+	size_t bodySize = mapping->Size - sizeof(KdTreeFileHeader);
+	bool ok = ( memcmp( header.Magic, KdTreeFileMagic, sizeof(header.Magic) ) == 0 )
+			&& header.Version == FileVersion
+			&& header.NodeSize == sizeof(KdPackedNode)
+			&& header.ObjectIdSize == sizeof(long)
+			&& header.SplitAlgorithm == (int)SplitAlgorithm
+			&& header.NumSplitBins == NumSplitBins
+			&& header.UseConstantCost == (UseConstantCost ? 1 : 0)
+			&& header.ObjectConstantCost == (UseConstantCost ? ObjectConstantCost : 0.0)
+			&& header.StoppingCostPerRay == StoppingCostPerRay
+			&& header.NumObjects == numObjects
+			&& header.NumPackedNodes > 0 && header.NumPackedNodes <= LONG_MAX
+			&& header.LeafObjectListSize >= 0 && header.LeafObjectListSize <= LONG_MAX
+			&& (unsigned long long)header.NumPackedNodes <= bodySize/sizeof(KdPackedNode)
+			&& (unsigned long long)header.LeafObjectListSize <= bodySize/sizeof(long)
+			&& bodySize == (size_t)header.NumPackedNodes*sizeof(KdPackedNode) 
+						   + (size_t)header.LeafObjectListSize*sizeof(long);
+	if ( ok ) {
+		unsigned long long hash = HashExtentsStart( numObjects );
+		AABB objectAabb;
+		for ( long i=0; i<numObjects; i++ ) {
+			(*extentFunc)( i, objectAabb );
+			hash = HashExtents( hash, objectAabb );
+		}
+		ok = ( hash == header.ExtentsHash );
+	}
+	if ( ok ) {
+		const char* nodeData = mapping->Data + sizeof(KdTreeFileHeader);
+		long numNodes = (long)header.NumPackedNodes;
+		ok = CheckMappedTree( (const KdPackedNode*)nodeData, numNodes,
+							  (const long*)(nodeData + numNodes*sizeof(KdPackedNode)),
+							  (long)header.LeafObjectListSize, numObjects );
+	}
+	if ( !ok ) {
+		delete mapping;
+		return false;
+	}
+
+	FileMapping = mapping;
+	NumObjects = numObjects;
+	ExtentsHash = header.ExtentsHash;
+	TotalObjectCosts = header.TotalObjectCosts;
+	BoundingBox.Set( VectorR3( header.BoundingBox[0], header.BoundingBox[1], header.BoundingBox[2] ),
+					 VectorR3( header.BoundingBox[3], header.BoundingBox[4], header.BoundingBox[5] ) );
+	NumPackedNodes = (long)header.NumPackedNodes;
+	LeafObjectListSize = (long)header.LeafObjectListSize;
+	// The tree is never changed after it is built, so it can use the read-only mapping directly.
+	PackedNodes = (KdPackedNode*)(mapping->Data + sizeof(KdTreeFileHeader));
+	LeafObjectList = (long*)(mapping->Data + sizeof(KdTreeFileHeader) + NumPackedNodes*sizeof(KdPackedNode));
+	return true;
+}
+
+void KdTree::MemoryError() const
 {
 	assert(0);
 	fprintf(stderr,"KdTree construction: Failed to allocate memory.\n");
 	exit(0);
 }
 
-void KdTree::MemoryError2()
+void KdTree::MemoryError2() const
 {
 	assert(0);
 	fprintf(stderr,"KdTree: Memory overflow. Need to increase storage multiplier.\n");
@@ -33,20 +33,45 @@
 #ifndef KDTREE_H
 #define KDTREE_H
 
+#include <string.h>
 #include "../DataStructs/ShellSort.h"
+#include "../DataStructs/RadixSort.h"
 #include "../DataStructs/Array.h"
 #include "../DataStructs/Stack.h"
 #include "../VrMath/Aabb.h"
 class RayTraceStats;	// Statistics for KdTree traversal
 
+// Set TrackKdTraversals to 0 to compile out the counting of the nodes, leaves
+//	 and objects visited by traversals.  RayTraceStats.h uses the same setting.
+#ifndef TrackKdTraversals
+#define TrackKdTraversals 1
+#endif
+
+// KD_PACKET_RAYS is the number of rays in a full packet for KdTree::TraversePacket:  
+//	 4 (the default) or 8.  Each four rays use one AVX register, or two SSE2 registers.
+//	 RayTraceView traces the four primary rays of a pixel as one packet, so only its
+//	 wavefront mode fills packets of 8.
+#ifndef KD_PACKET_RAYS
+#define KD_PACKET_RAYS 4
+#endif
+#if KD_PACKET_RAYS!=4 && KD_PACKET_RAYS!=8
+#error "KD_PACKET_RAYS must be 4 or 8."
+#endif
+
 class KdTree;			// kd-tree.
-class KdTreeNode;		// A single node in the kd-tree.
+class KdTreeNode;		// A single node in the kd-tree, as used while building the tree.
+class KdPackedNode;		// A single node in the kd-tree, in the compact form used for traversal.
 
 class Kd_TraverseNodeData;			// Holds information on a single node needing traversal.
+class KdTraverseScratch;			// Caller-supplied working storage for a traversal.
+class KdPacketScratch;				// Caller-supplied working storage for a packet traversal.
 
 // Next classes used only for creating tree
 class ExtentTriple;				// A extent triples: a single max, min, or flat value
 class ExtentTripleArrayInfo;	// Information about array of extent triples.
+class KdSplitBin;				// Totals for one bin, for binned split selection.
+class KdBuildTask;				// One piece of the tree build, with its own working storage.
+class KdTreeFileMapping;		// A tree file mapped into memory by LoadMapped.
 
 // Three callback routines that aid in tree building:
 //     ExtentFunction returns bounding box (an AABB) enclosing the object.
@@ -54,6 +79,11 @@ typedef void ExtentFunction( long objectNum, AABB& boundingBox );
 //     ExtentInBoxFunction returns a AABB that encloses the intersection of the object and the clippingBox.
 //	   Returns the "boundingBox" and returns true if the box is non-empty.
 typedef bool ExtentInBoxFunction( long objectNum, const AABB& clippingBox, AABB& boundingBox );
+//     Same as ExtentFunction and ExtentInBoxFunction, but also receive the userData pointer given to BuildTree.
+//	   This lets the caller keep its objects in its own object, instead of in global variables,
+//		so that several trees can be built at once.
+typedef void ExtentDataFunction( long objectNum, AABB& boundingBox, void* userData );
+typedef bool ExtentInBoxDataFunction( long objectNum, const AABB& clippingBox, AABB& boundingBox, void* userData );
 //     Returns the cost of testing an intersection against an object.
 typedef double ObjectCostFunction( long objectNum );
 
@@ -67,6 +97,12 @@ typedef bool PotentialObjectCallback( long objectNum, double* retStopDistance );
 //	  The list is sorted by objectNums.  
 //	  Return code is "true" if the returned stop distance is relevant
 typedef bool PotentialObjectsListCallback( int numberOfObjects, long* objectNums, double* retStopDistance );
+//    Same as PotentialObjectCallback, but also receives the userData pointer given to Traverse.
+//    This lets the caller keep its per-ray state in its own object, instead of in global variables,
+//		so that several rays can be traced at once.
+typedef bool PotentialObjectDataCallback( long objectNum, double* retStopDistance, void* userData );
+//    Used by Occluded.  Returns true if the object blocks the ray.
+typedef bool OcclusionCallback( long objectNum, void* userData );
 
 enum KD_SplittingAxis {
 	KD_SPLIT_X = 0,
@@ -96,26 +132,74 @@ public:
 	//	 startPos - beginning of the ray.
 	//	 dir - direction of the ray.
 	//   Returns "true" if traversal aborted by the callback function returning "true"
+	// Several threads may traverse the same tree at once.
+	// The first two forms use a scratch area private to the calling thread.
+	// The last form uses the caller's scratch area, and does no memory allocation.
+	//	  The scratch area may be reused for any number of traversals, 
+	//	  but must not be used by two traversals at the same time.
+	bool Traverse( const VectorR3& startPos, const VectorR3& dir, 
+					PotentialObjectCallback* pocFunc, double seekDistance = 0.0, bool useSeekDistance = false ) const;
 	bool Traverse( const VectorR3& startPos, const VectorR3& dir, 
-					PotentialObjectCallback* pocFunc, double seekDistance = 0.0, bool useSeekDistance = false );
+					PotentialObjectsListCallback* polcFunc, double seekDistance = 0.0, bool useSeekDistance = false ) const;
 	bool Traverse( const VectorR3& startPos, const VectorR3& dir, 
-					PotentialObjectsListCallback* polcFunc, double seekDistance = 0.0, bool useSeekDistance = false );
+					PotentialObjectDataCallback* podcFunc, void* userData, KdTraverseScratch& scratch,
+					double seekDistance = 0.0, bool useSeekDistance = false ) const;
+
+	// Occluded: any-hit traversal, for shadow feelers.
+	//	 Calls occlusionFunc for the objects in the leaves the ray meets before 
+	//	 distance maxDistance.  Returns true as soon as occlusionFunc returns true,
+	//	 without calling back the rest of the objects.  Returns false if no object blocks the ray.
+	//	 The scratch area is used as by Traverse.
+	bool Occluded( const VectorR3& startPos, const VectorR3& dir, double maxDistance,
+				   OcclusionCallback* occlusionFunc, void* userData, KdTraverseScratch& scratch ) const;
+
+	// TraversePacket: traverses a packet of up to KdPacketScratch::MaxRays rays together.
+	//	 startPos[r], dir[r] - the r-th ray.  userData[r] is passed to podcFunc for the r-th ray.
+	//	 seekDistance - if not null, seekDistance[r] limits the r-th ray, as for Traverse.
+	// The rays go down the tree together, with the split distances of all the rays
+	//	 computed at once by SSE2 (or AVX) instructions.  A ray visits the same leaves,
+	//	 in the same order, as it would with Traverse.  This requires the directions of
+	//	 the rays to have the same signs:  if they do not, or if a ray is parallel 
+	//	 to an axis, the packet is split up and each ray is traversed by itself.
+	// Returns a bit mask: bit r is set if Traverse would return "true" for the r-th ray.
+	int TraversePacket( int numRays, const VectorR3* startPos, const VectorR3* dir,
+						PotentialObjectDataCallback* podcFunc, void* const* userData,
+						KdPacketScratch& scratch, const double* seekDistance = 0 ) const;
 
 	// ******** Accessors ****************
-	const KdTreeNode& GetNode( long i ) const;
+	// The nodes are in packed form.  The root node has index 0.
+	const KdPackedNode& GetNode( long i ) const;
+	const long* GetLeafObjectList( const KdPackedNode& leafNode ) const;
     const AABB& GetBoundingBox() const { return BoundingBox; }
 
-	void ResetStats();
-	void Stats_ObjectsInLeaves( long objNum = 1 );
-	void Stats_NodeTraversed();
-	void Stats_LeafTraversed();
-	void Stats_GetAll( long* numNodes, long* numNonEmptyLeaves, long* numObjsInLeaves ) const;
+	// ****** Saving and loading the tree ******
+	// Save writes the finished tree to a binary file, in the packed form used for
+	//	 traversal.  Returns false if the file could not be written.
+	// LoadMapped maps a file written by Save into memory, and uses it in place of 
+	//	 calling BuildTree.  The nodes and object lists are used where they lie in the
+	//	 mapped file, without being copied.  The file stays mapped until the tree is destroyed.
+	//	 The file is rejected, and false is returned, if it has a different version,
+	//	 was built with different build settings (set these before calling LoadMapped),
+	//	 or if its hash of the object extents differs from the hash of the extents
+	//	 now returned by extentFunc.  After a false return, BuildTree may still be called.
+	// The file is in the native byte order, and holds the object numbers as longs.
+	bool Save( const char* fileName ) const;
+	bool LoadMapped( const char* fileName, long numObjects, ExtentFunction* extentFunc );
+	const static unsigned int FileVersion = 1;
 
 private:
-	bool Traverse( const VectorR3& startPos, const VectorR3& dir, double seekDistance = 0.0, bool useSeekDistance = false );
+	enum CallbackType {
+		KD_CALLBACK_OBJECT,			// PotentialObjectCallback
+		KD_CALLBACK_OBJECT_LIST,	// PotentialObjectsListCallback
+		KD_CALLBACK_OBJECT_DATA		// PotentialObjectDataCallback
+	};
+	bool Traverse( const VectorR3& startPos, const VectorR3& dir, 
+					void* callbackFunction, CallbackType callbackType, void* userData,
+					KdTraverseScratch& scratch, double seekDistance, bool useSeekDistance ) const;
 
-	void ResetInvokeCallback();
-	void InvokeCallback( const KdTreeNode* leafNode, bool& retStopDistanceActive, double& retStopDistance );
+	void InvokeCallback( const KdPackedNode* leafNode, void* callbackFunction, CallbackType callbackType, void* userData,
+						 KdTraverseScratch& scratch, bool& retStopDistanceActive, double& retStopDistance ) const;
+	long NonEmptyChild( long packedIdx ) const;	// Returns -1 if the node is an empty leaf
 
 public:
 	// ****** Tree building routines *******
@@ -136,6 +220,16 @@ public:
 	void SetMacdonaldBoothSplitting( bool useModifiedCoefs = false );	
 	void SetDoubleRecurseSplitting( bool useModifiedCoefs = false );
 
+	// Set how the candidate split values are chosen.
+	// By default, every object extent is tried as a split value (the exact method).
+	//	 This requires keeping the extents sorted, which is slow for big scenes.
+	// SetBinnedSplitting divides each axis of a node into numBins equal bins, and
+	//	 tries only the bin boundaries, so the extents need not be sorted.  
+	//	 Nodes with few objects still use the exact method.
+	//	 The cost function set above is still used to compare the splits.
+	void SetBinnedSplitting( int numBins = 32 );
+	void SetExactSplitting();
+
 	// Set the stopping criterion
 	//   numAccesses means the benefit required to justify adding a new tree node.
 	//		The "benefit" is measured in terms of time savings, the time saved is
@@ -147,31 +241,48 @@ public:
 	//  Default values are 1,000,000 and 4.0.
 	void SetStoppingCriterion( long numRays, double numAccesses );
 
-	// Can call BuildTree at most once.
+	// Set the number of threads used by BuildTree.
+	//   numThreads == 1 builds the whole tree in the calling thread (the default).
+	//	 numThreads == 0 means use one thread per hardware thread.
+	// A parallel build first builds the top of the tree, down to subtrees
+	//	 with few enough objects.  These subtrees are then built at the same time,
+	//	 each with its own nodes and extent lists, and finally merged into the tree.
+	//	 The resulting tree is the same as for a serial build, except that a subtree
+	//	 never gets more extent list storage than it would have in a tree of its own.
+	// The callback functions must be safe to call from several threads at once.
+	void SetBuildThreads( int numThreads );
+
+	// Can call BuildTree at most once, unless DeleteTree is called in between.
+	// BuildTree finishes by packing the tree into the compact form used for traversal.
 	void BuildTree( long numObject, ExtentFunction* extentFunc, ExtentInBoxFunction* extentInBoxFunc );
+	//	 Same, but userData is passed to the extent functions.
+	void BuildTree( long numObject, ExtentDataFunction* extentFunc, ExtentInBoxDataFunction* extentInBoxFunc,
+					void* userData );
+	// Delete the tree (built or loaded), keeping the build settings.
+	void DeleteTree();
 
 	const static int ExtentTripleStorageMultiplier  = 4;	// m/(1-m) where m is the overlapping fraction expected
+	const static int MaxTreeDepth = 64;		// Deeper nodes are made into leaves.  Bounds the traversal stack.
+	const static long MinBuildTaskObjects = 256;	// Smallest subtree worth building as a separate task
 
 	long NumObjects;	// Number of objects stored in the tree (not counting duplications)
 	double TotalObjectCosts;	// Total cost of all objects in the tree
 
 private:
-	long TreeSize() const { return TreeNodes.SizeUsed(); }		// Number of nodes in the tree
+	long TreeSize() const { return TreeNodes.SizeUsed(); }		// Number of nodes in the tree being built
 
-	Array<KdTreeNode> TreeNodes;
+	Array<KdTreeNode> TreeNodes;		// Only used while building the tree
 	long RootIndex() const { return 0; }	// Index for the first entry in the array.
-	long NextIndex();		// Preallocate the next entry ahead of time.
 
-	AABB BoundingBox;			// An AABB that encloses the entire tree
-
-	// Traversal helper data
-	bool UseListCallback;		// True for the "List" callback traversal
-	void* CallbackFunction;		// Either PotentialObjectCallback* or PotentialObjectsListCallback*
+	// The finished tree, in packed form.
+	KdPackedNode* PackedNodes;			// The root is PackedNodes[0].  
+	long NumPackedNodes;
+	long* LeafObjectList;				// The object lists of all the leaves, one after the other
+	long LeafObjectListSize;
 
-	// Traversal statistics
-	long Stats_NumberKdNodesTraversed;
-	long Stats_NumberKdLeavesTraversed;
-	long Stats_NumberKdObjectsInLeaves;
+	AABB BoundingBox;			// An AABB that encloses the entire tree
+	unsigned long long ExtentsHash;		// Hash of the object extents the tree was built for
+	KdTreeFileMapping* FileMapping;		// The mapped file, if the tree was loaded by LoadMapped
 
 
 	// Following items are used only while building the tree.
@@ -183,8 +294,11 @@ private:
 	};
 
 	SplitAlgorithmType SplitAlgorithm;	// Which split cost function to use.
+	int NumSplitBins;					// Number of bins per axis, or zero for the exact method.
+	const static int BinnedMinTriplesPerBin = 8;	// Nodes with fewer triples use the exact method.
 
 	double StoppingCostPerRay;				// Improved cost/ray needed to justify adding tree node
+	int NumBuildThreads;					// Number of threads used by BuildTree
 
 	bool UseConstantCost;
 	double ObjectConstantCost;
@@ -192,67 +306,80 @@ private:
 	ObjectCostFunction* UserCostFunction;
 
 	// Temporary data used only while building the kd-tree.
+	//   The working storage for the build is held in the KdBuildTask's.
+	//   Either ExtentFunc and ExtentInBoxFunc are set, or ExtentDataFunc and ExtentInBoxDataFunc.
 	ExtentFunction* ExtentFunc;	// Function for calculating the extents. 
 	ExtentInBoxFunction* ExtentInBoxFunc;	// For extents within a box
-	AABB* ObjectAABBs;			// Holds extents (and extents in boxes) for each object.
-	ExtentTriple* ET_Lists;		// Tons of storage for extent lists.
+	ExtentDataFunction* ExtentDataFunc;
+	ExtentInBoxDataFunction* ExtentInBoxDataFunc;
+	void* ExtentUserData;		// Passed to ExtentDataFunc and ExtentInBoxDataFunc
 	double BoundingBoxSurfaceArea;	// Surface area of the tree's bounding box
-	unsigned char* LeftRightStatus;		// Info on whether objects go left or right in split.
+
+	void BuildTreeWithExtents( long numObjects );		// Does BuildTree, once the extent functions are set
+	void CalcObjectExtents( long objectNum, AABB& boundingBox ) const;
+	bool CalcObjectExtentsInBox( long objectNum, const AABB& clippingBox, AABB& boundingBox ) const;
 
 	// Routines used for building the tree
-	void BuildSubTree( long baseIndex, AABB& aabb, double totalObjectCost,
+	//   They change only the task, so different tasks may be built at the same time.
+	void BuildSubTree( KdBuildTask& task, long baseIndex, int depth, AABB& aabb, double totalObjectCost,
 					ExtentTripleArrayInfo& xExtents, ExtentTripleArrayInfo& yExtents, 
-					ExtentTripleArrayInfo& zExtents, long spaceAvailable );
-	void CalcBestSplit( const AABB& aabb, const VectorR3& deltaAABB, double totalObjectCost, 
+					ExtentTripleArrayInfo& zExtents, long spaceAvailable ) const;
+	void DeferSubTree( KdBuildTask& task, long baseIndex, int depth, const AABB& aabb, double totalObjectCost,
 					const ExtentTripleArrayInfo& xExtents, const ExtentTripleArrayInfo& yExtents, 
-					const ExtentTripleArrayInfo& zExtents,
+					const ExtentTripleArrayInfo& zExtents, long spaceAvailable ) const;
+	static void RunBuildTask( long jobNum, int threadNum, void* userData );
+	void MergeSubtreeTask( const KdBuildTask& subtreeTask );
+	void CalcBestSplit( KdBuildTask& task, const AABB& aabb, const VectorR3& deltaAABB, double totalObjectCost, 
+					const ExtentTripleArrayInfo& xExtents, const ExtentTripleArrayInfo& yExtents, 
+					const ExtentTripleArrayInfo& zExtents, bool useBins,
 					KD_SplittingAxis* splitAxisID, double* splitValue, 
 					long* numTriplesToLeft, long* numObjectsToLeft, long* numObjectsToRight, 
-					double* costObjectsToLeft, double* costObjectsToRight );
-	bool CalcBestSplit( double totalObjectCost, double costToBeat, 
-						const ExtentTripleArrayInfo& extents, 
+					double* costObjectsToLeft, double* costObjectsToRight ) const;
+	bool CalcBestSplit( KdBuildTask& task, double totalObjectCost, double costToBeat, 
+						const ExtentTripleArrayInfo& extents, bool useBins,
 						double minOnAxis, double maxOnAxis, 
 						double secondAxisLen, double thirdAxisLen,
 						double* newBestCost, double* splitValue, 
 						long* numTriplesToLeft, long* numObjectsToLeft, long* numObjectsToRight,
-						double* costObjectsToLeft, double* costObjectsToRight );
-	void MakeAabbsForSubtree( unsigned char leftRightFlag, const ExtentTripleArrayInfo& theExtents,
-								const AABB& theAabb );
-	void CopyTriplesForSubtree( unsigned char leftRightFlag, int axisNumber,
+						double* costObjectsToLeft, double* costObjectsToRight ) const;
+	bool CalcBestSplitBinned( KdBuildTask& task, double totalObjectCost, const ExtentTripleArrayInfo& extents, 
+						double minOnAxis, double maxOnAxis,
+						double* newBestCost, double* splitValue, 
+						long* numTriplesToLeft, long* numObjectsToLeft, long* numObjectsToRight,
+						double* costObjectsToLeft, double* costObjectsToRight ) const;
+	void MakeLeaf( KdBuildTask& task, long baseIndex, const ExtentTripleArrayInfo& xExtents, 
+					const ExtentTripleArrayInfo& yExtents, const ExtentTripleArrayInfo& zExtents ) const;
+	double ObjectCost( long objectID ) const;
+	void MakeAabbsForSubtree( KdBuildTask& task, unsigned char leftRightFlag, const ExtentTripleArrayInfo& theExtents,
+								const AABB& theAabb ) const;
+	void CopyTriplesForSubtree( KdBuildTask& task, unsigned char leftRightFlag, int axisNumber,
 										ExtentTripleArrayInfo& fromExtents, 
-										ExtentTripleArrayInfo& toExtents ); 
-	void UpdateLeftRightCosts( const ExtentTriple& et, long* numObjectsLeft, long* numObjectsRight, 
-							   double *costLeft, double *costRight );
-	double CalcTotalCosts( const ExtentTripleArrayInfo& extents ) const;
-
-	// Routines and data used for split-cost-functions.  
-	// Only needed while building a kd-Tree.
+										ExtentTripleArrayInfo& toExtents ) const; 
+	void UpdateLeftRightCosts( const KdBuildTask& task, const ExtentTriple& et, long* numObjectsLeft, long* numObjectsRight, 
+							   double *costLeft, double *costRight ) const;
+	double CalcTotalCosts( const KdBuildTask& task, const ExtentTripleArrayInfo& extents ) const;
+	void SortTriples( KdBuildTask& task, ExtentTripleArrayInfo& extents ) const;
+
+	// Routines that pack the tree once it has been built.
+	void FinalizeTree();
+	void PackSubtree( long buildIdx, long packedIdx, long* nextPackedIdx, long* nextObjectIdx );
+	void DeleteBuildNodes();
+
+	// Routines used for split-cost-functions.  Their data is kept in the KdBuildTask.
 	//  CF = cost function.  
-	double CF_MinOnAxis;			// Starting value for first axis
-	double CF_MaxOnAxis;			// Ending value for first axis
-	double CF_FirstAxisLenInv;		// One divided by length of first axis
-	double CF_OldCost;				// Cost to beat
-	double CF_TotalNodeObjectCosts;	// Total cost of all objects in current node
-	double CF_LogTNOCinv;			// 1.0 over log(CF_TotalNodeObjectCosts)
-	double CF_Area;					// Area of the node
-	double CF_EndArea;				// Surface area of one end (side face) of the node combined.
-	double CF_Wrap;					// Surface area of "wrap" portion of the node.
-	double CF_C, CF_D;				// C and D coefs for the Buss double recurse method
-	double CF_ExponentToBeat;		// Exponent to beat for double recurse method
-	void InitSplitCostFunction( double minOnAxis, double maxOnAxis, double secondAxisLen, double thirdAxisLen,
-								double costToBeat, double totalObjectCosts );
-	void InitMacdonaldBooth( double minOnAxis, double maxOnAxis, double secondAxisLen, double thirdAxisLen,
-								double costToBeat, double totalObjectCosts );
-	void InitDoubleRecurse( double minOnAxis, double maxOnAxis, double secondAxisLen, double thirdAxisLen,
-								double costToBeat, double totalObjectCosts );
-	bool CalcSplitCost( double splitValue, double costLeft, double costRight, double* retCost );
-	bool CalcMacdonaldBooth( double splitValue, double costLeft, double costRight, double* retCost );
-	bool CalcMacdonaldBoothModifiedCoefs( double splitValue, double costLeft, double costRight, double* retCost );
-	bool CalcDoubleRecurseGS( double splitValue, double costLeft, double costRight, double* retCost );
-	bool CalcDoubleRecurseModifiedCoefs( double splitValue, double costLeft, double costRight, double* retCost );
-
-	void MemoryError();					// If allocation of memory fails.
-	void MemoryError2();				// If storage multiplier did not give enough memory
+	void InitSplitCostFunction( KdBuildTask& task, double minOnAxis, double maxOnAxis, double secondAxisLen, double thirdAxisLen,
+								double costToBeat, double totalObjectCosts ) const;
+	void InitMacdonaldBooth( KdBuildTask& task, double minOnAxis, double maxOnAxis, double secondAxisLen, double thirdAxisLen,
+								double costToBeat, double totalObjectCosts ) const;
+	void InitDoubleRecurse( KdBuildTask& task, double minOnAxis, double maxOnAxis, double secondAxisLen, double thirdAxisLen,
+								double costToBeat, double totalObjectCosts ) const;
+	bool CalcSplitCost( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const;
+	bool CalcMacdonaldBooth( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const;
+	bool CalcMacdonaldBoothModifiedCoefs( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const;
+	bool CalcDoubleRecurseGS( KdBuildTask& task, double splitValue, double costLeft, double costRight, double* retCost ) const;
+
+	void MemoryError() const;			// If allocation of memory fails.
+	void MemoryError2() const;			// If storage multiplier did not give enough memory
 };
 
 // See the end of this file for the inlined members of KdTree.
@@ -307,6 +434,59 @@ private:
 
 };
 
+// ************************************************************************************
+// KdPackedNode																		  *
+//    The compact, eight byte, form of a tree node used for traversal.				  *
+//	  The two children of a split node are stored next to each other,				  *
+//		left child first.  An empty child is stored as a leaf with no objects.		  *
+//	  The leaf object lists are stored one after the other in a single array.		  *
+//	  Split values are floats.  While the tree is built, the extents are			  *
+//		rounded outward to floats so that the float split values are exact.			  *
+// ************************************************************************************
+
+class KdPackedNode {
+public:
+	friend class KdTree;
+
+	bool IsLeaf() const { return ((Flags&3)==KD_LEAF); }
+	bool IsEmptyLeaf() const { return ( IsLeaf() && Data.NumObjects==0 ); }
+	int SplitAxis() const { assert(!IsLeaf()); return (int)(Flags&3); }
+	double SplitValue() const { assert(!IsLeaf()); return Data.SplitValue; }
+	long GetNumObjects() const { assert(IsLeaf()); return (long)Data.NumObjects; }
+
+	// The right child immediately follows the left child.
+	long LeftChildIndex() const { assert(!IsLeaf()); return (long)(Flags>>2); }
+	long RightChildIndex() const { assert(!IsLeaf()); return (long)(Flags>>2)+1; }
+
+	// Position of the leaf's objects in the tree's leaf object list.
+	long FirstObjectIndex() const { assert(IsLeaf()); return (long)(Flags>>2); }
+
+private:
+	void SetSplit( int splitAxis, float splitValue, long leftChildIdx );
+	void SetLeaf( long numObjects, long firstObjectIdx );
+
+	union {
+		float SplitValue;			// For an internal node: the value for the split plane
+		unsigned int NumObjects;	// For a leaf: the number of objects in the leaf.
+	} Data;
+	unsigned int Flags;				// Low two bits: the KD_SplittingAxis.
+									// Other bits: left child index, or first object index.
+};
+
+inline void KdPackedNode::SetSplit( int splitAxis, float splitValue, long leftChildIdx )
+{
+	assert ( 0<=splitAxis && splitAxis<KD_LEAF && 0<=leftChildIdx && leftChildIdx<(1L<<30)-1 );
+	Data.SplitValue = splitValue;
+	Flags = (((unsigned int)leftChildIdx)<<2) | (unsigned int)splitAxis;
+}
+
+inline void KdPackedNode::SetLeaf( long numObjects, long firstObjectIdx )
+{
+	assert ( 0<=firstObjectIdx && firstObjectIdx<(1L<<30) );
+	Data.NumObjects = (unsigned int)numObjects;
+	Flags = (((unsigned int)firstObjectIdx)<<2) | (unsigned int)KD_LEAF;
+}
+
 // *******************************************************************
 // Kd_TraverseNodeData												 *
 //		Holds information on a node needing traversal				 *
@@ -328,15 +508,137 @@ private:
 	long NodeNumber;			// Index of the node
 	double MinDistance;			// Minimum distance along ray to search (entry distance)
 	double MaxDistance;			// Maximum distance along ray to search (exit distance)
+};
+
+// *******************************************************************
+// KdTraverseScratch												 *
+//		Working storage for one traversal at a time.				 *
+//		Holds the stack of nodes still to be traversed, and a		 *
+//		mailbox of the objects recently called back.  An object is	 *
+//		not called back again if it was called back within the last	 *
+//		MailboxLeafWindow leaves of the same traversal.				 *
+//	    All storage has fixed size, so no memory allocation is done. *
+// *******************************************************************
+
+class KdTraverseScratch {
+	friend class KdTree;
+
+public:
+	KdTraverseScratch();
+
+	static const int MailboxSize = 256;			// Number of mailbox slots.  Must be a power of two.
+	static const int MailboxLeafWindow = 3;		// Number of prior leaves remembered by the mailbox
+	static const int ListBufferSize = 64;		// Max objects per PotentialObjectsListCallback call
+
+	// Statistics for the most recent traversal that used this scratch area.
+	//	 These are always zero if TrackKdTraversals is 0.
+	long GetNumNodesTraversed() const { return NumNodesTraversed; }
+	long GetNumLeavesTraversed() const { return NumLeavesTraversed; }		// Non-empty leaves
+	long GetNumObjectsInLeaves() const { return NumObjectsInLeaves; }		// Objects called back
+
+private:
+	void BeginTraversal();
+	bool RecentlyCalledBack( long objectID );	// Also marks the object as called back
+	void Stats_NodeTraversed();
+	void Stats_LeafTraversed();
+	void Stats_ObjectsInLeaves( long numObjects = 1 );
+
+	Kd_TraverseNodeData NodeStack[KdTree::MaxTreeDepth];
+	int StackSize;
+
+	long MailboxObjectID[MailboxSize];			// -1 if the slot is unused
+	unsigned int MailboxLeafStamp[MailboxSize];	// Value of LeafStamp when last called back
+	unsigned int LeafStamp;						// Incremented once per leaf traversed
+
+	long ListBuffer[ListBufferSize];			// Object ID's to be passed to a list callback
+
+	long NumNodesTraversed;
+	long NumLeavesTraversed;
+	long NumObjectsInLeaves;
+};
+
+// *******************************************************************
+// KdPacketScratch													 *
+//		Working storage for one packet traversal at a time.			 *
+//		Holds the stack of nodes, with the distance range of each	 *
+//		ray in the node.  Each ray has a KdTraverseScratch for its	 *
+//		mailbox, which is also used if the packet is split up.		 *
+// *******************************************************************
+
+class KdPacketScratch {
+	friend class KdTree;
+
+public:
+	static const int MaxRays = KD_PACKET_RAYS;		// Number of rays in a full packet
+
+	// The scratch area of the r-th ray.  Its statistics are for the r-th ray
+	//	 of the most recent packet traversal.
+	const KdTraverseScratch& GetRayScratch( int r ) const { return RayScratch[r]; }
 
 private:
-	static Array<long> ToCallBackObjectID;		// Object ID's to be called back
-	static Array<long> CalledBackObjectID;		// Object ID's recently called back
-	static Array<long> CalledBackDecay;			// How long ago last called back
-	static Array<long> CalledBackTemp;			// Object ID's recently called back
-	static Array<long> CalledBackTemp2;			// How long ago last called back
+	KdTraverseScratch RayScratch[MaxRays];
+
+	long StackNode[KdTree::MaxTreeDepth];
+	double StackMinDist[KdTree::MaxTreeDepth][MaxRays];
+	double StackMaxDist[KdTree::MaxTreeDepth][MaxRays];
 };
 
+inline KdTraverseScratch::KdTraverseScratch()
+{
+	for ( int i=0; i<MailboxSize; i++ ) {
+		MailboxObjectID[i] = -1;
+		MailboxLeafStamp[i] = 0;
+	}
+	LeafStamp = 0;
+	StackSize = 0;
+	NumNodesTraversed = 0;
+	NumLeavesTraversed = 0;
+	NumObjectsInLeaves = 0;
+}
+
+// Called at the start of each traversal.
+//	 Advancing the stamp past the window forgets objects from earlier traversals
+//	 without having to clear the mailbox.
+inline void KdTraverseScratch::BeginTraversal()
+{
+	StackSize = 0;
+	LeafStamp += MailboxLeafWindow;
+	NumNodesTraversed = 0;
+	NumLeavesTraversed = 0;
+	NumObjectsInLeaves = 0;
+}
+
+inline bool KdTraverseScratch::RecentlyCalledBack( long objectID )
+{
+	int slot = (int)(objectID & (MailboxSize-1));
+	bool recent = ( MailboxObjectID[slot]==objectID 
+					&& LeafStamp-MailboxLeafStamp[slot] <= (unsigned int)MailboxLeafWindow );
+	MailboxObjectID[slot] = objectID;
+	MailboxLeafStamp[slot] = LeafStamp;
+	return recent;
+}
+
+inline void KdTraverseScratch::Stats_NodeTraversed()
+{
+#if TrackKdTraversals
+	NumNodesTraversed++;
+#endif
+}
+
+inline void KdTraverseScratch::Stats_LeafTraversed()
+{
+#if TrackKdTraversals
+	NumLeavesTraversed++;
+#endif
+}
+
+inline void KdTraverseScratch::Stats_ObjectsInLeaves( long numObjects )
+{
+#if TrackKdTraversals
+	NumObjectsInLeaves += numObjects;
+#endif
+}
+
 inline Kd_TraverseNodeData::Kd_TraverseNodeData( long nodeNum, double minDist, double maxDist )
 {
 	Set ( nodeNum, minDist, maxDist );
@@ -378,9 +680,16 @@ public:
 	bool IsMax() const { return ExtentType==TT_MAX; }
 	bool IsFlat() const { return ExtentType==TT_FLAT; }
 
-	friend bool operator<(const ExtentTriple& x, const ExtentTriple y );
+	friend bool operator<(const ExtentTriple& x, const ExtentTriple& y );
 	ExtentTriple operator=( const ExtentTriple& );
 
+	// A 64 bit key which sorts in the same order as operator<.
+	//	 The extent value must be a float (the extents are rounded to floats),
+	//	 and the object ID must be less than 2^30.  
+	//	 SetFromSortKey recovers the triple from its key.
+	unsigned long long SortKey() const;
+	void SetFromSortKey( unsigned long long key );
+
 private:
 	TripleType ExtentType;		// Type of extent value
 	double ExtentValue;			// The extent value
@@ -412,7 +721,11 @@ public:
 	// Add either a min and a max or a flat.
 	long AddToEnd ( double min, double max, long objectID );
 
-	void Sort() { ShellSort( TripleArray, NumTriples() ); }
+	// Sort the triples into increasing order.
+	//	 keyBuffer must have room for 2*NumTriples() sort keys.
+	//	 Short lists are ShellSorted, longer lists are radix sorted on their SortKey's.
+	void Sort( unsigned long long* keyBuffer );
+	const static long RadixSortMinTriples = 256;
 
 private:
 	ExtentTriple* TripleArray;		// Pointer to an array of triples
@@ -457,7 +770,7 @@ inline void ExtentTriple::SetFlat( double value, long objectID )
 	ObjectID = objectID;
 }
 
-inline bool operator<(const ExtentTriple& x, const ExtentTriple y )
+inline bool operator<(const ExtentTriple& x, const ExtentTriple& y )
 {
 	if ( x.ExtentValue < y.ExtentValue ) {
 		return true;
@@ -473,6 +786,29 @@ inline bool operator<(const ExtentTriple& x, const ExtentTriple y )
 	return false;
 }
 
+// The key has the float bits of the value, flipped so that they sort as unsigned integers, 
+//	 followed by two bits of type and 30 bits of object ID.
+inline unsigned long long ExtentTriple::SortKey() const
+{
+	assert ( (double)(float)ExtentValue == ExtentValue && 0<=ObjectID && ObjectID<(1L<<30) );
+	float value = (float)(ExtentValue + 0.0);		// Adding 0.0 turns -0.0 into +0.0
+	unsigned int bits;
+	memcpy( &bits, &value, sizeof(bits) );
+	bits = ( bits & 0x80000000 ) ? ~bits : ( bits | 0x80000000 );
+	return ( ((unsigned long long)bits)<<32 ) | ( ((unsigned long long)ExtentType)<<30 ) | (unsigned long long)ObjectID;
+}
+
+inline void ExtentTriple::SetFromSortKey( unsigned long long key )
+{
+	unsigned int bits = (unsigned int)(key>>32);
+	bits = ( bits & 0x80000000 ) ? ( bits & 0x7fffffff ) : ~bits;
+	float value;
+	memcpy( &value, &bits, sizeof(value) );
+	ExtentValue = value;
+	ExtentType = (TripleType)((key>>30) & 3);
+	ObjectID = (long)(key & 0x3fffffff);
+}
+
 inline ExtentTriple ExtentTriple::operator=( const ExtentTriple& other )
 {
 	ExtentValue = other.ExtentValue;
@@ -528,21 +864,52 @@ inline long ExtentTripleArrayInfo::AddToEnd ( double min, double max, long objec
 
 inline KdTree::KdTree()
 {
+	PackedNodes = 0;
+	NumPackedNodes = 0;
+	LeafObjectList = 0;
+	LeafObjectListSize = 0;
+	ExtentsHash = 0;
+	FileMapping = 0;
 	SplitAlgorithm = MacDonaldBooth;
+	NumSplitBins = 0;
+	NumBuildThreads = 1;
 	SetObjectCost ( DefaultObjectCost() );
 	SetStoppingCriterion( 1000000, 4.0 );
-
-	ResetStats();
 }
 
 inline KdTree::KdTree( long numObjects, ExtentFunction* extentFunc, ExtentInBoxFunction* extentInBoxFunc )
 {
+	PackedNodes = 0;
+	NumPackedNodes = 0;
+	LeafObjectList = 0;
+	LeafObjectListSize = 0;
+	ExtentsHash = 0;
+	FileMapping = 0;
 	SplitAlgorithm = MacDonaldBooth;
+	NumSplitBins = 0;
+	NumBuildThreads = 1;
 	SetObjectCost ( DefaultObjectCost() );
 	SetStoppingCriterion( 1000000, 4.0 );
 	BuildTree( numObjects, extentFunc, extentInBoxFunc );
+}
 
-	ResetStats();
+// Calls whichever extent function was given to BuildTree
+inline void KdTree::CalcObjectExtents( long objectNum, AABB& boundingBox ) const
+{
+	if ( ExtentDataFunc ) {
+		(*ExtentDataFunc)( objectNum, boundingBox, ExtentUserData );
+	}
+	else {
+		(*ExtentFunc)( objectNum, boundingBox );
+	}
+}
+
+inline bool KdTree::CalcObjectExtentsInBox( long objectNum, const AABB& clippingBox, AABB& boundingBox ) const
+{
+	if ( ExtentInBoxDataFunc ) {
+		return (*ExtentInBoxDataFunc)( objectNum, clippingBox, boundingBox, ExtentUserData );
+	}
+	return (*ExtentInBoxFunc)( objectNum, clippingBox, boundingBox );
 }
 
 // Set a cost function for objects
@@ -579,51 +946,47 @@ inline void KdTree::SetDoubleRecurseSplitting( bool useModifiedCoefs )
 	SplitAlgorithm = useModifiedCoefs ? DoubleRecurseModifiedCoefs : DoubleRecurseGS;
 }
 
-inline void KdTree::ResetStats() 
+// Use binned split selection, with numBins bins on each axis of a node.
+inline void KdTree::SetBinnedSplitting( int numBins )
 {
-	// Traversal statistics
-	Stats_NumberKdNodesTraversed = 0;
-	Stats_NumberKdLeavesTraversed = 0;
-	Stats_NumberKdObjectsInLeaves = 0;
+	assert ( numBins>=2 );
+	NumSplitBins = numBins;
 }
 
-inline void KdTree::Stats_ObjectsInLeaves( long objNum ) 
+inline void KdTree::SetBuildThreads( int numThreads )
 {
-	Stats_NumberKdObjectsInLeaves += objNum;
+	assert ( numThreads>=0 );
+	NumBuildThreads = numThreads;
 }
 
-inline void KdTree::Stats_NodeTraversed( ) 
+// Use exact split selection (the default).
+inline void KdTree::SetExactSplitting()
 {
-	Stats_NumberKdNodesTraversed++;
+	NumSplitBins = 0;
 }
 
-inline void KdTree::Stats_LeafTraversed( ) 
+inline double KdTree::ObjectCost( long objectID ) const
 {
-	Stats_NumberKdLeavesTraversed++;
+	return UseConstantCost ? ObjectConstantCost : (*UserCostFunction)(objectID);
 }
 
-inline void KdTree::Stats_GetAll( long* numNodes, long* numNonEmptyLeaves, long* numObjsInLeaves ) const
-{
-	*numNodes = Stats_NumberKdNodesTraversed;
-	*numNonEmptyLeaves = Stats_NumberKdLeavesTraversed;
-	*numObjsInLeaves = Stats_NumberKdObjectsInLeaves;
+inline const KdPackedNode& KdTree::GetNode( long i ) const 
+{ 
+	assert ( 0<=i && i<NumPackedNodes );
+	return PackedNodes[i]; 
 }
 
-inline const KdTreeNode& KdTree::GetNode( long i ) const 
-{ 
-	return TreeNodes[i]; 
+inline const long* KdTree::GetLeafObjectList( const KdPackedNode& leafNode ) const
+{
+	return LeafObjectList + leafNode.FirstObjectIndex();
 }
 
-// Allocate the next entry for the KdTree 
-//  Call this to pre-allocate to avoid having the Array for the KdTree
-//		automatically re-sized at a bad time.
-inline long KdTree::NextIndex() 
-{ 
-	long i = TreeNodes.SizeUsed(); 
-	TreeNodes.Touch(i); 
-	return i; 
+inline long KdTree::NonEmptyChild( long packedIdx ) const
+{
+	return PackedNodes[packedIdx].IsEmptyLeaf() ? -1 : packedIdx;
 }
 
 
 
+
 #endif // KDTREE_H
\ No newline at end of file
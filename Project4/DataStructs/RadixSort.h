@@ -0,0 +1,89 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Data Structures Subpackage (DataStructs)
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ */
+
+// RadixSort.h
+//
+// A least-significant-digit radix sort, written as templated C++ code.
+//	 Sorts an array of unsigned integer keys into increasing order.
+//	 The keys are sorted one byte at a time, starting with the lowest byte.
+//	 All the byte counts are found in a single pass over the keys.  A byte
+//	 position where all keys have the same value is skipped.
+//	 The run time is linear in the number of keys.
+//
+// To sort records, pack each record, or its sort order and its index,
+//	 into an unsigned integer key.  Sort the keys, and then unpack them.
+
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <assert.h>
+
+// Do a radix sort.
+//   Pass a pointer to an array of keys, and the number of keys.
+//   The class "T" must be an unsigned integer type.
+//   tempArray must have room for num keys: its contents are overwritten.
+template <class T>
+void RadixSort( T *array, long num, T *tempArray )
+{
+	const int numBytes = (int)sizeof(T);
+	long counts[sizeof(T)][256];
+	for ( int b=0; b<numBytes; b++ ) {
+		for ( int k=0; k<256; k++ ) {
+			counts[b][k] = 0;
+		}
+	}
+	T* keyPtr = array;
+	for ( long i=num; i>0; i--, keyPtr++ ) {
+		T key = *keyPtr;
+		for ( int b=0; b<numBytes; b++ ) {
+			counts[b][ (int)(key & 0xff) ]++;
+			key >>= 8;
+		}
+	}
+
+	T* from = array;
+	T* to = tempArray;
+	for ( int b=0; b<numBytes; b++ ) {
+		long* count = counts[b];
+		int shift = 8*b;
+		if ( num==0 || count[ (int)((from[0]>>shift) & 0xff) ]==num ) {
+			continue;			// All keys have the same value in this byte
+		}
+		// Convert the counts into starting positions
+		long pos = 0;
+		for ( int k=0; k<256; k++ ) {
+			long c = count[k];
+			count[k] = pos;
+			pos += c;
+		}
+		keyPtr = from;
+		for ( long i=num; i>0; i--, keyPtr++ ) {
+			to[ count[ (int)(((*keyPtr)>>shift) & 0xff) ]++ ] = *keyPtr;
+		}
+		T* swapTemp = from;
+		from = to;
+		to = swapTemp;
+	}
+
+	if ( from!=array ) {
+		for ( long i=0; i<num; i++ ) {
+			array[i] = from[i];
+		}
+	}
+}
+
+#endif // RADIX_SORT_H
@@ -0,0 +1,135 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Data Structures Subpackage (DataStructs)
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ */
+
+// ThreadPool.cpp
+//
+//   A small work-stealing pool of worker threads.
+
+#include <assert.h>
+#include <mutex>
+#include <thread>
+
+#include "ThreadPool.h"
+
+// The block of jobs still waiting to run on one worker.
+//    The owner takes jobs from the front, thieves take jobs from the back.
+class ThreadPoolJobBlock {
+public:
+	std::mutex Lock;
+	long Front;			// First job not yet taken
+	long Back;			// One past the last job not yet taken
+};
+
+class ThreadPoolBatch {
+public:
+	ThreadPoolJobFunction* JobFunc;
+	void* UserData;
+	int NumWorkers;
+	ThreadPoolJobBlock* Blocks;
+};
+
+// Take the next job from a worker's own block.  Returns -1 if empty.
+static long TakeFront( ThreadPoolJobBlock& block )
+{
+	std::lock_guard<std::mutex> guard(block.Lock);
+	if ( block.Front >= block.Back ) {
+		return -1;
+	}
+	return block.Front++;
+}
+
+// Steal a job from the back of another worker's block.  Returns -1 if empty.
+static long TakeBack( ThreadPoolJobBlock& block )
+{
+	std::lock_guard<std::mutex> guard(block.Lock);
+	if ( block.Front >= block.Back ) {
+		return -1;
+	}
+	return --block.Back;
+}
+
+static void RunWorker( ThreadPoolBatch* batch, int threadNum )
+{
+	ThreadPoolJobBlock& ownBlock = batch->Blocks[threadNum];
+	while ( true ) {
+		long jobNum = TakeFront( ownBlock );
+		if ( jobNum < 0 ) {
+			// Own block is used up.  Try to steal, starting with the next worker.
+			for ( int k = 1; k < batch->NumWorkers && jobNum < 0; k++ ) {
+				jobNum = TakeBack( batch->Blocks[(threadNum + k) % batch->NumWorkers] );
+			}
+			if ( jobNum < 0 ) {
+				return;			// No work left anywhere.
+			}
+		}
+		(*batch->JobFunc)( jobNum, threadNum, batch->UserData );
+	}
+}
+
+void ThreadPool::SetNumThreads( int numThreads )
+{
+	assert( numThreads >= 0 );
+	NumWorkers = (numThreads > 0) ? numThreads : HardwareThreads();
+}
+
+int ThreadPool::HardwareThreads()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return (n > 0) ? n : 1;
+}
+
+void ThreadPool::Run( long numJobs, ThreadPoolJobFunction* jobFunc, void* userData )
+{
+	if ( numJobs <= 0 ) {
+		return;
+	}
+	int numWorkers = NumWorkers;
+	if ( numWorkers > numJobs ) {
+		numWorkers = (int)numJobs;
+	}
+	if ( numWorkers == 1 ) {
+		for ( long i = 0; i < numJobs; i++ ) {
+			(*jobFunc)( i, 0, userData );
+		}
+		return;
+	}
+
+	// Split the jobs into contiguous blocks, one per worker.
+	ThreadPoolJobBlock* blocks = new ThreadPoolJobBlock[numWorkers];
+	for ( int k = 0; k < numWorkers; k++ ) {
+		blocks[k].Front = (numJobs*k) / numWorkers;
+		blocks[k].Back = (numJobs*(k + 1)) / numWorkers;
+	}
+	ThreadPoolBatch batch;
+	batch.JobFunc = jobFunc;
+	batch.UserData = userData;
+	batch.NumWorkers = numWorkers;
+	batch.Blocks = blocks;
+
+	// The calling thread is worker 0.
+	std::thread* workers = new std::thread[numWorkers - 1];
+	for ( int k = 1; k < numWorkers; k++ ) {
+		workers[k - 1] = std::thread( RunWorker, &batch, k );
+	}
+	RunWorker( &batch, 0 );
+	for ( int k = 1; k < numWorkers; k++ ) {
+		workers[k - 1].join();
+	}
+
+	delete[] workers;
+	delete[] blocks;
+}
@@ -0,0 +1,60 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Data Structures Subpackage (DataStructs)
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ */
+
+// ThreadPool.h
+//
+//   A small work-stealing pool of worker threads.
+//   A batch of jobs, numbered 0,1,...,numJobs-1, is run by calling Run().
+//	 Each worker is first given a contiguous block of job numbers.
+//	 It works through its own block from the front; once its block is
+//		used up, it steals jobs from the back of the other workers' blocks.
+//	 Run() does not return until every job in the batch has finished.
+//
+//   The calling thread acts as worker number 0, so a pool with
+//		one thread runs all jobs inline without creating any threads.
+
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Callback routine that runs a single job.
+//	  jobNum - the number of the job, in the range 0 to numJobs-1.
+//	  threadNum - the worker running the job, in the range 0 to NumThreads()-1.
+//				  At most one job at a time runs with a given threadNum.
+//	  userData - the pointer that was passed to Run().
+typedef void ThreadPoolJobFunction( long jobNum, int threadNum, void* userData );
+
+class ThreadPool
+{
+public:
+	// numThreads == 0 means use one thread per hardware thread.
+	ThreadPool( int numThreads = 0 ) { SetNumThreads( numThreads ); }
+
+	void SetNumThreads( int numThreads );
+	int NumThreads() const { return NumWorkers; }
+
+	// Run jobs 0 through numJobs-1 and wait for them all to finish.
+	void Run( long numJobs, ThreadPoolJobFunction* jobFunc, void* userData );
+
+	// Number of threads the hardware can run concurrently (at least 1).
+	static int HardwareThreads();
+
+private:
+	int NumWorkers;
+};
+
+#endif // THREAD_POOL_H
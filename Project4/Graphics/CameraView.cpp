@@ -110,6 +110,25 @@ void CameraView::RecalcPixeldUdV()
     assert(pixeldU.NormSq() > 0.0 && pixeldV.NormSq());
 }
 
+// Projects pos onto the screen, along the line to the camera position, and finds 
+//   its pixel coordinates.  The vectors pixeldU and pixeldV are orthogonal.
+bool CameraView::CalcPixelCoordinates( const VectorR3& pos, double* i, double* j ) const
+{
+	assert( IsLocalViewer() );
+
+	VectorR3 toPos = pos - Position;
+	double depth = toPos^Direction;		// Distance in front of the camera
+	if ( depth <= 0.0 ) {
+		return false;
+	}
+	toPos *= ScreenDistance/depth;
+	toPos += Position;
+	toPos -= ScreenCenter;				// Now the displacement from the screen center
+	*i = (toPos^pixeldU)/pixeldU.NormSq() + (WidthPixels-1.0)/2.0;
+	*j = (toPos^pixeldV)/pixeldV.NormSq() + (HeightPixels-1.0)/2.0;
+	return true;
+}
+
 // Given a fully established camera and view, rotate the view upward around
 //		screen's  center.
 void CameraView::RotateViewUp( double theta )
@@ -51,6 +51,10 @@ public:
 	void CalcPixelPosition( double i, double j, float* pos) const;
 	void CalcPixelPosition( double i, double j, VectorR3* pos ) const;
 
+	// Inverse of CalcPixelPosition for a perspective camera:  calculates the pixel 
+	//   coordinates (i,j) where the point pos is seen.  Returns false if pos is not in front of the camera.
+	bool CalcPixelCoordinates( const VectorR3& pos, double* i, double* j ) const;
+
 	void SetScreenPixelSize( int width, int height );	// Width and height in pixels
 	void SetScreenPixelSize( const PixelArray& pixelarray );
 	void SetScreenDistance( double dist );	// Distance to the projection place
@@ -31,6 +31,7 @@ void DirectIlluminateViewPos( const VectorR3& position, const VectorR3& normal,
 					  const VectorR3& ViewPos,
 					  const Light& light,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit ) 
 {
@@ -43,14 +44,14 @@ void DirectIlluminateViewPos( const VectorR3& position, const VectorR3& normal,
 	if ( !CalcLightDirAndFactor( light, position, 
 								 &lightVector, &lightReduction) ) {
 		// Hidden from spotlight.
-		CalcAmbientOnly(material,light,lightReduction,colorReturned);
+		CalcAmbientOnly(colorAmbient,light,lightReduction,colorReturned);
 	}
 	else {
 		// Compute the normalized view vector
 		viewVector.Normalize();
 
 		// Call the general purpose function with missing H vector
-		DirectIlluminateBasic( colorReturned, material, light, 
+		DirectIlluminateBasic( colorReturned, material, colorAmbient, colorDiffuse, light, 
 								  percentLit, lightReduction,
 								  normal, viewVector, lightVector, NULL );
 	}
@@ -62,6 +63,7 @@ void DirectIlluminateViewDir( const VectorR3& position, const VectorR3& normal,
 					  const VectorR3& ViewDir,
 					  const Light& light,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit ) 
 {
@@ -70,11 +72,11 @@ void DirectIlluminateViewDir( const VectorR3& position, const VectorR3& normal,
 
 	if ( !CalcLightDirAndFactor( light, position, 
 								 &lightVector, &lightReduction) ) {
-		CalcAmbientOnly(material,light,lightReduction,colorReturned);
+		CalcAmbientOnly(colorAmbient,light,lightReduction,colorReturned);
 	}
 	else {
 		// Call the general purpose function with null H vector ptr
-		DirectIlluminateBasic( colorReturned, material, light, 
+		DirectIlluminateBasic( colorReturned, material, colorAmbient, colorDiffuse, light, 
 								  percentLit, lightReduction,
 								  normal, ViewDir, lightVector, NULL );
 	}
@@ -86,18 +88,19 @@ void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 					  const View& view,
 					  const Light& light,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit )
 {
 	if ( view.IsLocalViewer() ) {
 		DirectIlluminateViewPos( position, normal, view.GetPosition(), light, material,
-						  colorReturned, percentLit );
+						  colorAmbient, colorDiffuse, colorReturned, percentLit );
 	}
 	else {
 		VectorR3 viewVector(view.GetDirection());
 		viewVector.Negate();
 		DirectIlluminateViewDir( position, normal, viewVector, light, material,
-						  colorReturned, percentLit );
+						  colorAmbient, colorDiffuse, colorReturned, percentLit );
 	}
 }
 
@@ -105,12 +108,13 @@ void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 					  const LightView& lv,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit )
 {
 	if ( !lv.GetView().IsLocalViewer() ) {
 		DirectIlluminateViewPos( position, normal, lv.GetView().GetPosition(), 
-								lv.GetLight(), material,
+								lv.GetLight(), material, colorAmbient, colorDiffuse,
 								colorReturned, percentLit );
 		return;
 	}
@@ -125,11 +129,11 @@ void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 	if ( !CalcLightDirAndFactor( lv.GetLight(), position, 
 								 &lightVector, &lightReduction) ) {
 		// Hidden from spotlight.
-		CalcAmbientOnly(material,lv.GetLight(),lightReduction,colorReturned);
+		CalcAmbientOnly(colorAmbient,lv.GetLight(),lightReduction,colorReturned);
 	}
 	else {
 		// Call the general purpose function
-		DirectIlluminateBasic( colorReturned, material, lv.GetLight(), 
+		DirectIlluminateBasic( colorReturned, material, colorAmbient, colorDiffuse, lv.GetLight(), 
 								  percentLit, lightReduction,
 								  normal, viewVector, lightVector, &(lv.GetH()) );
 	}
@@ -209,10 +213,10 @@ void LightView::CalcH() {
 // Calculate the response to the ambient light
 // This calculation can apply to both the Phong and Cook-Torrance models
 //		so is currently used for all lights.
-void CalcAmbientOnly( const MaterialBase& mat, const Light& light, double lightAttenuation,
+void CalcAmbientOnly( const VectorR3& colorAmbient, const Light& light, double lightAttenuation,
 					  VectorR3& colorReturned )
 {
-	colorReturned = mat.GetColorAmbient();
+	colorReturned = colorAmbient;
 	colorReturned.ArrayProd(light.GetColorAmbient());
 	colorReturned *= lightAttenuation;
 }
@@ -226,15 +230,18 @@ void CalcAmbientOnly( const MaterialBase& mat, const Light& light, double lightA
 // H = H vector (or null pointer).
 // lightAttenuation - net attenuation factor for this light.
 // light and material have the basic relevant properties needed for the illumination
-//		calculation.
+//		calculation, except that colorAmbient and colorDiffuse are used in place of the
+//		material's ambient and diffuse colors.
 
 void DirectIlluminateBasic( VectorR3& colorReturned, const MaterialBase& material, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 						    const Light& light, 
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* H )
 {
-	material.CalcLocalLighting( colorReturned, light, percentLit, lightAttenuation,
+	material.CalcLocalLighting( colorReturned, light, colorAmbient, colorDiffuse,
+								percentLit, lightAttenuation,
 								N, V, L, H );
 	return;
 }
@@ -31,11 +31,16 @@ class View;				// A viewer (viewpoint position and direction)
 class LightView;		// Combination of a light and a view
 
 
+// Each routine takes the ambient and diffuse colors to use in place of the
+//    material's own colors; these are the colors of a visible point, as set by a texture map.
+//    The versions without the colors use the material's colors.
+
 // For a view structure (may be a local viewer)
 void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 					  const View& view,
 					  const Light& light,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit );
 
@@ -43,6 +48,7 @@ void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
 					  const LightView& lv,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit );
 
@@ -51,6 +57,7 @@ void DirectIlluminateViewPos( const VectorR3& position, const VectorR3& normal,
 					  const VectorR3& ViewPos,
 					  const Light& light,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit ); 
 // For a viewpoint with explicit direction of view 
@@ -59,10 +66,59 @@ void DirectIlluminateViewDir( const VectorR3& position, const VectorR3& normal,
 					  const VectorR3& ViewDir,
 					  const Light& light,
 					  const MaterialBase& material,
+					  const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 					  VectorR3& colorReturned,
 					  const VectorR3& percentLit );
 
-// The routines below are identical except use the VisiblePoint class
+inline void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
+					  const View& view,
+					  const Light& light,
+					  const MaterialBase& material,
+					  VectorR3& colorReturned,
+					  const VectorR3& percentLit )
+{
+	DirectIlluminate( position, normal, view, light, material,
+					  material.GetColorAmbient(), material.GetColorDiffuse(),
+					  colorReturned, percentLit );
+}
+
+inline void DirectIlluminate( const VectorR3& position, const VectorR3& normal,
+					  const LightView& lv,
+					  const MaterialBase& material,
+					  VectorR3& colorReturned,
+					  const VectorR3& percentLit )
+{
+	DirectIlluminate( position, normal, lv, material,
+					  material.GetColorAmbient(), material.GetColorDiffuse(),
+					  colorReturned, percentLit );
+}
+
+inline void DirectIlluminateViewPos( const VectorR3& position, const VectorR3& normal,
+					  const VectorR3& ViewPos,
+					  const Light& light,
+					  const MaterialBase& material,
+					  VectorR3& colorReturned,
+					  const VectorR3& percentLit )
+{
+	DirectIlluminateViewPos( position, normal, ViewPos, light, material,
+					  material.GetColorAmbient(), material.GetColorDiffuse(),
+					  colorReturned, percentLit );
+}
+
+inline void DirectIlluminateViewDir( const VectorR3& position, const VectorR3& normal,
+					  const VectorR3& ViewDir,
+					  const Light& light,
+					  const MaterialBase& material,
+					  VectorR3& colorReturned,
+					  const VectorR3& percentLit )
+{
+	DirectIlluminateViewDir( position, normal, ViewDir, light, material,
+					  material.GetColorAmbient(), material.GetColorDiffuse(),
+					  colorReturned, percentLit );
+}
+
+// The routines below are identical except use the VisiblePoint class,
+//    with the colors of the visible point.
 
 
 // For a view structure (may be a local viewer)
@@ -73,7 +129,8 @@ inline void DirectIlluminate( const VisiblePoint& visPoint,
 					  const VectorR3& percentLit ) 
 {
 	DirectIlluminate( visPoint.GetPosition(), visPoint.GetNormal(),
-					  view, light, visPoint.GetMaterial(), colorReturned,
+					  view, light, visPoint.GetMaterial(), 
+					  visPoint.GetColorAmbient(), visPoint.GetColorDiffuse(), colorReturned,
 					  percentLit  );
 }
 
@@ -84,7 +141,8 @@ inline void DirectIlluminate( const VisiblePoint& visPoint,
 					  const VectorR3& percentLit )
 {
 	DirectIlluminate( visPoint.GetPosition(), visPoint.GetNormal(),
-					  lv, visPoint.GetMaterial(), colorReturned,
+					  lv, visPoint.GetMaterial(), 
+					  visPoint.GetColorAmbient(), visPoint.GetColorDiffuse(), colorReturned,
 					  percentLit  );
 }
 
@@ -96,7 +154,8 @@ inline void DirectIlluminateViewPos( const VisiblePoint& visPoint,
 					  const VectorR3& percentLit )
 {
 	DirectIlluminateViewPos( visPoint.GetPosition(), visPoint.GetNormal(),
-					  ViewPos, light, visPoint.GetMaterial(), colorReturned,
+					  ViewPos, light, visPoint.GetMaterial(), 
+					  visPoint.GetColorAmbient(), visPoint.GetColorDiffuse(), colorReturned,
 					  percentLit  );
 }
  
@@ -109,7 +168,8 @@ inline void DirectIlluminateViewDir( const VisiblePoint& visPoint,
 					  const VectorR3& percentLit )
 {
 	DirectIlluminateViewDir( visPoint.GetPosition(), visPoint.GetNormal(),
-					  ViewDir, light, visPoint.GetMaterial(), colorReturned,
+					  ViewDir, light, visPoint.GetMaterial(), 
+					  visPoint.GetColorAmbient(), visPoint.GetColorDiffuse(), colorReturned,
 					  percentLit );
 }
 
@@ -119,12 +179,13 @@ inline void DirectIlluminateViewDir( const VisiblePoint& visPoint,
 // V = Unit vector towards viewer
 // H = H vector (or null pointer)
 void DirectIlluminateBasic( VectorR3& colorReturned, const MaterialBase& material, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 						    const Light& light, 
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* H );
 
-void CalcAmbientOnly( const MaterialBase& mat, const Light& light, double lightAttenuation,
+void CalcAmbientOnly( const VectorR3& colorAmbient, const Light& light, double lightAttenuation,
 					  VectorR3& colorReturned );
 
 bool CalcLightDirAndFactor(const Light& light, 
@@ -68,6 +68,12 @@ bool CalcExtentsInBox( const ViewableTriangle& tri,
 						   const VectorR3& boxBoundMin, const VectorR3& boxBoundMax,
 						   VectorR3* extentsMin, VectorR3* extentsMax );
 
+// A triangle given by its three vertices and its unit normal (as for a triangle of a mesh).
+bool CalcExtentsInBox( const VectorR3& vertA, const VectorR3& vertB, const VectorR3& vertC,
+						   const VectorR3& normal,
+						   const VectorR3& boxBoundMin, const VectorR3& boxBoundMax,
+						   VectorR3* extentsMin, VectorR3* extentsMax );
+
 // **********************************************************************
 // CalcSolidExtentsInBox. Consider the intersection of a solid geometric 
 //		object with the bounding box defined by boundBoxMax/Min.
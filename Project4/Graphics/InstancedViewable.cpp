@@ -0,0 +1,101 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Author: Samuel R. Buss
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ * Bug reports: Sam Buss, sbuss@ucsd.edu.
+ * Web page: http://math.ucsd.edu/~sbuss/MathCG
+ *
+ */
+
+#include "InstancedViewable.h"
+
+double InstancedViewable::ToObjectRay( const VectorR3& viewPos, const VectorR3& viewDir,
+									   VectorR3* objectPos, VectorR3* objectDir ) const
+{
+	InversePlacement.Transform( viewPos, objectPos );
+	InversePlacement.Transform3x3( viewDir, objectDir );
+	double scale = objectDir->Norm();
+	*objectDir /= scale;
+	return scale;
+}
+
+// Returns an intersection if found with distance maxDistance
+// viewDir must be a unit vector.
+// intersectDistance and visPoint are returned values.
+bool InstancedViewable::FindIntersectionNT ( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const
+{
+	VectorR3 objectPos, objectDir;
+	double scale = ToObjectRay( viewPos, viewDir, &objectPos, &objectDir );
+	double objectDistance;
+	if ( !SharedObject->FindIntersectionUntextured( objectPos, objectDir, maxDistance*scale,
+													&objectDistance, returnedPoint ) ) {
+		return false;
+	}
+	*intersectDistance = objectDistance/scale;
+
+	// Map the point and the normal back to the scene.  Normals are mapped by the 
+	//	 transpose of the inverse, to stay perpendicular to the surface.
+	VectorR3 position = viewPos;
+	position.AddScaled( viewDir, *intersectDistance );
+	returnedPoint.SetPosition( position );
+	VectorR3 normal;
+	InversePlacement.Transform3x3Transpose( returnedPoint.GetNormal(), &normal );
+	normal.Normalize();
+	returnedPoint.SetNormal( normal );
+	return true;
+}
+
+bool InstancedViewable::IntersectsBefore( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	VectorR3 objectPos, objectDir;
+	double scale = ToObjectRay( viewPos, viewDir, &objectPos, &objectDir );
+	return SharedObject->IntersectsBefore( objectPos, objectDir, maxDistance*scale );
+}
+
+// For x = Ay + b, u.x = (A^T u).y + u.b, so the bounds come from the shared object's 
+//	 bounds in the direction of A^T u.
+void InstancedViewable::CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const
+{
+	VectorR3 objectU;
+	Placement.Transform3x3Transpose( u, &objectU );
+	double scale = objectU.Norm();
+	objectU /= scale;
+	double objectMin, objectMax;
+	SharedObject->CalcBoundingPlanes( objectU, &objectMin, &objectMax );
+	double offset = u^Placement.Column4();
+	*minDot = scale*objectMin + offset;
+	*maxDot = scale*objectMax + offset;
+}
+
+bool InstancedViewable::CalcPartials( const VisiblePoint& visPoint, 
+									  VectorR3& retPartialU, VectorR3& retPartialV ) const
+{
+	VisiblePoint objectPoint = visPoint;
+	VectorR3 v;
+	InversePlacement.Transform( visPoint.GetPosition(), &v );
+	objectPoint.SetPosition( v );
+	Placement.Transform3x3Transpose( visPoint.GetNormal(), &v );
+	v.Normalize();
+	objectPoint.SetNormal( v );
+	objectPoint.SetObject( SharedObject );
+	if ( !SharedObject->CalcPartials( objectPoint, retPartialU, retPartialV ) ) {
+		return false;
+	}
+	Placement.Transform3x3( &retPartialU );
+	Placement.Transform3x3( &retPartialV );
+	return true;
+}
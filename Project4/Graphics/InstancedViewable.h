@@ -0,0 +1,106 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Author: Samuel R. Buss
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ * Bug reports: Sam Buss, sbuss@ucsd.edu.
+ * Web page: http://math.ucsd.edu/~sbuss/MathCG
+ *
+ */
+
+#ifndef INSTANCEDVIEWABLE_H
+#define INSTANCEDVIEWABLE_H
+
+#include "ViewableBase.h"
+#include "../VrMath/LinearR3.h"
+
+// InstancedViewable places a copy of a shared object in the scene with an affine map,
+//	 without copying the object.  Many instances may share one object.  A shared 
+//	 ViewableTriangleMesh should have a kd-tree (see BuildKdTree), so that each instance
+//	 is intersected through the mesh's kd-tree:  the scene's kd-tree then holds the
+//	 instances, and the meshes' kd-trees hold the triangles.
+// Rays are mapped into the coordinates of the shared object by the inverse of the 
+//	 placement, intersected with the shared object, and the hit is mapped back.
+// The shared object is not added to the scene as a viewable (see 
+//	 SceneDescription::AddSharedViewable), and must not change while instances use it.
+// The materials, (u,v) coordinates and face numbers come from the shared object.
+//	 The texture maps are the instance's own:  those of the shared object are not used.
+class InstancedViewable : public ViewableBase {
+
+public:
+	InstancedViewable();
+	InstancedViewable( const ViewableBase& sharedObject, const AffineMapR3& placement );
+	InstancedViewable( const ViewableBase& sharedObject, const RigidMapR3& placement );
+
+	void SetSharedObject( const ViewableBase& sharedObject ) { SharedObject = &sharedObject; }
+	const ViewableBase& GetSharedObject() const { return *SharedObject; }
+
+	// The placement maps the coordinates of the shared object to the scene.
+	//	 It must be invertible.
+	void SetPlacement( const AffineMapR3& placement );
+	void SetPlacement( const RigidMapR3& placement );
+	const AffineMapR3& GetPlacement() const { return Placement; }
+
+	virtual bool FindIntersectionNT ( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	bool IntersectsBefore( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
+	void CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const;
+	bool CalcPartials( const VisiblePoint& visPoint, 
+					   VectorR3& retPartialU, VectorR3& retPartialV ) const;
+	ViewableType GetViewableType() const { return Viewable_Instance; }
+
+protected:
+	const ViewableBase* SharedObject;
+	AffineMapR3 Placement;			// From the shared object's coordinates to the scene
+	AffineMapR3 InversePlacement;	// From the scene to the shared object's coordinates
+
+	// Maps a ray into the shared object's coordinates, with a unit direction.
+	//	 Returns the length of the mapped direction before it was normalized:
+	//	 a distance along the ray is this many times longer in the shared object.
+	double ToObjectRay( const VectorR3& viewPos, const VectorR3& viewDir,
+						VectorR3* objectPos, VectorR3* objectDir ) const;
+};
+
+inline InstancedViewable::InstancedViewable()
+{
+	SharedObject = 0;
+	Placement.SetIdentity();
+	InversePlacement.SetIdentity();
+}
+
+inline InstancedViewable::InstancedViewable( const ViewableBase& sharedObject, const AffineMapR3& placement )
+{
+	SetSharedObject( sharedObject );
+	SetPlacement( placement );
+}
+
+inline InstancedViewable::InstancedViewable( const ViewableBase& sharedObject, const RigidMapR3& placement )
+{
+	SetSharedObject( sharedObject );
+	SetPlacement( placement );
+}
+
+inline void InstancedViewable::SetPlacement( const AffineMapR3& placement )
+{
+	Placement = placement;
+	InversePlacement = placement.Inverse();
+}
+
+inline void InstancedViewable::SetPlacement( const RigidMapR3& placement )
+{
+	Placement.Set( placement );
+	InversePlacement.Set( placement.Inverse() );
+}
+
+#endif // INSTANCEDVIEWABLE_H
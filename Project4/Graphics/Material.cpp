@@ -33,6 +33,7 @@ MaterialBase* Material::Clone() const {
 
 void Material::CalcLocalLighting( 
 							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* H ) const
@@ -56,7 +57,7 @@ void Material::CalcLocalLighting(
 			}
 
 			// Diffuse light
-			colorReturned = this->GetColorDiffuse();
+			colorReturned = colorDiffuse;
 			colorReturned.ArrayProd(light.GetColorDiffuse());
 			colorReturned *= (L^facingNormal);
 
@@ -112,7 +113,7 @@ void Material::CalcLocalLighting(
 	}
 
 	// Ambient light
-	LightValue = this->GetColorAmbient();
+	LightValue = colorAmbient;
 	LightValue.ArrayProd(light.GetColorAmbient());
 	colorReturned += LightValue;
 
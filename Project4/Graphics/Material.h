@@ -81,8 +81,10 @@ public:
 												const VectorR3& /*fromDir*/) const
 							{ return GetColorTransmissive(); }
 
+	using MaterialBase::CalcLocalLighting;
 	virtual void CalcLocalLighting( 
 							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* H ) const;
@@ -48,11 +48,19 @@ public:
 	virtual VectorR3 GetTransmissionColor( const VisiblePoint& visPoint, 
 												  const VectorR3& outDir, 
 												  const VectorR3& fromDir) const = 0;
+	// CalcLocalLighting with colorAmbient and colorDiffuse in place of the material's own
+	//   ambient and diffuse colors, as set for a visible point by a texture map.
 	virtual void CalcLocalLighting( 
 							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* H ) const = 0;
+	void CalcLocalLighting( 
+							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& percentLit, double lightAttenuation,
+							const VectorR3& N, const VectorR3& V, 
+							const VectorR3& L, const VectorR3* H ) const;
 
 
 	void SetColorAmbient( double r, double g, double b);
@@ -244,6 +252,16 @@ inline const VectorR3& MaterialBase::GetColorEmissive() const {
 	return ColorEmissive;
 }
 
+inline void MaterialBase::CalcLocalLighting( 
+							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& percentLit, double lightAttenuation,
+							const VectorR3& N, const VectorR3& V, 
+							const VectorR3& L, const VectorR3* H ) const
+{
+	CalcLocalLighting( colorReturned, light, ColorAmbient, ColorDiffuse,
+					   percentLit, lightAttenuation, N, V, L, H );
+}
+
 // General purpose calculation of refraction direction.
 // Return false if "total internal reflection".
 inline bool MaterialBase::CalcRefractDir( double indexOfRefraction, double indexOfRefractionInv,
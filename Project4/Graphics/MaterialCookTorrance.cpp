@@ -44,6 +44,7 @@ double MaterialCookTorrance::GetPhongShininess() const
 
 void MaterialCookTorrance::CalcLocalLighting( 
 							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* /*H*/ ) const
@@ -68,7 +69,7 @@ void MaterialCookTorrance::CalcLocalLighting(
 			}
 
 			// Diffuse light
-			colorReturned = this->GetColorDiffuse();
+			colorReturned = colorDiffuse;
 			colorReturned.ArrayProd(light.GetColorDiffuse());
 			colorReturned *= (L^facingNormal);
 
@@ -92,7 +93,7 @@ void MaterialCookTorrance::CalcLocalLighting(
 	}
 
 	// Ambient light
-	LightValue = this->GetColorAmbient();
+	LightValue = colorAmbient;
 	LightValue.ArrayProd(light.GetColorAmbient());
 	colorReturned += LightValue;
 
@@ -87,8 +87,10 @@ public:
 
 	// Here is the main local lighting routine for the Cook-Torrance lighting
 	//		model.
+	using MaterialBase::CalcLocalLighting;
 	virtual void CalcLocalLighting( 
 							VectorR3& colorReturned, const Light& light, 
+							const VectorR3& colorAmbient, const VectorR3& colorDiffuse,
 							const VectorR3& percentLit, double lightAttenuation,
 							const VectorR3& N, const VectorR3& V, 
 							const VectorR3& L, const VectorR3* H ) const;
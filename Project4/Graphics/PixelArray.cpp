@@ -23,6 +23,8 @@
 #include "PixelArray.h"
 #include "RgbImage.h"
 
+// The routines that use OpenGL are in PixelArrayOpengl.cpp.
+
 // SetSize(width, height) resizes the pixel data info.
 // If necessary, it allocates new block of memory.
 // Returns true if new memory has been allocated.
@@ -44,48 +46,6 @@ bool PixelArray::SetSize( int width, int height ) {
 	return retValue;
 }
 
-// Set the size to the size of the viewport.
-void PixelArray::ResetSize() {
-	GLint got[4];		// i,j, width, height
-	glGetIntegerv( GL_VIEWPORT, got );
-	SetSize(got[2],got[3]);
-}
-
-// DrawFloats() writes the contents of the pixel array into
-//	OpenGL's currently bound GL_TEXTURE_2D object.
-
-void PixelArray::DrawToTexture() const
-{
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, GetWidth(), GetHeight(), 0, GL_RGB, GL_FLOAT, ColorValues);
-}
-
-// DrawViaRgbImage() writes the contents of the pixel array into
-//	OpenGL's buffer.  The floating point numbers are first converted
-//  to unsigned integers (via an RgbImage).
-// This avoids the graphics board software bugs mentioned
-//  in the comments for DrawFloats();  However, some ATI
-//  graphics boards have another software bug (concerning
-//  row length) that makes this method give a skewed image.
-
-void PixelArray::DrawViaRgbImage() const
-{
-	glRasterPos2i(0,0);		// Position at base of window
-	RgbImage image( GetHeight(), GetWidth() );
-	Dump( image );
-	image.DrawToOpenglBuffer();
-}
-
-// ClampAndDrawFloats() first clamps all values to the 
-//	interval [0,1] and then draws them.  The whole point
-//  is to avoid some software issues for some graphics
-//  boards (particularly, ATI boards).
-
-void PixelArray::ClampAndDrawToTexture()
-{
-	ClampAllValues();							// Clamp values to range [0,1]
-	DrawToTexture();
-}
-
 // Dumps the PixelArray data into an RgbImage object.
 //   The RgbImage data (for now at least) must match the
 //	 size of the PixelArray dimensions.
@@ -120,3 +80,11 @@ void PixelArray::ClampAllValues()
 		ClampRange( pixelPtr++, (float)0.0f, (float)1.0f );		// Clamp value to range [0,1]
 	}
 }
+
+void PixelArray::SetAllZero()
+{
+	long iterCount = 3*GetHeight()*GetWidth();
+	for ( long i=0; i<iterCount; i++ ) {
+		ColorValues[i] = 0.0f;
+	}
+}
@@ -22,11 +22,6 @@
 #ifndef PIXELARRAY_H
 #define PIXELARRAY_H
 
-// If you do not have GLUT installed, you can use the basic GL routines instead.
-//   For this, include windows.h and GL/gl.h, instead of GL/glut.h
-#include <windows.h>
-#include <GL/gl.h>	// Basic OpenGL includes
-
 #include "../VrMath/LinearR3.h"
 #include "../VrMath/LinearR4.h"
 #include "../VrMath/MathMisc.h"
@@ -39,7 +34,7 @@ public:
 	PixelArray( int width, int height );
 	~PixelArray();
 
-	void ResetSize();
+	void ResetSize();		// Sets the size to the OpenGL viewport's size
 	bool SetSize( int width, int height );
 
 	// Set a single pixel color  -- i indexes left to right, j top to bottom
@@ -47,8 +42,13 @@ public:
 	void SetPixel( int i, int j, const double* color );
 	void SetPixel( int i, int j, const VectorR4 color );
 	void SetPixel( int i, int j, const VectorR3 color );
+	// Add to a single pixel color, for accumulating samples
+	void AddToPixel( int i, int j, const VectorR3& color );
+	// Set all pixels to zero (black)
+	void SetAllZero();
 
-	// Draw into the OpenGL draw buffer
+	// Draw into the OpenGL draw buffer.  These, and ResetSize, are in PixelArrayOpengl.cpp:
+	//	 programs that do not call them do not need to link with OpenGL.
 	// Any of the three methods could be used, but ClampAndDrawToTexture
 	//	is safest, as it first clamps values to [0,1].
 	void Draw() { ClampAndDrawToTexture(); }
@@ -80,11 +80,13 @@ protected:
 
 };
 
+// The default constructor makes an empty array.  Call SetSize, or ResetSize
+//	 to use the size of the OpenGL viewport.
 inline PixelArray::PixelArray() 
 { 
 	ColorValues = 0;
 	Allocated = 0;
-	ResetSize(); 
+	SetSize(0,0); 
 }
 inline PixelArray::PixelArray( int width, int height )
 {
@@ -126,6 +128,14 @@ inline void PixelArray::SetPixel( int i, int j, const VectorR3 color )
 	SetPixel(i,j,t);
 }
 
+inline void PixelArray::AddToPixel( int i, int j, const VectorR3& color )
+{
+	float* cptr = const_cast<float*>(GetPixel(i,j));
+	*(cptr++) += (float)color.x;
+	*(cptr++) += (float)color.y;
+	*(cptr) += (float)color.z;
+}
+
 inline const float* PixelArray::GetPixel ( int i, int j ) const {
 	return ColorValues + (((long) j)*WidthAlloc + ((long) i))*3;
 }
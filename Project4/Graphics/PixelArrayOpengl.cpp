@@ -0,0 +1,74 @@
+/*
+ *
+ * RayTrace Software Package, release 3.2.  May 3, 2007.
+ *		Graphics subpackage
+ *
+ * Author: Samuel R. Buss
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ * Bug reports: Sam Buss, sbuss@ucsd.edu.
+ * Web page: http://math.ucsd.edu/~sbuss/MathCG
+ *
+ */
+
+// PixelArrayOpengl.cpp - the routines of PixelArray that use OpenGL.
+//	 They are kept apart from PixelArray.cpp so that programs that only
+//	 write images, such as RayTraceBatch, do not need to link with OpenGL.
+
+#if defined(_WIN32)			// If on windows, need this for gl.h
+#include <windows.h>
+#endif  // defined(_WIN32)
+#include <GL/gl.h>	// Basic OpenGL includes
+
+#include "PixelArray.h"
+#include "RgbImage.h"
+
+// Set the size to the size of the viewport.
+void PixelArray::ResetSize() {
+	GLint got[4];		// i,j, width, height
+	glGetIntegerv( GL_VIEWPORT, got );
+	SetSize(got[2],got[3]);
+}
+
+// DrawFloats() writes the contents of the pixel array into
+//	OpenGL's currently bound GL_TEXTURE_2D object.
+
+void PixelArray::DrawToTexture() const
+{
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, GetWidth(), GetHeight(), 0, GL_RGB, GL_FLOAT, ColorValues);
+}
+
+// DrawViaRgbImage() writes the contents of the pixel array into
+//	OpenGL's buffer.  The floating point numbers are first converted
+//  to unsigned integers (via an RgbImage).
+// This avoids the graphics board software bugs mentioned
+//  in the comments for DrawFloats();  However, some ATI
+//  graphics boards have another software bug (concerning
+//  row length) that makes this method give a skewed image.
+
+void PixelArray::DrawViaRgbImage() const
+{
+	glRasterPos2i(0,0);		// Position at base of window
+	RgbImage image( GetHeight(), GetWidth() );
+	Dump( image );
+	image.DrawToOpenglBuffer();
+}
+
+// ClampAndDrawFloats() first clamps all values to the 
+//	interval [0,1] and then draws them.  The whole point
+//  is to avoid some software issues for some graphics
+//  boards (particularly, ATI boards).
+
+void PixelArray::ClampAndDrawToTexture()
+{
+	ClampAllValues();							// Clamp values to range [0,1]
+	DrawToTexture();
+}
@@ -24,12 +24,7 @@
 
 #include "RgbImage.h"
 
-#ifndef RGBIMAGE_DONT_USE_OPENGL
-#if defined(_WIN32)			// If on windows, need this for gl.h
-#include <windows.h>
-#endif  // defined(_WIN32)
-#include "GL/gl.h"
-#endif
+// LoadFromOpenglBuffer and DrawToOpenglBuffer are in RgbImageOpengl.cpp.
 #ifndef BI_RGB
 #define BI_RGB 0
 #endif
@@ -352,75 +347,3 @@ bool RgbImage::AllocateImageData(int numRows, int numCols)
 // "long int" really means "unsigned long int"
 // Pixel data: 3 bytes per pixel: RGB values (in reverse order).
 //	Rows padded to multiples of four.
-
-
-#ifndef RGBIMAGE_DONT_USE_OPENGL
-
-bool RgbImage::LoadFromOpenglBuffer()					// Load the bitmap from the current OpenGL buffer
-{
-	GLint viewportData[4];
-	glGetIntegerv( GL_VIEWPORT, viewportData );
-	int vWidth = viewportData[2];
-	int vHeight = viewportData[3];
-	
-	if ( ImagePtr==0 ) { // If no memory allocated
-        bool noAllocError = AllocateImageData(vHeight, vWidth);
-        if (!noAllocError) {
-            return false;
-        }
-	}
-	assert ( vWidth>=NumCols && vHeight>=NumRows );
-	GLint oldGlRowLen;
-	if ( vWidth > NumCols ) {
-		glGetIntegerv( GL_PACK_ROW_LENGTH, &oldGlRowLen );
-		glPixelStorei( GL_PACK_ROW_LENGTH, NumCols );
-	}
-	glPixelStorei(GL_PACK_ALIGNMENT, 4);
-
-	// Get the frame buffer data.
-	glReadPixels( 0, 0, NumCols, NumRows, GL_RGB, GL_UNSIGNED_BYTE, ImagePtr);
-
-	// Restore the row length in glPixelStorei  (really ought to restore alignment too).
-	if ( vWidth > NumCols ) {
-		glPixelStorei( GL_PACK_ROW_LENGTH, oldGlRowLen );
-	}	
-	ErrorCode = NoError;
-	return true;
-}
-
-// Draw the bitmap into the current OpenGL buffer
-//    Always starts at the position (0,0).
-bool RgbImage::DrawToOpenglBuffer()	
-{
-	GLint viewportData[4];
-	glGetIntegerv( GL_VIEWPORT, viewportData );
-	int vWidth = viewportData[2];
-	int vHeight = viewportData[3];
-	
-	if ( !ImageLoaded() ) { // If no memory allocated
-		assert ( false && "RgbImage.cpp error: No RGB Image for DrawToOpenglBuffer()." );
-		ErrorCode = WriteError;
-		return false;
-	}
-
-	assert ( vWidth>=NumCols && vHeight>=NumRows );
-	GLint oldGlRowLen;			
-	if ( vWidth > NumCols ) {
-		glGetIntegerv( GL_UNPACK_ROW_LENGTH, &oldGlRowLen );
-		glPixelStorei( GL_UNPACK_ROW_LENGTH, NumCols );
-	}
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-
-	// Upload the frame buffer data.
-	glRasterPos2i(0,0);		// Position at base of window
-	glDrawPixels( NumCols, NumRows, GL_RGB, GL_UNSIGNED_BYTE, ImagePtr);
-
-	// Restore the row length in glPixelStorei  (really ought to restore alignment too).
-	if ( vWidth > NumCols ) {
-		glPixelStorei( GL_UNPACK_ROW_LENGTH, oldGlRowLen );
-	}	
-	ErrorCode = NoError;
-	return true;
-}
-
-#endif   // RGBIMAGE_DONT_USE_OPENGL
\ No newline at end of file
@@ -0,0 +1,98 @@
+/*
+ *
+ * RgbImage.h - release 4.0.  May 1, 2018.
+ *
+ * Author: Samuel R. Buss
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ * Bug reports: Sam Buss, sbuss@ucsd.edu.
+ * Web page: http://math.ucsd.edu/~sbuss/MathCG
+ *
+ */
+
+// RgbImageOpengl.cpp - the routines of RgbImage that read or draw the OpenGL buffer.
+
+#include "RgbImage.h"
+
+#ifndef RGBIMAGE_DONT_USE_OPENGL
+#if defined(_WIN32)			// If on windows, need this for gl.h
+#include <windows.h>
+#endif  // defined(_WIN32)
+#include "GL/gl.h"
+
+bool RgbImage::LoadFromOpenglBuffer()					// Load the bitmap from the current OpenGL buffer
+{
+	GLint viewportData[4];
+	glGetIntegerv( GL_VIEWPORT, viewportData );
+	int vWidth = viewportData[2];
+	int vHeight = viewportData[3];
+	
+	if ( ImagePtr==0 ) { // If no memory allocated
+        bool noAllocError = AllocateImageData(vHeight, vWidth);
+        if (!noAllocError) {
+            return false;
+        }
+	}
+	assert ( vWidth>=NumCols && vHeight>=NumRows );
+	GLint oldGlRowLen;
+	if ( vWidth > NumCols ) {
+		glGetIntegerv( GL_PACK_ROW_LENGTH, &oldGlRowLen );
+		glPixelStorei( GL_PACK_ROW_LENGTH, NumCols );
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+	// Get the frame buffer data.
+	glReadPixels( 0, 0, NumCols, NumRows, GL_RGB, GL_UNSIGNED_BYTE, ImagePtr);
+
+	// Restore the row length in glPixelStorei  (really ought to restore alignment too).
+	if ( vWidth > NumCols ) {
+		glPixelStorei( GL_PACK_ROW_LENGTH, oldGlRowLen );
+	}	
+	ErrorCode = NoError;
+	return true;
+}
+
+// Draw the bitmap into the current OpenGL buffer
+//    Always starts at the position (0,0).
+bool RgbImage::DrawToOpenglBuffer()	
+{
+	GLint viewportData[4];
+	glGetIntegerv( GL_VIEWPORT, viewportData );
+	int vWidth = viewportData[2];
+	int vHeight = viewportData[3];
+	
+	if ( !ImageLoaded() ) { // If no memory allocated
+		assert ( false && "RgbImage.cpp error: No RGB Image for DrawToOpenglBuffer()." );
+		ErrorCode = WriteError;
+		return false;
+	}
+
+	assert ( vWidth>=NumCols && vHeight>=NumRows );
+	GLint oldGlRowLen;			
+	if ( vWidth > NumCols ) {
+		glGetIntegerv( GL_UNPACK_ROW_LENGTH, &oldGlRowLen );
+		glPixelStorei( GL_UNPACK_ROW_LENGTH, NumCols );
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	// Upload the frame buffer data.
+	glRasterPos2i(0,0);		// Position at base of window
+	glDrawPixels( NumCols, NumRows, GL_RGB, GL_UNSIGNED_BYTE, ImagePtr);
+
+	// Restore the row length in glPixelStorei  (really ought to restore alignment too).
+	if ( vWidth > NumCols ) {
+		glPixelStorei( GL_UNPACK_ROW_LENGTH, oldGlRowLen );
+	}	
+	ErrorCode = NoError;
+	return true;
+}
+
+#endif   // RGBIMAGE_DONT_USE_OPENGL
@@ -26,5 +26,12 @@ void TextureAffineXform::ApplyTexture( VisiblePoint& visPoint ) const
 	double u = visPoint.GetU();
 	double v = visPoint.GetV();
 	visPoint.SetUV( m11*u+m12*v+m13, m21*u+m22*v+m23 );
+	if ( visPoint.HasUVDerivatives() ) {
+		// The derivatives are transformed by the linear part
+		VectorR2& dx = visPoint.GetdUVdx();
+		dx.Set( m11*dx.x+m12*dx.y, m21*dx.x+m22*dx.y );
+		VectorR2& dy = visPoint.GetdUVdy();
+		dy.Set( m11*dy.x+m12*dy.y, m21*dy.x+m22*dy.y );
+	}
 	return;
 }
@@ -29,5 +29,14 @@ void TextureBilinearXform::ApplyTexture( VisiblePoint& visPoint ) const
 										+vCoord*TextureCoordD)
 						+ uCoord*((1.0-vCoord)*TextureCoordB
 									+vCoord*TextureCoordC));
+	if ( visPoint.HasUVDerivatives() ) {
+		// The derivatives are transformed by the Jacobian of the bilinear map
+		VectorR2 dMapdU = (1.0-vCoord)*(TextureCoordB-TextureCoordA) + vCoord*(TextureCoordC-TextureCoordD);
+		VectorR2 dMapdV = (1.0-uCoord)*(TextureCoordD-TextureCoordA) + uCoord*(TextureCoordC-TextureCoordB);
+		VectorR2& dx = visPoint.GetdUVdx();
+		dx = dx.x*dMapdU + dx.y*dMapdV;
+		VectorR2& dy = visPoint.GetdUVdy();
+		dy = dy.x*dMapdU + dy.y*dMapdV;
+	}
 	return;
 }
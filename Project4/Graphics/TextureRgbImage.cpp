@@ -38,52 +38,107 @@ void TextureRgbImage::ApplyTexture( VisiblePoint& visPoint ) const
 	if ( TextureImage->ImageLoaded() ) {
 		const VectorR2& uv = visPoint.GetUV();
 		VectorR3 color;
-		GetTextureColor(uv.x, uv.y, &color);
-		visPoint.MakeMaterialMutable();
-        MaterialBase& visPointMat = visPoint.GetMaterialMutable();
+		if ( visPoint.HasUVDerivatives() ) {
+			GetTextureColor(uv, visPoint.GetdUVdx(), visPoint.GetdUVdy(), &color);
+		}
+		else {
+			GetTextureColor(uv.x, uv.y, &color);
+		}
         if (BlendMode == Decal) {
-            visPointMat.SetColorAmbientDiffuse(color);
+            visPoint.SetColorAmbientDiffuse(color);
         }
         else {
-            VectorR3 ambColor = visPointMat.GetColorAmbient();
+            VectorR3 ambColor = visPoint.GetColorAmbient();
             ambColor.x *= color.x;
             ambColor.y *= color.y;
             ambColor.z *= color.z;
-            visPointMat.SetColorAmbient(ambColor);
-            VectorR3 diffColor = visPointMat.GetColorDiffuse();
+            visPoint.SetColorAmbient(ambColor);
+            VectorR3 diffColor = visPoint.GetColorDiffuse();
             diffColor.x *= color.x;
             diffColor.y *= color.y;
             diffColor.z *= color.z;
-            visPointMat.SetColorDiffuse(diffColor);
+            visPoint.SetColorDiffuse(diffColor);
         }
 	}
 }
 
 void TextureRgbImage::GetTextureColor( double u, double v, VectorR3 *retColor ) const
+{
+	if ( !WrapCoords( &u, &v ) ) {
+		*retColor = BackgroundColor;
+		return;
+	}
+	GetImageColor( *TextureImage, u, v, retColor );
+}
+
+// The level of detail is log base 2 of the length in texels of the longer side
+//   of the footprint.  The two mip map levels around it are blended.
+void TextureRgbImage::GetTextureColor( const VectorR2& uvCoords, const VectorR2& dUVdx, const VectorR2& dUVdy, 
+									   VectorR3* retColor ) const
+{
+	double u = uvCoords.x;
+	double v = uvCoords.y;
+	if ( !WrapCoords( &u, &v ) ) {
+		*retColor = BackgroundColor;
+		return;
+	}
+	double numCols = (double)TextureImage->GetNumCols();
+	double numRows = (double)TextureImage->GetNumRows();
+	double lenSqX = Square(dUVdx.x*numCols) + Square(dUVdx.y*numRows);
+	double lenSqY = Square(dUVdy.x*numCols) + Square(dUVdy.y*numRows);
+	double lod = 0.5*log2( Max(lenSqX, lenSqY) );
+	int lastLevel = MipmapLevels.SizeUsed()-1;
+	if ( !(lod > 0.0) || lastLevel<=0 ) {		// Also if the footprint is zero
+		GetImageColor( *TextureImage, u, v, retColor );
+		return;
+	}
+	if ( lod >= (double)lastLevel ) {
+		GetImageColor( *MipmapLevels[lastLevel], u, v, retColor );
+		return;
+	}
+	if ( !UseBilinearFlag ) {
+		GetImageColor( *MipmapLevels[(int)(lod+0.5)], u, v, retColor );
+		return;
+	}
+	int level = (int)lod;
+	double frac = lod - (double)level;
+	VectorR3 nextColor;
+	GetImageColor( *MipmapLevels[level], u, v, retColor );
+	GetImageColor( *MipmapLevels[level+1], u, v, &nextColor );
+	*retColor *= 1.0-frac;
+	retColor->AddScaled( nextColor, frac );
+}
+
+// Wraps or clamps (u,v) into [0,1]x[0,1], according to the wrap mode.
+bool TextureRgbImage::WrapCoords( double* u, double* v ) const
 {
 	switch( WrapMode ) {
 	case WrapUV:
-		if ( u<0.0 || u>1.0 ) {
-			u = u-floor(u);
+		if ( *u<0.0 || *u>1.0 ) {
+			*u = *u-floor(*u);
 		}
-		if ( v<0.0 || v>1.0 ) {
-			v = v-floor(v);
+		if ( *v<0.0 || *v>1.0 ) {
+			*v = *v-floor(*v);
 		}
 		break;
 	case ClampUV:
-		ClampRange( &u, 0.0, 1.0 );
-		ClampRange( &v, 0.0, 1.0 );
+		ClampRange( u, 0.0, 1.0 );
+		ClampRange( v, 0.0, 1.0 );
 		break;
 	case BackgroundColorMode:
-		if ( u<0.0 || u>1.0 || v<0.0 || v>1.0 ) {
-			*retColor = BackgroundColor;
-			return;
+		if ( *u<0.0 || *u>1.0 || *v<0.0 || *v>1.0 ) {
+			return false;
 		}
 		break;
 	}
+	return true;
+}
 
-	double s = TextureImage->GetNumRows();
-	double r = TextureImage->GetNumCols();
+// Looks up (u,v) in image, which is the texture image or one of its mip map levels.
+void TextureRgbImage::GetImageColor( const RgbImage& image, double u, double v, VectorR3* retColor ) const
+{
+	double s = image.GetNumRows();
+	double r = image.GetNumCols();
 
 	if ( UseBilinearFlag ) {
 		long iLo, iHi;
@@ -96,7 +151,7 @@ void TextureRgbImage::GetTextureColor( double u, double v, VectorR3 *retColor )
 			r -= 1.0;
 			double temp = floor(u*r);
 			iLo = (long)temp;
-			ClampMax<long>( &iLo, TextureImage->GetNumCols()-2 );
+			ClampMax<long>( &iLo, image.GetNumCols()-2 );
 			iHi = iLo + 1;
 			alpha = u*r - temp;
 		}
@@ -110,22 +165,22 @@ void TextureRgbImage::GetTextureColor( double u, double v, VectorR3 *retColor )
 			s -= 1.0;
 			double temp = floor(v*s);
 			jLo = (long)temp;
-			ClampMax<long>( &jLo, TextureImage->GetNumRows()-2 );
+			ClampMax<long>( &jLo, image.GetNumRows()-2 );
 			jHi = jLo + 1;
 			beta = v*s - temp;
 		}
 
 		VectorR3 wk;
-		TextureImage->GetRgbPixel( jLo, iLo, &(wk.x), &(wk.y), &(wk.z) );
+		image.GetRgbPixel( jLo, iLo, &(wk.x), &(wk.y), &(wk.z) );
 		wk *= (1.0-alpha)*(1.0-beta);
 		*retColor = wk;
-		TextureImage->GetRgbPixel( jHi, iLo, &(wk.x), &(wk.y), &(wk.z) );
+		image.GetRgbPixel( jHi, iLo, &(wk.x), &(wk.y), &(wk.z) );
 		wk *= (1.0-alpha)*beta;
 		*retColor += wk;
-		TextureImage->GetRgbPixel( jHi, iHi, &(wk.x), &(wk.y), &(wk.z) );
+		image.GetRgbPixel( jHi, iHi, &(wk.x), &(wk.y), &(wk.z) );
 		wk *= alpha*beta;
 		*retColor += wk;
-		TextureImage->GetRgbPixel( jLo, iHi, &(wk.x), &(wk.y), &(wk.z) );
+		image.GetRgbPixel( jLo, iHi, &(wk.x), &(wk.y), &(wk.z) );
 		wk *= alpha*(1.0-beta);
 		*retColor += wk;
 	}
@@ -135,9 +190,53 @@ void TextureRgbImage::GetTextureColor( double u, double v, VectorR3 *retColor )
 		long i = (long)temp;
 		temp = floor(v*s);
 		long j = (long)temp;
-		ClampRange<long>( &i, 0, TextureImage->GetNumCols()-1 );	// Just in case (e.g. u=1)
-		ClampRange<long>( &j, 0, TextureImage->GetNumRows()-1 );
-		TextureImage->GetRgbPixel(j,i, &(retColor->x), &(retColor->y), &(retColor->z) );
+		ClampRange<long>( &i, 0, image.GetNumCols()-1 );	// Just in case (e.g. u=1)
+		ClampRange<long>( &j, 0, image.GetNumRows()-1 );
+		image.GetRgbPixel(j,i, &(retColor->x), &(retColor->y), &(retColor->z) );
 	}
 	return;
 }
+
+// Each level after level 0 averages 2x2 blocks of the level before.  A level with
+//   an odd number of rows or columns drops the last one.
+void TextureRgbImage::BuildMipmaps()
+{
+	FreeMipmaps();
+	if ( TextureImage==0 || !TextureImage->ImageLoaded() ) {
+		return;
+	}
+	MipmapLevels.Push( TextureImage );
+	const RgbImage* prev = TextureImage;
+	while ( prev->GetNumRows()>1 || prev->GetNumCols()>1 ) {
+		long numRows = Max( prev->GetNumRows()/2, 1L );
+		long numCols = Max( prev->GetNumCols()/2, 1L );
+		long lastRow = prev->GetNumRows()-1;
+		long lastCol = prev->GetNumCols()-1;
+		RgbImage* next = new RgbImage( numRows, numCols );
+		for ( long i=0; i<numRows; i++ ) {
+			long i1 = Min( 2*i+1, lastRow );
+			for ( long j=0; j<numCols; j++ ) {
+				long j1 = Min( 2*j+1, lastCol );
+				const unsigned char* c00 = prev->GetRgbPixel( 2*i, 2*j );
+				const unsigned char* c01 = prev->GetRgbPixel( 2*i, j1 );
+				const unsigned char* c10 = prev->GetRgbPixel( i1, 2*j );
+				const unsigned char* c11 = prev->GetRgbPixel( i1, j1 );
+				unsigned char avg[3];
+				for ( int k=0; k<3; k++ ) {
+					avg[k] = (unsigned char)( ((int)c00[k] + c01[k] + c10[k] + c11[k] + 2) >> 2 );
+				}
+				next->SetRgbPixelc( i, j, avg[0], avg[1], avg[2] );
+			}
+		}
+		MipmapLevels.Push( next );
+		prev = next;
+	}
+}
+
+void TextureRgbImage::FreeMipmaps()
+{
+	for ( long k=1; k<MipmapLevels.SizeUsed(); k++ ) {
+		delete MipmapLevels[k];
+	}
+	MipmapLevels.Reset();
+}
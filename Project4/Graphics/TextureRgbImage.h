@@ -25,10 +25,15 @@
 #include "RgbImage.h"
 #include "../VrMath/LinearR2.h"
 #include "../VrMath/LinearR3.h"
+#include "../DataStructs/Array.h"
 
 // TextureRgbImage makes a texture map out of an RGB image.  
 // Uses bilinear interpolation to set colors (by default)
 // Wraps around by default.
+// A mip map (a pyramid of images, each half the size of the one before) is built
+//   when the image is loaded.  If the visible point has derivatives of its (u,v) coordinates,
+//   they give the size of the footprint, and the texture is filtered by trilinear 
+//   interpolation in the mip map.  Otherwise the full size image is used.
 
 class TextureRgbImage : public TextureMapBase {
 
@@ -40,7 +45,7 @@ public:
 
 	const RgbImage& GetRgbImage() const { return *TextureImage; }
 	bool TextureMapLoaded() const { return RgbImageLoadedFromFile; }
-	void FreeRgbImage() { RgbImageLoadedFromFile = false; delete TextureImage; }
+	void FreeRgbImage();
 
 	void UseBilinearInterp( bool status );		// controls whether bilinear interpolate
 	void SetWrapMode( int mode );				// Mode should be WrapUV or ClampUV
@@ -70,16 +75,27 @@ public:
 
 	void GetTextureColor( const VectorR2& uvCoords, VectorR3* retColor ) const;  
 	void GetTextureColor( double u, double v, VectorR3 *retColor ) const;
+	// Filtered lookup:  dUVdx and dUVdy are the sides of the footprint in (u,v) coordinates.
+	void GetTextureColor( const VectorR2& uvCoords, const VectorR2& dUVdx, const VectorR2& dUVdy, 
+						  VectorR3* retColor ) const;
+
+	int GetNumMipmapLevels() const { return MipmapLevels.SizeUsed(); }
 
 private:
 	const RgbImage* TextureImage;	// Pointer to the RgbImage
 	bool RgbImageLoadedFromFile;	// true if loaded from a file.
+	Array<const RgbImage*> MipmapLevels;	// Level 0 is TextureImage.  The other levels are owned.
 
 	bool UseBilinearFlag;			// if false, then just use closest pixel
 
 	int WrapMode;
 	VectorR3 BackgroundColor;		// Color used in BackgroundColorMode
     int BlendMode;
+
+	void BuildMipmaps();
+	void FreeMipmaps();
+	bool WrapCoords( double* u, double* v ) const;	// Returns false if the background color is used
+	void GetImageColor( const RgbImage& image, double u, double v, VectorR3* retColor ) const;
 };
 
 inline TextureRgbImage::TextureRgbImage()
@@ -98,6 +114,7 @@ inline TextureRgbImage::TextureRgbImage( const RgbImage& img )
     BlendMode = Decal;
     UseBilinearFlag = true;
 	RgbImageLoadedFromFile = false;
+	BuildMipmaps();
 }
 
 inline TextureRgbImage::TextureRgbImage( const char* filename ) 
@@ -112,15 +129,24 @@ inline TextureRgbImage::TextureRgbImage( const char* filename )
 		TextureImage = 0;
 		RgbImageLoadedFromFile = false;
 	}
+	BuildMipmaps();
 }
 
 inline TextureRgbImage::~TextureRgbImage()
 {
+	FreeMipmaps();
 	if ( RgbImageLoadedFromFile ) {
 		delete TextureImage;
 	}
 }
 
+inline void TextureRgbImage::FreeRgbImage()
+{
+	FreeMipmaps();
+	RgbImageLoadedFromFile = false; 
+	delete TextureImage; 
+}
+
 inline void TextureRgbImage::UseBilinearInterp( bool status )
 {
 	UseBilinearFlag = status;
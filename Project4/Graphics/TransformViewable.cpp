@@ -41,6 +41,8 @@
 #include "../Graphics/ViewableSphere.h"
 #include "../Graphics/ViewableTorus.h"
 #include "../Graphics/ViewableTriangle.h"
+#include "../Graphics/ViewableTriangleMesh.h"
+#include "../Graphics/InstancedViewable.h"
 
 void TransformWithRigid(  ViewableBase* theObject, const RigidMapR3& theTransform )
 {
@@ -72,6 +74,12 @@ void TransformWithRigid(  ViewableBase* theObject, const RigidMapR3& theTransfor
 		case ViewableBase::Viewable_Triangle:
 			TransformWithRigid( (ViewableTriangle*)theObject, theTransform );
 			break;
+		case ViewableBase::Viewable_TriangleMesh:
+			TransformWithRigid( (ViewableTriangleMesh*)theObject, theTransform );
+			break;
+		case ViewableBase::Viewable_Instance:
+			TransformWithRigid( (InstancedViewable*)theObject, theTransform );
+			break;
 		default:
 			assert(0);
 	}
@@ -252,4 +260,22 @@ void TransformWithRigid(  ViewableTriangle* theObject, const RigidMapR3& theTran
 	theObject->Init( newA, newB, newC );
 }
 
+void TransformWithRigid(  ViewableTriangleMesh* theObject, const RigidMapR3& theTransform )
+{
+	// Transform the shared vertices, then update the triangles
+	for ( long i=0; i<theObject->NumVertices(); i++ ) {
+		VectorR3 newVert = theObject->GetVertex( i );
+		theTransform.Transform( &newVert );
+		theObject->SetVertex( i, newVert );
+	}
+	theObject->UpdateTriangles();
+}
 
+void TransformWithRigid(  InstancedViewable* theObject, const RigidMapR3& theTransform )
+{
+	// Move the instance only:  the shared object stays as it is
+	AffineMapR3 placement;
+	placement.Set( theTransform );
+	placement *= theObject->GetPlacement();
+	theObject->SetPlacement( placement );
+}
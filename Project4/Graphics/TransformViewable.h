@@ -40,6 +40,8 @@ class ViewableParallelogram;
 class ViewableSphere;
 class ViewableTorus;
 class ViewableTriangle;
+class ViewableTriangleMesh;
+class InstancedViewable;
 class BezierPatch;
 
 void TransformWithRigid(  ViewableBase* theObject, const RigidMapR3& theTransform );
@@ -52,6 +54,8 @@ void TransformWithRigid(  ViewableParallelogram* theObject, const RigidMapR3& th
 void TransformWithRigid(  ViewableSphere* theObject, const RigidMapR3& theTransform );
 void TransformWithRigid(  ViewableTorus* theObject, const RigidMapR3& theTransform );
 void TransformWithRigid(  ViewableTriangle* theObject, const RigidMapR3& theTransform );
+void TransformWithRigid(  ViewableTriangleMesh* theObject, const RigidMapR3& theTransform );
+void TransformWithRigid(  InstancedViewable* theObject, const RigidMapR3& theTransform );
 void TransformBezierPatchRecursive( const RigidMapR3& theTransform, BezierPatch* theBp );
 
 #endif    // TRANSFORM_VIEWABLE
\ No newline at end of file
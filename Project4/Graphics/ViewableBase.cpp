@@ -35,6 +35,27 @@ void ViewableBase::CalcAABB( AABB& retAABB ) const
 	CalcBoundingPlanes( dirVec, &theMin.z, &theMax.z );
 }
 
+bool ViewableBase::IntersectsBefore( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	double intersectDistance;
+	VisiblePoint tempPoint;
+	return FindIntersectionNT( viewPos, viewDir, maxDistance, &intersectDistance, tempPoint );
+}
+
+bool ViewableBase::Intersect( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const
+{
+	return FindIntersectionNT( viewPos, viewDir, maxDistance, intersectDistance, *hit.Point );
+}
+
+void ViewableBase::ComputeSurfaceNT( const VectorR3& /*viewPos*/, const VectorR3& /*viewDir*/, 
+									 double /*intersectDistance*/, const ViewableHit& hit, VisiblePoint& returnedPoint ) const
+{
+	returnedPoint = *hit.Point;
+}
+
 bool ViewableBase::CalcExtentsInBox( const AABB& aabb, AABB& retAABB ) const
 {
 	CalcAABB( retAABB );
@@ -22,7 +22,7 @@
 #define VIEWABLEBASE_H
 
 // ****************************************************************************
-// The classes    ViewableBase   and   VisiblePoint   are defined in this file.
+// The classes    ViewableBase   and   ViewableHit   are defined in this file.
 // ****************************************************************************
 
 #include <math.h>
@@ -31,6 +31,18 @@ class AABB;
 #include "TextureMapBase.h"
 #include "VisiblePoint.h"
 
+// ViewableHit holds what ViewableBase::Intersect finds out about a hit:  enough for 
+//		ComputeSurface to compute the visible point later, if the hit turns out to
+//		be the closest one.
+class ViewableHit {
+public:
+	VectorR2 uv;			// Coordinates of the hit on the object (or on its part)
+	long Part;				// The part hit, for objects made of parts (the triangle of a mesh)
+	bool FrontFace;
+	VisiblePoint* Point;	// Set by the caller.  The default Intersect computes the whole
+							//	 visible point here, and the default ComputeSurface copies it.
+};
+
 // This is the purely abstract base class for viewable objects.
 //		Any ViewableBase class is responsible for determining
 //		it it intersects a given line of sight.  Thus it must
@@ -40,6 +52,7 @@ class ViewableBase {
 
 public:
 	ViewableBase();
+	virtual ~ViewableBase() {}		// Viewables are deleted through ViewableBase pointers
 
 	// Returns an intersection if found with distance maxDistance
 	// viewDir must be a unit vector.
@@ -48,6 +61,34 @@ public:
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const;
 
+	// FindIntersectionUntextured is FindIntersection without the texture map.
+	//	 Calling ApplyTextureMap afterwards gives the same visible point as FindIntersection.
+	bool FindIntersectionUntextured ( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	void ApplyTextureMap( VisiblePoint& visPoint, const VectorR3& viewDir ) const;
+
+	// Intersect and ComputeSurface split FindIntersectionUntextured in two, for searches
+	//	 for the closest hit among many objects.  Intersect finds only the distance to the hit,
+	//	 and the values in hit.  ComputeSurface, called with the same ray and the values
+	//	 that Intersect returned, then fills in the visible point (without the texture map).
+	//	 So the position, normal and (u,v) coordinates are computed for the closest hit only.
+	// The default Intersect calls FindIntersectionNT, to compute the visible point in hit.Point;
+	//	 subclasses may override Intersect and ComputeSurfaceNT with a cheaper Intersect.
+	virtual bool Intersect( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const;
+	void ComputeSurface( const VectorR3& viewPos, const VectorR3& viewDir, double intersectDistance,
+						 const ViewableHit& hit, VisiblePoint& returnedPoint ) const;
+
+	// Returns true if the ray hits the object at a distance less than maxDistance.
+	// viewDir must be a unit vector.
+	// Used for shadow feelers: no surface information is computed, and the 
+	//	 texture map is not invoked.  The default version calls FindIntersectionNT;
+	//	 subclasses may override it with a cheaper test.
+	virtual bool IntersectsBefore( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
+
 	// Sets front and back texture maps.
 	// Subclasses of ViewablePoint will have more routines.
 	void TextureMap( const TextureMapBase* texture );	// Front & back
@@ -96,7 +137,9 @@ public:
 			Viewable_Parallelogram,
 			Viewable_Sphere,
 			Viewable_Torus,
-			Viewable_Triangle };
+			Viewable_Triangle,
+			Viewable_TriangleMesh,
+			Viewable_Instance };
 	virtual ViewableType GetViewableType() const = 0;
 
 protected:
@@ -111,6 +154,11 @@ protected:
 	virtual bool FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const = 0;
+
+	// ComputeSurfaceNT does the work of ComputeSurface.  Like FindIntersectionNT,
+	//		it does not call the texture map, or set the object of the visible point.
+	virtual void ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, double intersectDistance,
+								   const ViewableHit& hit, VisiblePoint& returnedPoint ) const;
 };
 
 inline ViewableBase::ViewableBase()
@@ -148,19 +196,45 @@ inline void ViewableBase::TextureMapInner( const TextureMapBase* texture )
 inline bool ViewableBase::FindIntersection ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const 
+{
+	bool found;
+	found = FindIntersectionUntextured(viewPos, viewDir, 
+								maxDistance, intersectDistance, returnedPoint);
+	if ( found ) {
+		ApplyTextureMap( returnedPoint, viewDir );
+	}
+	return found;
+}
+
+inline bool ViewableBase::FindIntersectionUntextured ( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const 
 {
 	bool found;
 	found = FindIntersectionNT(viewPos, viewDir, 
 								maxDistance, intersectDistance, returnedPoint);
 	if ( found ) {
 		returnedPoint.SetObject( this );
-		// Invoke the texture map (if any)
-		const TextureMapBase* texmap = returnedPoint.IsFrontFacing() ? TextureFront : TextureBack;
-		if ( texmap ) {
-			texmap->ApplyTexture( returnedPoint, viewDir );
-		}
+		returnedPoint.ClearUVDerivatives();
 	}
 	return found;
 }
 
+inline void ViewableBase::ComputeSurface( const VectorR3& viewPos, const VectorR3& viewDir, 
+		double intersectDistance, const ViewableHit& hit, VisiblePoint& returnedPoint ) const
+{
+	ComputeSurfaceNT( viewPos, viewDir, intersectDistance, hit, returnedPoint );
+	returnedPoint.SetObject( this );
+	returnedPoint.ClearUVDerivatives();
+}
+
+inline void ViewableBase::ApplyTextureMap( VisiblePoint& visPoint, const VectorR3& viewDir ) const
+{
+	// Invoke the texture map (if any)
+	const TextureMapBase* texmap = visPoint.IsFrontFacing() ? TextureFront : TextureBack;
+	if ( texmap ) {
+		texmap->ApplyTexture( visPoint, viewDir );
+	}
+}
+
 #endif // VIEWABLEBASE_H
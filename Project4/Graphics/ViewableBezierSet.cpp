@@ -25,6 +25,7 @@
 #include "../VrMath/LinearR4.h"
 
 #include <stdio.h>
+#include <mutex>
 
 // The next two variables control recusion depth for subdivision
 //	during Bezier intersection.
@@ -32,18 +33,11 @@
 int BezierPatchMgr::MaxRecurseSave = 10;
 int BezierPatchMgr::MinIsectRecurse = 18;
 
-// The next variables hold what is essentially a stack of Bezier patches.
-// They are sorted (more-or-less) in order of hit distance to their
-//		bounding parallelepiped.
-// These are meant for local use only, but are global to save on
-//		memory management overhead.
-static const int BP_MAX_NUM_PATCHES = 192;	// Maximum number of B'ezier patches that can be active
-static int BpStackSize;
-static double BpPpdDistIn[BP_MAX_NUM_PATCHES];
-static double BpPpdDistOut[BP_MAX_NUM_PATCHES];
-static BezierPatch* BezPatchStack[BP_MAX_NUM_PATCHES];
-void BpPushPatchToStack( BezierPatch*, double HitDistIn, double HitDistOut, int SortRange );
-	
+// Each thread intersects Bezier patches with its own stack and pool of patches.
+static thread_local BezierPatchMgr BezierIsectMgr;
+
+// Guards computing bounding spheres, and saving subpatches with the patch they split from.
+static std::mutex BezierSetMutex;
 
 // Returns an intersection if found with distance maxDistance
 // viewDir must be a unit vector.
@@ -54,7 +48,10 @@ bool ViewableBezierSet::FindIntersectionNT (
 {
 	// Start by computing bounding sphere if necessary
 	if ( !BoundingSphereSet ) {
-		(const_cast<ViewableBezierSet*>(this))->CalcBoundingSphere();
+		std::lock_guard<std::mutex> lock( BezierSetMutex );
+		if ( !BoundingSphereSet ) {
+			(const_cast<ViewableBezierSet*>(this))->CalcBoundingSphere();
+		}
 	}
 
 	// Check against bounding sphere
@@ -67,7 +64,8 @@ bool ViewableBezierSet::FindIntersectionNT (
 	// For each BezierPatch, check ray against bounding parallelepiped
 	//	Those that are hit by the ray are stored into an array sorted
 	//	in order of hit distance.
-	BpStackSize=0;
+	BezierPatchMgr& mgr = BezierIsectMgr;
+	mgr.ResetStack();
 	
 	double intersectDistanceIn, intersectDistanceOut;
 
@@ -81,11 +79,7 @@ bool ViewableBezierSet::FindIntersectionNT (
 								bPatch->NormalA, bPatch->MinDotA, bPatch->MaxDotA,
 								bPatch->NormalB, bPatch->MinDotB, bPatch->MaxDotB, 
 								bPatch->NormalC, bPatch->MinDotC, bPatch->MaxDotC ) ) {
-			if ( BpStackSize>=BP_MAX_NUM_PATCHES ) {
-				assert( 0 && "BP Stack Overflow (Bezier Patch)!" );
-				return false;
-			}
-			BpPushPatchToStack( const_cast<BezierPatch*>(bPatch), intersectDistanceIn, intersectDistanceOut, BpStackSize );
+			mgr.PushPatchToStack( const_cast<BezierPatch*>(bPatch), intersectDistanceIn, intersectDistanceOut, mgr.StackSize() );
 		}
 	}
 
@@ -104,26 +98,24 @@ bool ViewableBezierSet::FindIntersectionNT (
 	VectorR4 tempHg;
 	VectorR3 hitPosMaybe;
 	VectorR2 uVmaybe;
-	while ( BpStackSize>0 ) {
-		int i = BpStackSize-1;
-		if ( bestIntersection && BpPpdDistIn[i]>=bestIntersectDist ) {
+	while ( mgr.StackSize()>0 ) {
+		long i = mgr.StackSize()-1;
+		if ( bestIntersection && mgr.PpdDistIn[i]>=bestIntersectDist ) {
 			// This is too far away to still be hit.  Remove from stack and continue
-			BezierPatchMgr::ReleaseBezierPatch( BezPatchStack[BpStackSize-1] );
-			BpStackSize--;
+			mgr.PopPatchFromStack();
 			continue;
 		}
-		BezierPatch* bp = BezPatchStack[i];
+		BezierPatch* bp = mgr.PatchStack[i];
 		if ( bp->MaxDotA-bp->MinDotA + bp->MaxDotB-bp->MinDotB < 1.0e-14 ) {
 			// This patch is too small to continue subdividing. Remove from stack and continue
-			BezierPatchMgr::ReleaseBezierPatch( BezPatchStack[BpStackSize-1] );
-			BpStackSize--;
+			mgr.PopPatchFromStack();
 			continue;
 		}
 		
 		if ( !bp->MgrNeedToRecurse() ) {
 			// Intersect with the midpoint of where enters and exits patch
 			double alpha;
-			alpha = 0.5*( Max(BpPpdDistIn[i],0.0) + Min(BpPpdDistOut[i],maxDist) );
+			alpha = 0.5*( Max(mgr.PpdDistIn[i],0.0) + Min(mgr.PpdDistOut[i],maxDist) );
 			assert ( alpha>= 0.0 );
 			hitPosMaybe = viewDir;
 			hitPosMaybe *= alpha;
@@ -161,8 +153,7 @@ bool ViewableBezierSet::FindIntersectionNT (
 					}
 				}
 				// Done with this patch.  Remove from stack and continue looping
-				BezierPatchMgr::ReleaseBezierPatch( BezPatchStack[BpStackSize-1] );
-				BpStackSize--;
+				mgr.PopPatchFromStack();
 				continue;
 			}
 		}
@@ -170,40 +161,29 @@ bool ViewableBezierSet::FindIntersectionNT (
 		// Split the patch into two
 		BezierPatch* bpX0;	
 		BezierPatch* bpX1;
-		BezierPatchMgr::GetTwoSubPatchs( *bp, &bpX0, &bpX1 );
-		BezierPatchMgr::ReleaseBezierPatch( BezPatchStack[BpStackSize-1] );
-		BpStackSize--;						// Pop off old patch
-		bpX0->CalcBoundingPpd();
-		bpX1->CalcBoundingPpd();
+		mgr.GetTwoSubPatchs( *bp, &bpX0, &bpX1 );	// Their bounding parallelepipeds are already computed
+		mgr.PopPatchFromStack();					// Pop off old patch
 		int sortRange = 0;
 		if ( ViewableParallelepiped::QuickIntersectTest( viewPos, viewDir, maxDist,
 								&intersectDistanceIn, &intersectDistanceOut, 
 								bpX0->NormalA, bpX0->MinDotA, bpX0->MaxDotA,
 								bpX0->NormalB, bpX0->MinDotB, bpX0->MaxDotB, 
 								bpX0->NormalC, bpX0->MinDotC, bpX0->MaxDotC ) ) {
-			if ( BpStackSize>=BP_MAX_NUM_PATCHES ) {
-				assert( 0 && "BP Stack Overflow (Bezier Patch)!" );
-				return false;
-			}
-			BpPushPatchToStack( bpX0, intersectDistanceIn, intersectDistanceOut, 0 );
+			mgr.PushPatchToStack( bpX0, intersectDistanceIn, intersectDistanceOut, 0 );
 			sortRange = 1;
 		}
 		else {
-			BezierPatchMgr::ReleaseBezierPatch( bpX0 );
+			mgr.ReleaseBezierPatch( bpX0 );
 		}
 		if ( ViewableParallelepiped::QuickIntersectTest( viewPos, viewDir, maxDist,
 								&intersectDistanceIn, &intersectDistanceOut, 
 								bpX1->NormalA, bpX1->MinDotA, bpX1->MaxDotA,
 								bpX1->NormalB, bpX1->MinDotB, bpX1->MaxDotB, 
 								bpX1->NormalC, bpX1->MinDotC, bpX1->MaxDotC ) ) {
-			if ( BpStackSize>=BP_MAX_NUM_PATCHES ) {
-				assert( 0 && "BP Stack Overflow (Bezier Patch)!" );
-				return false;
-			}
-			BpPushPatchToStack( bpX1, intersectDistanceIn, intersectDistanceOut, sortRange );
+			mgr.PushPatchToStack( bpX1, intersectDistanceIn, intersectDistanceOut, sortRange );
 		}
 		else {
-			BezierPatchMgr::ReleaseBezierPatch( bpX1 );
+			mgr.ReleaseBezierPatch( bpX1 );
 		}
 	}
 
@@ -218,24 +198,110 @@ bool ViewableBezierSet::FindIntersectionNT (
 
 // Maintains an *approximate* priority queue.
 //	sortRange indicates how far back to search for insertion point.
-void BpPushPatchToStack( BezierPatch* thePatch, double hitDistIn, double hitDistOut, int sortRange ) {
-	int i;
+void BezierPatchMgr::PushPatchToStack( BezierPatch* thePatch, double hitDistIn, double hitDistOut, int sortRange ) {
+	long stackSize = StackSize();
+	long i;
 	int j = sortRange;
 	// Compute the index i where to put thePatch.
-	for ( i=BpStackSize; i>0 && j>0 ; i--, j-- ) {
-		if ( hitDistIn<=BpPpdDistIn[i-1] ) {
+	for ( i=stackSize; i>0 && j>0 ; i--, j-- ) {
+		if ( hitDistIn<=PpdDistIn[i-1] ) {
 			break;
 		}
 	}
-	for ( j=BpStackSize-1; j>=i; j-- ) {
-		BpPpdDistIn[j+1] = BpPpdDistIn[j];
-		BpPpdDistOut[j+1] = BpPpdDistOut[j];
-		BezPatchStack[j+1] = BezPatchStack[j];
+	PpdDistIn.Push();
+	PpdDistOut.Push();
+	PatchStack.Push();
+	for ( long k=stackSize-1; k>=i; k-- ) {
+		PpdDistIn[k+1] = PpdDistIn[k];
+		PpdDistOut[k+1] = PpdDistOut[k];
+		PatchStack[k+1] = PatchStack[k];
+	}
+	PpdDistIn[i] = hitDistIn;
+	PpdDistOut[i] = hitDistOut;
+	PatchStack[i] = thePatch;
+}
+
+// Splits bpIn into two subpatches, and computes their bounding parallelepipeds.
+//   If bpIn is at a recursion level below MaxRecurseSave, the subpatches are saved
+//	 with bpIn, and are returned by later calls, from any thread.
+void BezierPatchMgr::GetTwoSubPatchs ( BezierPatch& bpIn, 
+									   BezierPatch** bpOut1, BezierPatch** bpOut2 ) 
+{
+	BezierPatch* savedA = bpIn.SplitPatchA;
+	if ( savedA ) {
+		*bpOut1 = savedA;
+		*bpOut2 = bpIn.SplitPatchB;
+		return;
+	}
+
+	bool saveSplit = ( bpIn.MgrRecurseLevel<MaxRecurseSave );
+	if ( saveSplit ) {
+		*bpOut1 = new BezierPatch();
+		*bpOut2 = new BezierPatch();
+	}
+	else {
+		*bpOut1 = NewPatch();
+		*bpOut2 = NewPatch();
+	}
+	int i = bpIn.MgrRecurseLevel + 1;
+	(*bpOut1)->MgrRecurseLevel = i;
+	(*bpOut2)->MgrRecurseLevel = i;
+	VectorR4 temp;
+	double sizeA, sizeB;
+	temp = bpIn.CntlPts[3][0];
+	temp -= bpIn.CntlPts[0][0];
+	sizeA = temp.NormSq();
+	temp = bpIn.CntlPts[3][3];
+	temp -= bpIn.CntlPts[0][3];
+	sizeA += temp.NormSq();
+	temp = bpIn.CntlPts[0][3];
+	temp -= bpIn.CntlPts[0][0];
+	sizeB = temp.NormSq();
+	temp = bpIn.CntlPts[3][3];
+	temp -= bpIn.CntlPts[3][0];
+	sizeB += temp.NormSq();
+	if ( sizeA >= sizeB ) {		
+		bpIn.MakeSplitU(*bpOut1,*bpOut2);		// Split in U direction
+	}
+	else {
+		bpIn.MakeSplitV(*bpOut1,*bpOut2);		// Split in V direction
+	}
+	(*bpOut1)->CalcBoundingPpd();
+	(*bpOut2)->CalcBoundingPpd();
+
+	if ( saveSplit ) {
+		// Save for next time.  If another thread saved a split first, use its split instead.
+		std::lock_guard<std::mutex> lock( BezierSetMutex );
+		if ( bpIn.SplitPatchA==0 ) {
+			bpIn.SplitPatchB = *bpOut2;
+			bpIn.SplitPatchA = *bpOut1;			// Set after SplitPatchB
+		}
+		else {
+			delete *bpOut1;
+			delete *bpOut2;
+			*bpOut1 = bpIn.SplitPatchA;
+			*bpOut2 = bpIn.SplitPatchB;
+		}
+	}
+}
+
+BezierPatch* BezierPatchMgr::NewPatch()
+{
+	if ( FreePatches.IsEmpty() ) {
+		BezierPatch* block = new BezierPatch[PatchBlockSize];
+		PatchBlocks.Push( block );
+		for ( int i=PatchBlockSize-1; i>=0; i-- ) {
+			FreePatches.Push( block+i );
+		}
+	}
+	return FreePatches.Pop();
+}
+
+BezierPatchMgr::~BezierPatchMgr()
+{
+	for ( long i=0; i<PatchBlocks.SizeUsed(); i++ ) {
+		delete[] PatchBlocks[i];
 	}
-	BpPpdDistIn[i] = hitDistIn;
-	BpPpdDistOut[i] = hitDistOut;
-	BezPatchStack[i] = thePatch;
-	BpStackSize++;
 }
 
 void ViewableBezierSet::CalcBoundingSphere() {
@@ -26,6 +26,7 @@
 #include "../DataStructs/Array.h"
 #include "../VrMath/Parallelepiped.h"
 #include "../DataStructs/CLinkedList.h"
+#include <atomic>
 
 class BezierPatch;
 class BezierPatchMgr;
@@ -116,7 +117,7 @@ protected:
 	const MaterialBase* FrontMaterial;
 	const MaterialBase* BackMaterial;
 
-	bool BoundingSphereSet;				// Bounding sphere calculated?
+	std::atomic<bool> BoundingSphereSet;	// Bounding sphere calculated?
 	bool BoundingSphereManuallySet;		// Bounding sphere center been set by the user?
 	VectorR3 BoundingSphereCenter;		// Center of bounding sphere
 	double BoundingSphereRadiusSq;		// Square of radius of bounding sphere
@@ -133,6 +134,25 @@ protected:
 // ***********************************************************************************
 class RigidMapR3;
 
+// BezierSubpatchPtr points to the first subpatch of a split patch.  It is set by
+//	 whichever thread first splits the patch while other threads may read it, so it is
+//	 atomic:  the second subpatch is stored before it, and read after it.
+class BezierSubpatchPtr {
+public:
+	BezierSubpatchPtr() : Ptr(0) {}
+	BezierSubpatchPtr( const BezierSubpatchPtr& p ) : Ptr( p.Get() ) {}
+	BezierSubpatchPtr& operator=( const BezierSubpatchPtr& p ) { Set( p.Get() ); return *this; }
+	BezierSubpatchPtr& operator=( BezierPatch* p ) { Set( p ); return *this; }
+
+	BezierPatch* Get() const { return Ptr.load( std::memory_order_acquire ); }
+	void Set( BezierPatch* p ) { Ptr.store( p, std::memory_order_release ); }
+	operator BezierPatch*() const { return Get(); }
+	BezierPatch* operator->() const { return Get(); }
+
+private:
+	std::atomic<BezierPatch*> Ptr;
+};
+
 class BezierPatch {
 	friend class ViewableBezierSet;
 	friend class BezierPatchMgr;
@@ -193,8 +213,8 @@ protected:
 	int MgrRecurseLevel;			// Recursion level ==0 for "original" patch
 	bool IsMgrAutoAllocated();		// If allocated by the BezierPatchMgr
 	bool MgrNeedToRecurse();		// If needs more recursion
-	BezierPatch* SplitPatchA;		// Pointer to first subpatch
-	BezierPatch* SplitPatchB;		// Pointer to second subpatch
+	BezierSubpatchPtr SplitPatchA;	// Pointer to first subpatch
+	BezierPatch* SplitPatchB;		// Pointer to second subpatch (valid once SplitPatchA is set)
 	bool IsSplitIntoTwo() const { return (SplitPatchA!=0); } 
 
 	void MakeSplitU ( BezierPatch* u0, BezierPatch* u1 );
@@ -209,16 +229,44 @@ protected:
 // * BezierPatchMgr class -  Manages allocating and freeing Bezier patchs			 *
 // ***********************************************************************************
 
+// Each thread has its own BezierPatchMgr, which holds the stack of patches for
+//	 ViewableBezierSet::FindIntersectionNT.  The stack grows as needed.
+// Subpatches up to recursion level MaxRecurseSave are saved with the patch they
+//	 split from, and shared by all threads.  Deeper subpatches are only needed during
+//	 one intersection:  they come from, and are released to, the BezierPatchMgr's pool.
 class BezierPatchMgr {
 	friend class ViewableBezierSet;
 public:
 	static int MaxRecurseSave;
 	static int MinIsectRecurse;
 
+	BezierPatchMgr() {}
+	~BezierPatchMgr();
+
 protected:
-	static void GetTwoSubPatchs ( BezierPatch& bpIn, 
-								  BezierPatch** bpOut1,BezierPatch** bpOut2 );
-	static void ReleaseBezierPatch ( BezierPatch* bp );
+	void GetTwoSubPatchs ( BezierPatch& bpIn, 
+						   BezierPatch** bpOut1, BezierPatch** bpOut2 );
+	void ReleaseBezierPatch ( BezierPatch* bp );
+
+	// The stack of patches, sorted (more-or-less) in order of hit distance
+	//	 to their bounding parallelepiped.
+	long StackSize() const { return PatchStack.SizeUsed(); }
+	void PushPatchToStack( BezierPatch* thePatch, double hitDistIn, double hitDistOut, int sortRange );
+	void PopPatchFromStack();
+	void ResetStack() { PpdDistIn.Reset(); PpdDistOut.Reset(); PatchStack.Reset(); }
+	Array<double> PpdDistIn;
+	Array<double> PpdDistOut;
+	Array<BezierPatch*> PatchStack;
+
+	// The pool of patches deeper than MaxRecurseSave.  They are allocated in blocks.
+	static const int PatchBlockSize = 64;
+	BezierPatch* NewPatch();
+	Array<BezierPatch*> FreePatches;
+	Array<BezierPatch*> PatchBlocks;
+
+private:
+	BezierPatchMgr( const BezierPatchMgr& );			// Not copyable
+	BezierPatchMgr& operator=( const BezierPatchMgr& );
 };
 
 // ***********************************************************************************
@@ -302,59 +350,24 @@ inline bool BezierPatch::MgrNeedToRecurse () {
 				&& MaxDotC-MinDotC > 1.0e-10 ) ;
 }
 
+inline bool BezierPatch::IsMgrAutoAllocated() {
+	return ( MgrRecurseLevel!=0 );
+}
+
 // ***********************************************************************************
-// * BezierPatch class - Member functions											 *
+// * BezierPatchMgr class - Member functions										 *
 // ***********************************************************************************
 
-inline void BezierPatchMgr::GetTwoSubPatchs ( BezierPatch& bpIn, 
-											 BezierPatch** bpOut1,BezierPatch** bpOut2 ) 
-{
-	if ( bpIn.SplitPatchA==0 ) {
-		*bpOut1 = new BezierPatch();
-		*bpOut2 = new BezierPatch();
-		int i = bpIn.MgrRecurseLevel + 1;
-		(*bpOut1)->MgrRecurseLevel = i;
-		(*bpOut2)->MgrRecurseLevel = i;
-		VectorR4 temp;
-		double sizeA, sizeB;
-		temp = bpIn.CntlPts[3][0];
-		temp -= bpIn.CntlPts[0][0];
-		sizeA = temp.NormSq();
-		temp = bpIn.CntlPts[3][3];
-		temp -= bpIn.CntlPts[0][3];
-		sizeA += temp.NormSq();
-		temp = bpIn.CntlPts[0][3];
-		temp -= bpIn.CntlPts[0][0];
-		sizeB = temp.NormSq();
-		temp = bpIn.CntlPts[3][3];
-		temp -= bpIn.CntlPts[3][0];
-		sizeB += temp.NormSq();
-		if ( sizeA >= sizeB ) {		
-			bpIn.MakeSplitU(*bpOut1,*bpOut2);		// Split in U direction
-		}
-		else {
-			bpIn.MakeSplitV(*bpOut1,*bpOut2);		// Split in V direction
-		}
-		if ( bpIn.MgrRecurseLevel<MaxRecurseSave ) {
-			// Save for next time
-			bpIn.SplitPatchA = *bpOut1;
-			bpIn.SplitPatchB = *bpOut2;
-		}
-	}
-	else {
-		*bpOut1 = bpIn.SplitPatchA;
-		*bpOut2 = bpIn.SplitPatchB;
-	}
-}
-
 inline void BezierPatchMgr::ReleaseBezierPatch ( BezierPatch* bp ) {
 	if ( bp->MgrRecurseLevel>MaxRecurseSave ) {
-		delete bp;
+		FreePatches.Push( bp );
 	}
 }
 
-inline bool BezierPatch::IsMgrAutoAllocated() {
-	return ( MgrRecurseLevel!=0 );
+inline void BezierPatchMgr::PopPatchFromStack() {
+	ReleaseBezierPatch( PatchStack.Pop() );
+	PpdDistIn.Pop();
+	PpdDistOut.Pop();
 }
 
 #endif // VIEWABLEBEZIERPATCH_H
@@ -68,6 +68,19 @@ bool ViewableParallelogram::IsWellFormed() const
 bool ViewableParallelogram::FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const
+{
+	ViewableHit hit;
+	if ( !Intersect( viewPos, viewDir, maxDistance, intersectDistance, hit ) ) {
+		return false;
+	}
+	ComputeSurfaceNT( viewPos, viewDir, *intersectDistance, hit, returnedPoint );
+	return true;
+}
+
+// The u-v coordinates of the hit are returned in hit.uv.
+bool ViewableParallelogram::Intersect( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const
 {
 	assert( IsWellFormed() );
 	double mdotn = (viewDir^Normal);
@@ -78,13 +91,11 @@ bool ViewableParallelogram::FindIntersectionNT (
 		if ( planarDist<=0 || planarDist >= -maxDistance*mdotn ) {
 			return false;
 		}
-		returnedPoint.SetFrontFace();
 	}
 	else {
 		if ( BackFaceCulled() || planarDist>=0 || -planarDist >= maxDistance*mdotn ) {
 			return false;
 		}
-		returnedPoint.SetBackFace();
 	}
 
 	*intersectDistance = -planarDist/mdotn;
@@ -102,18 +113,65 @@ bool ViewableParallelogram::FindIntersectionNT (
 		return false;
 	}
 
-	// Front/Back face info already set above
-	returnedPoint.SetPosition( v );
-	returnedPoint.SetMaterial( (mdotn<=0) ? *FrontMat : *BackMat );
-	returnedPoint.SetNormal( Normal );
-
 	// Compute the u-v coordinates
 	double uCoord = (dotBCnormal-CoefDA)/(CoefBC-CoefDA);
 	double vCoord = (dotABnormal-CoefAB)/(CoefCD-CoefAB);
-	returnedPoint.SetUV(uCoord, vCoord);
+	hit.uv.Set( uCoord, vCoord );
+	hit.FrontFace = ( mdotn<=0.0 );
+	return true;
+}
+
+void ViewableParallelogram::ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, 
+		double intersectDistance, const ViewableHit& hit, VisiblePoint& returnedPoint ) const
+{
+	VectorR3 v;		
+	v = viewDir;
+	v *= intersectDistance;
+	v += viewPos;				// Point of view line intersecting plane
+	returnedPoint.SetPosition( v );
+	if ( hit.FrontFace ) {
+		returnedPoint.SetFrontFace();
+		returnedPoint.SetMaterial( *FrontMat );
+	}
+	else {
+		returnedPoint.SetBackFace();
+		returnedPoint.SetMaterial( *BackMat );
+	}
+	returnedPoint.SetNormal( Normal );
+	returnedPoint.SetUV( hit.uv );
 	returnedPoint.SetFaceNumber( 0 );
+}
 
-	return true;
+// Same tests as FindIntersectionNT, without setting a VisiblePoint
+bool ViewableParallelogram::IntersectsBefore( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	assert( IsWellFormed() );
+	double mdotn = (viewDir^Normal);
+	double planarDist = (viewPos^Normal)-PlaneCoef;
+
+	if ( mdotn<=0.0 ) {
+		if ( planarDist<=0 || planarDist >= -maxDistance*mdotn ) {
+			return false;
+		}
+	}
+	else {
+		if ( BackFaceCulled() || planarDist>=0 || -planarDist >= maxDistance*mdotn ) {
+			return false;
+		}
+	}
+
+	VectorR3 v;		
+	v = viewDir;
+	v *= -planarDist/mdotn;
+	v += viewPos;				// Point of view line intersecting plane
+
+	double dotABnormal = v^NormalAB;
+	if ( dotABnormal<CoefAB || dotABnormal>CoefCD ) {
+		return false;
+	}
+	double dotBCnormal = v^NormalBC;
+	return ( dotBCnormal>=CoefBC && dotBCnormal<=CoefDA );
 }
 
 bool ViewableParallelogram::CalcPartials( const VisiblePoint& /*vvisPointv*/, 
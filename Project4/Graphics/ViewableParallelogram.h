@@ -55,6 +55,9 @@ public:
 	virtual bool FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	bool Intersect( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+					double *intersectDistance, ViewableHit& hit ) const;
+	bool IntersectsBefore( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
 	void CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const;
 	bool CalcExtentsInBox( const AABB& boundingAABB, AABB& retAABB ) const;
 	bool CalcPartials( const VisiblePoint& visPoint, 
@@ -87,6 +90,8 @@ protected:
 	double LengthAB, LengthBC;		// Edge lengths
 
 	void PreCalcInfo();				// Precalculations for intersection testing speed
+	void ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, double intersectDistance,
+						   const ViewableHit& hit, VisiblePoint& returnedPoint ) const;
 };
 
 inline ViewableParallelogram::ViewableParallelogram () 
@@ -29,6 +29,20 @@
 bool ViewableSphere::FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDist,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const 
+{
+	ViewableHit hit;
+	if ( !Intersect( viewPos, viewDir, maxDist, intersectDistance, hit ) ) {
+		return false;
+	}
+	ComputeSurfaceNT( viewPos, viewDir, *intersectDistance, hit, returnedPoint );
+	return true;
+}
+
+// Only the distance, and whether the ray enters or exits the sphere, are found here.
+//	 The normal and the u-v coordinates are left for ComputeSurfaceNT.
+bool ViewableSphere::Intersect( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDist,
+		double *intersectDistance, ViewableHit& hit ) const 
 {
 	VectorR3 tocenter(Center);
 	tocenter -= viewPos;		// Vector view position to the center
@@ -51,39 +65,17 @@ bool ViewableSphere::FindIntersectionNT (
 	if ( D>0.0 && D*D>BSq && 
 		(D<maxDist || BSq>Square(D-maxDist) ) ) {
 		
-		// Return the point where view intersects with the outside of
-		//		the sphere.
+		// The view intersects with the outside of the sphere.
 		*intersectDistance = D-sqrt(BSq);
-		v = viewDir;
-		v *= *intersectDistance;
-		v += viewPos;					//  Position of intersection
-		returnedPoint.SetPosition( v );
-		v -= Center;					
-		v /= Radius;	// Normalize: normal out from intersection pt
-		v.ReNormalize();
-		returnedPoint.SetNormal( v );
-		returnedPoint.SetMaterial ( *OuterMaterial );
-		returnedPoint.SetFrontFace();	// Front face direction
-		CalcUV( v, &(returnedPoint.GetUV()) );
-		returnedPoint.SetFaceNumber( 0 );
+		hit.FrontFace = true;
 		return true;
 	}
 
 	else if ( (D>0.0 || D*D<BSq) && D<maxDist && BSq<Square(D-maxDist) ) {
 
-		// return the point where view exits the sphere
+		// The view exits the sphere
 		*intersectDistance = D+sqrt(BSq);
-		v = viewDir;
-		v *= *intersectDistance;
-		v += viewPos;
-		returnedPoint.SetPosition( v );
-		v -= Center;
-		v /= Radius;	// Normalize, but still points outward
-		v.ReNormalize(); // Just in case
-		returnedPoint.SetNormal( v );
-		returnedPoint.SetMaterial ( *InnerMaterial );
-		returnedPoint.SetBackFace();
-		CalcUV( v, &(returnedPoint.GetUV()) );
+		hit.FrontFace = false;
 		return true;
 	}
 
@@ -92,6 +84,29 @@ bool ViewableSphere::FindIntersectionNT (
 	}
 }
 
+void ViewableSphere::ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, 
+		double intersectDistance, const ViewableHit& hit, VisiblePoint& returnedPoint ) const
+{
+	VectorR3 v = viewDir;
+	v *= intersectDistance;
+	v += viewPos;					//  Position of intersection
+	returnedPoint.SetPosition( v );
+	v -= Center;					
+	v /= Radius;	// Normalize: normal out from intersection pt
+	v.ReNormalize();
+	returnedPoint.SetNormal( v );
+	if ( hit.FrontFace ) {
+		returnedPoint.SetMaterial ( *OuterMaterial );
+		returnedPoint.SetFrontFace();	// Front face direction
+	}
+	else {
+		returnedPoint.SetMaterial ( *InnerMaterial );
+		returnedPoint.SetBackFace();
+	}
+	CalcUV( v, &(returnedPoint.GetUV()) );
+	returnedPoint.SetFaceNumber( 0 );
+}
+
 bool ViewableSphere::QuickIntersectTest( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDist,
 		double *intersectDistance,
@@ -39,6 +39,9 @@ public:
 	virtual bool FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	bool Intersect( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+					double *intersectDistance, ViewableHit& hit ) const;
+	bool IntersectsBefore( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
 	void CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const;
 	bool CalcExtentsInBox( const AABB& boundingAABB, AABB& retAABB ) const;
 	bool CalcPartials( const VisiblePoint& visPoint, 
@@ -107,6 +110,9 @@ protected:
 	VectorR3 AxisB;			// Axis for u = 3/4. (like x-axis)
 	VectorR3 AxisC;			// Axis for v.		(like y-axis)
 
+	void ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, double intersectDistance,
+						   const ViewableHit& hit, VisiblePoint& returnedPoint ) const;
+
 };
 
 inline
@@ -221,5 +227,12 @@ inline bool ViewableSphere::QuickIntersectTest(
 							   intersectDistance, Center, RadiusSq );
 }
 
+inline bool ViewableSphere::IntersectsBefore( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	double intersectDistance;
+	return QuickIntersectTest( viewPos, viewDir, maxDistance, &intersectDistance );
+}
+
 
 #endif // VIEWABLESPHERE_H
@@ -69,6 +69,19 @@ bool ViewableTriangle::IsWellFormed() const
 bool ViewableTriangle::FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const
+{
+	ViewableHit hit;
+	if ( !Intersect( viewPos, viewDir, maxDistance, intersectDistance, hit ) ) {
+		return false;
+	}
+	ComputeSurfaceNT( viewPos, viewDir, *intersectDistance, hit, returnedPoint );
+	return true;
+}
+
+// The barycentric coordinates of the hit are returned in hit.uv.
+bool ViewableTriangle::Intersect( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const
 {
 	assert( IsWellFormed() );
 	double mdotn = (viewDir^Normal);
@@ -105,11 +118,22 @@ bool ViewableTriangle::FindIntersectionNT (
 		return false;
 	}
 
+	hit.uv.Set( vCoord, wCoord );
+	hit.FrontFace = frontFace;
+	return true;
+}
+
+void ViewableTriangle::ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, 
+		double intersectDistance, const ViewableHit& hit, VisiblePoint& returnedPoint ) const
+{
+	VectorR3 q;
+	q = viewDir;
+	q *= intersectDistance;
+	q += viewPos;						// Point of view line intersecting plane
 	returnedPoint.SetPosition( q );		// Set point of intersection
-	returnedPoint.SetUV( vCoord, wCoord );
+	returnedPoint.SetUV( hit.uv );
 
-	// Front/Back face info already set above
-	if ( frontFace ) {
+	if ( hit.FrontFace ) {
 		returnedPoint.SetMaterial( *FrontMat );
 		returnedPoint.SetFrontFace();
 	}
@@ -119,8 +143,38 @@ bool ViewableTriangle::FindIntersectionNT (
 	}
 	returnedPoint.SetNormal( Normal );
 	returnedPoint.SetFaceNumber( 0 );
+}
 
-	return true;
+// Same tests as FindIntersectionNT, without setting a VisiblePoint
+bool ViewableTriangle::IntersectsBefore( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	assert( IsWellFormed() );
+	double mdotn = (viewDir^Normal);
+	double planarDist = (viewPos^Normal)-PlaneCoef;
+
+	if ( mdotn<=0.0 ) {
+		if ( planarDist<=0 || planarDist >= -maxDistance*mdotn ) {
+			return false;
+		}
+	}
+	else {
+		if ( BackFaceCulled() || planarDist>=0 || -planarDist >= maxDistance*mdotn ) {
+			return false;
+		}
+	}
+
+	VectorR3 v;
+	v = viewDir;
+	v *= -planarDist/mdotn;
+	v += viewPos;						// Point of view line intersecting plane
+	v -= VertexA;
+	double vCoord = (v^Ubeta);
+	if ( vCoord<0.0 ) {
+		return false;
+	}
+	double wCoord = (v^Ugamma);
+	return ( wCoord>=0.0 && vCoord+wCoord<=1.0 );
 }
 
 void ViewableTriangle::CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const
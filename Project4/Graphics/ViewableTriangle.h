@@ -52,6 +52,9 @@ public:
 	virtual bool FindIntersectionNT ( 
 		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
 		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	bool Intersect( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+					double *intersectDistance, ViewableHit& hit ) const;
+	bool IntersectsBefore( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
 	void CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const;
 	bool CalcExtentsInBox( const AABB& boundingAABB, AABB& retAABB ) const;
 	bool CalcPartials( const VisiblePoint& visPoint, 
@@ -80,6 +83,8 @@ protected:
 	VectorR3 Ugamma;	// Vector for finding gamma coef
 
 	void PreCalcInfo();				// Precalculations for intersection testing speed
+	void ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, double intersectDistance,
+						   const ViewableHit& hit, VisiblePoint& returnedPoint ) const;
 };
 
 inline ViewableTriangle::ViewableTriangle() {
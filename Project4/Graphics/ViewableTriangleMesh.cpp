@@ -0,0 +1,366 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Author: Samuel R. Buss
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ * Bug reports: Sam Buss, sbuss@ucsd.edu.
+ * Web page: http://math.ucsd.edu/~sbuss/MathCG
+ *
+ */
+
+#include <float.h>
+#include "ViewableTriangleMesh.h"
+#include "Extents.h"
+#include "../VrMath/Aabb.h"
+
+// PreCalcInfo sets the (non-unit) normal N = AB x AC of triangle t from its vertices.
+void ViewableTriangleMesh::PreCalcInfo( long t )
+{
+	const VectorR3& vA = Vertices[TriangleVerts[3*t]];
+	VectorR3 edgeAB = Vertices[TriangleVerts[3*t+1]] - vA;
+	VectorR3 edgeAC = Vertices[TriangleVerts[3*t+2]] - vA;
+	TriangleNormals[t] = edgeAB*edgeAC;
+}
+
+void ViewableTriangleMesh::UpdateTriangles()
+{
+	for ( long t=0; t<NumTriangles(); t++ ) {
+		PreCalcInfo( t );
+	}
+	if ( KdTreeBuilt ) {
+		TriangleKdTree.DeleteTree();		// Its boxes no longer hold the triangles
+		KdTreeBuilt = false;
+	}
+}
+
+long ViewableTriangleMesh::AddTriangle( long vertA, long vertB, long vertC,
+									    const MaterialBase* frontmaterial, const MaterialBase* backmaterial )
+{
+	assert( 0<=vertA && vertA<NumVertices() && 0<=vertB && vertB<NumVertices() && 0<=vertC && vertC<NumVertices() );
+	VectorR3 edgeAB = Vertices[vertB] - Vertices[vertA];
+	VectorR3 edgeAC = Vertices[vertC] - Vertices[vertA];
+	if ( (edgeAB*edgeAC).NormSq()==0.0 ) {
+		return -1;				// Zero area
+	}
+
+	// Find the pair of materials, or add it.
+	int matIdx;
+	for ( matIdx=MaterialsFront.SizeUsed()-1; matIdx>=0; matIdx-- ) {
+		if ( MaterialsFront[matIdx]==frontmaterial && MaterialsBack[matIdx]==backmaterial ) {
+			break;
+		}
+	}
+	if ( matIdx<0 ) {
+		matIdx = MaterialsFront.SizeUsed();
+		MaterialsFront.Push( frontmaterial );
+		MaterialsBack.Push( backmaterial );
+	}
+
+	long t = NumTriangles();
+	TriangleVerts.Push( vertA );
+	TriangleVerts.Push( vertB );
+	TriangleVerts.Push( vertC );
+	TriangleMaterials.Push( matIdx );
+	TriangleNormals.Push( edgeAB*edgeAC );
+	return t;
+}
+
+// The unit normal, found as for a ViewableTriangle.
+VectorR3 ViewableTriangleMesh::GetTriangleNormal( long t ) const
+{
+	VectorR3 vA, vB, vC;
+	GetTriangleVertices( t, &vA, &vB, &vC );
+	VectorR3 edgeAB = vB - vA;
+	VectorR3 edgeBC = vC - vB;
+	VectorR3 edgeCA = vA - vC;
+	VectorR3 normal;
+	if ( (edgeAB^edgeBC) < (edgeBC^edgeCA) ) {
+		normal = edgeAB*edgeBC;
+	}
+	else {
+		normal = edgeBC*edgeCA;
+	}
+	normal.Normalize();
+	return normal;
+}
+
+// Fills in the visible point for a hit on triangle t, at distance hitDist,
+//		with barycentric coordinates u and v.
+void ViewableTriangleMesh::SetHitPoint( long t, const VectorR3& viewPos, const VectorR3& viewDir,
+									    double hitDist, double u, double v, bool frontFace,
+										VisiblePoint& returnedPoint ) const
+{
+	VectorR3 q;
+	q = viewDir;
+	q *= hitDist;
+	q += viewPos;						// Point of view line intersecting triangle
+	returnedPoint.SetPosition( q );
+	returnedPoint.SetUV( u, v );
+	if ( frontFace ) {
+		returnedPoint.SetMaterial( *GetMaterialFront(t) );
+		returnedPoint.SetFrontFace();
+	}
+	else {
+		returnedPoint.SetMaterial( *GetMaterialBack(t) );
+		returnedPoint.SetBackFace();
+	}
+	returnedPoint.SetNormal( GetTriangleNormal(t) );
+	returnedPoint.SetFaceNumber( (int)t );
+	returnedPoint.SetObject( this );
+	returnedPoint.ClearUVDerivatives();
+}
+
+// Moller-Trumbore intersection of a ray with triangle t, in the form that uses
+//	 the precomputed normal N = AB x AC.  With C = A - viewPos and R = viewDir x C,
+//	 the hit distance is (C.N)/det, and the barycentric coordinates are
+//	 u = -(R.AC)/det and v = (R.AB)/det, where det = viewDir.N.
+//	 So, as for ViewableTriangle, the plane of the triangle is tested first,
+//	 and most misses are found from two dot products, before B and C are loaded.
+//	 The ray meets the front face if det<0.
+inline bool ViewableTriangleMesh::TriangleRayHit( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double* hitDist, double* u, double* v, bool* frontFace ) const
+{
+	const VectorR3& normal = TriangleNormals[t];
+	const long* verts = &TriangleVerts[3*t];
+	const VectorR3& vA = Vertices[verts[0]];
+	VectorR3 c( vA.x-viewPos.x, vA.y-viewPos.y, vA.z-viewPos.z );
+	double det = (viewDir^normal);
+	double distNum = (c^normal);
+	if ( det<0.0 ) {
+		if ( distNum>=0.0 || distNum<=maxDistance*det ) {
+			return false;
+		}
+	}
+	else {
+		if ( !(det>0.0) || distNum<=0.0 || distNum>=maxDistance*det || BackFaceCulled(t) ) {
+			return false;			// Parallel, not hit before maxDistance, or culled back face
+		}
+	}
+	double invDet = 1.0/det;
+	VectorR3 r = viewDir*c;
+	double uCoord = -(r^(Vertices[verts[2]]-vA))*invDet;
+	if ( uCoord<0.0 ) {
+		return false;
+	}
+	double vCoord = (r^(Vertices[verts[1]]-vA))*invDet;
+	if ( vCoord<0.0 || uCoord+vCoord>1.0 ) {
+		return false;
+	}
+	*hitDist = distNum*invDet;
+	*u = uCoord;
+	*v = vCoord;
+	*frontFace = (det<0.0);
+	return true;
+}
+
+bool ViewableTriangleMesh::FindTriangleIntersection( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const
+{
+	double u, v;
+	bool frontFace;
+	if ( !TriangleRayHit( t, viewPos, viewDir, maxDistance, intersectDistance, &u, &v, &frontFace ) ) {
+		return false;
+	}
+	SetHitPoint( t, viewPos, viewDir, *intersectDistance, u, v, frontFace, returnedPoint );
+	return true;
+}
+
+bool ViewableTriangleMesh::IntersectTriangle( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const
+{
+	if ( !TriangleRayHit( t, viewPos, viewDir, maxDistance, intersectDistance, &hit.uv.x, &hit.uv.y, &hit.FrontFace ) ) {
+		return false;
+	}
+	hit.Part = t;
+	return true;
+}
+
+void ViewableTriangleMesh::ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, 
+		double intersectDistance, const ViewableHit& hit, VisiblePoint& returnedPoint ) const
+{
+	SetHitPoint( hit.Part, viewPos, viewDir, intersectDistance, hit.uv.x, hit.uv.y, hit.FrontFace, returnedPoint );
+}
+
+bool ViewableTriangleMesh::TriangleIntersectsBefore( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	double hitDist, u, v;
+	bool frontFace;
+	return TriangleRayHit( t, viewPos, viewDir, maxDistance, &hitDist, &u, &v, &frontFace );
+}
+
+void ViewableTriangleMesh::CalcTriangleAABB( long t, AABB& retAABB ) const
+{
+	VectorR3 verts[3];
+	GetTriangleVertices( t, verts, verts+1, verts+2 );
+	CalcBoundingBox( 3, verts, &(retAABB.GetBoxMin()), &(retAABB.GetBoxMax()) );
+}
+
+bool ViewableTriangleMesh::CalcTriangleExtentsInBox( long t, const AABB& boundingAABB, AABB& retAABB ) const
+{
+	VectorR3 vA, vB, vC;
+	GetTriangleVertices( t, &vA, &vB, &vC );
+	return ( ::CalcExtentsInBox( vA, vB, vC, GetTriangleNormal(t),
+								 boundingAABB.GetBoxMin(), boundingAABB.GetBoxMax(),
+								 &(retAABB.GetBoxMin()), &(retAABB.GetBoxMax()) ) );
+}
+
+// The extent functions for KdTree::BuildTree.  userData is the mesh whose kd-tree is being built.
+static void MeshExtentsFunc( long t, AABB& retBox, void* userData )
+{
+	((const ViewableTriangleMesh*)userData)->CalcTriangleAABB( t, retBox );
+}
+
+static bool MeshExtentsInBox( long t, const AABB& aabb, AABB& retBox, void* userData )
+{
+	return ((const ViewableTriangleMesh*)userData)->CalcTriangleExtentsInBox( t, aabb, retBox );
+}
+
+void ViewableTriangleMesh::BuildKdTree()
+{
+	TriangleKdTree.DeleteTree();
+	KdTreeBuilt = false;
+	if ( NumTriangles()==0 ) {
+		return;
+	}
+	TriangleKdTree.BuildTree( NumTriangles(), MeshExtentsFunc, MeshExtentsInBox, this );
+	KdTreeBuilt = true;
+}
+
+// Scratch area for traversing the kd-trees of meshes: one copy per thread.
+//	 A mesh is traversed from inside the traversal of the scene's kd-tree,
+//	 so this cannot be the scratch area of that traversal.
+static thread_local KdTraverseScratch MeshTraverseScratch;
+
+// The ray and the closest hit so far, for the kd-tree callbacks of the mesh.
+class MeshRayQuery {
+public:
+	const ViewableTriangleMesh* Mesh;
+	const VectorR3* ViewPos;
+	const VectorR3* ViewDir;
+	double MaxDistance;			// The closest hit so far, or the maximum distance
+	double* IntersectDistance;
+	ViewableHit* Hit;
+	bool Found;
+};
+
+// Kd-tree callback for Intersect, of type PotentialObjectDataCallback.
+static bool MeshSeekIntersection( long t, double* retStopDistance, void* userData )
+{
+	MeshRayQuery& query = *(MeshRayQuery*)userData;
+	if ( !query.Mesh->IntersectTriangle( t, *query.ViewPos, *query.ViewDir,
+										 query.MaxDistance, query.IntersectDistance, *query.Hit ) ) {
+		return false;
+	}
+	query.MaxDistance = *query.IntersectDistance;
+	query.Found = true;
+	*retStopDistance = query.MaxDistance;
+	return true;
+}
+
+// Kd-tree callback for IntersectsBefore, of type OcclusionCallback.
+static bool MeshShadowFeeler( long t, void* userData )
+{
+	const MeshRayQuery& query = *(const MeshRayQuery*)userData;
+	return query.Mesh->TriangleIntersectsBefore( t, *query.ViewPos, *query.ViewDir, query.MaxDistance );
+}
+
+bool ViewableTriangleMesh::FindIntersectionNT (
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const
+{
+	ViewableHit hit;
+	if ( !Intersect( viewPos, viewDir, maxDistance, intersectDistance, hit ) ) {
+		return false;
+	}
+	ComputeSurfaceNT( viewPos, viewDir, *intersectDistance, hit, returnedPoint );
+	return true;
+}
+
+bool ViewableTriangleMesh::Intersect( 
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const
+{
+	if ( KdTreeBuilt ) {
+		MeshRayQuery query;
+		query.Mesh = this;
+		query.ViewPos = &viewPos;
+		query.ViewDir = &viewDir;
+		query.MaxDistance = maxDistance;
+		query.IntersectDistance = intersectDistance;
+		query.Hit = &hit;
+		query.Found = false;
+		TriangleKdTree.Traverse( viewPos, viewDir, MeshSeekIntersection, &query, MeshTraverseScratch,
+								 maxDistance, true );
+		return query.Found;
+	}
+
+	bool found = false;
+	for ( long t=0; t<NumTriangles(); t++ ) {
+		if ( IntersectTriangle( t, viewPos, viewDir, maxDistance, intersectDistance, hit ) ) {
+			maxDistance = *intersectDistance;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool ViewableTriangleMesh::IntersectsBefore(
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const
+{
+	if ( KdTreeBuilt ) {
+		MeshRayQuery query;
+		query.Mesh = this;
+		query.ViewPos = &viewPos;
+		query.ViewDir = &viewDir;
+		query.MaxDistance = maxDistance;
+		return TriangleKdTree.Occluded( viewPos, viewDir, maxDistance, MeshShadowFeeler, &query, MeshTraverseScratch );
+	}
+
+	for ( long t=0; t<NumTriangles(); t++ ) {
+		if ( TriangleIntersectsBefore( t, viewPos, viewDir, maxDistance ) ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void ViewableTriangleMesh::CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const
+{
+	double mind = DBL_MAX;
+	double maxd = -DBL_MAX;
+	for ( long i=0; i<TriangleVerts.SizeUsed(); i++ ) {
+		double t = (u^Vertices[TriangleVerts[i]]);
+		if ( t<mind ) {
+			mind = t;
+		}
+		if ( t>maxd ) {
+			maxd = t;
+		}
+	}
+	*minDot = mind;
+	*maxDot = maxd;
+}
+
+bool ViewableTriangleMesh::CalcPartials( const VisiblePoint& visPoint,
+										 VectorR3& retPartialU, VectorR3& retPartialV ) const
+{
+	long t = visPoint.GetFaceNumber();
+	const VectorR3& vA = Vertices[TriangleVerts[3*t]];
+	retPartialU = Vertices[TriangleVerts[3*t+1]] - vA;
+	retPartialV = Vertices[TriangleVerts[3*t+2]] - vA;
+	return true;			// Not a singularity point (zero area triangles are not added)
+}
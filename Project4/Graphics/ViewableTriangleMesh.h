@@ -0,0 +1,156 @@
+/*
+ *
+ * RayTrace Software Package, release 4.beta, May 2018.
+ *
+ * Author: Samuel R. Buss
+ *
+ * Software accompanying the book
+ *		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+ *		by S. Buss, Cambridge University Press, 2003.
+ *
+ * Software is "as-is" and carries no warranty.  It may be used without
+ *   restriction, but if you modify it, please change the filenames to
+ *   prevent confusion between different versions.  Please acknowledge
+ *   all use of the software in any publications or products based on it.
+ *
+ * Bug reports: Sam Buss, sbuss@ucsd.edu.
+ * Web page: http://math.ucsd.edu/~sbuss/MathCG
+ *
+ */
+
+#ifndef VIEWABLETRIANGLEMESH_H
+#define VIEWABLETRIANGLEMESH_H
+
+#include "ViewableBase.h"
+#include "Material.h"
+#include "../DataStructs/Array.h"
+#include "../DataStructs/KdTree.h"
+
+// ViewableTriangleMesh holds many triangles with shared vertices, in place
+//	 of one ViewableTriangle per triangle.  The triangles are intersected
+//	 one at a time, as though each were a ViewableTriangle, so a kd-tree
+//	 can hold each triangle as a separate object.
+// Only the (non-unit) normal of each triangle is kept besides its vertex indices,
+//	 so that a ray is tested against the plane of a triangle before its vertices are loaded.
+// The (u,v) coordinates of a point are its barycentric coordinates
+//	 for B and C, as for ViewableTriangle.  The face number of a point is
+//	 the number of its triangle.  Intersect returns the triangle in ViewableHit::Part.
+// When the whole mesh is intersected as one object, as it is by an InstancedViewable,
+//	 the triangles are found with the mesh's own kd-tree, built by BuildKdTree.
+class ViewableTriangleMesh : public ViewableBase {
+
+public:
+	ViewableTriangleMesh();
+
+	// AddVertex returns the index of the new vertex.
+	long AddVertex( const VectorR3& v );
+	long NumVertices() const { return Vertices.SizeUsed(); }
+	const VectorR3& GetVertex( long i ) const { return Vertices[i]; }
+	// After moving vertices, call UpdateTriangles before intersecting the mesh.
+	//	 UpdateTriangles discards the mesh's kd-tree:  call BuildKdTree again if it is needed.
+	void SetVertex( long i, const VectorR3& v ) { Vertices[i] = v; }
+	void UpdateTriangles();
+
+	// Three vertex indices in counter-clockwise order.  The triangle is culled
+	//	 from the back if backmaterial is null.  AddTriangle returns the index of
+	//	 the new triangle, or -1 if the triangle has zero area and was not added.
+	long AddTriangle( long vertA, long vertB, long vertC, const MaterialBase* material );
+	long AddTriangle( long vertA, long vertB, long vertC,
+					  const MaterialBase* frontmaterial, const MaterialBase* backmaterial );
+	long NumTriangles() const { return TriangleMaterials.SizeUsed(); }
+
+	void GetTriangleVertexIndices( long t, long* vertA, long* vertB, long* vertC ) const;
+	void GetTriangleVertices( long t, VectorR3* vertA, VectorR3* vertB, VectorR3* vertC ) const;
+	VectorR3 GetTriangleNormal( long t ) const;		// Unit normal
+	const MaterialBase* GetMaterialFront( long t ) const { return MaterialsFront[TriangleMaterials[t]]; }
+	const MaterialBase* GetMaterialBack( long t ) const { return MaterialsBack[TriangleMaterials[t]]; }
+	bool BackFaceCulled( long t ) const { return (GetMaterialBack(t)==0); }
+
+	// Intersections with the single triangle t.
+	//	 These work like FindIntersectionUntextured and IntersectsBefore for a ViewableTriangle:
+	//   The texture map is not applied.
+	//	 IntersectTriangle is the Intersect for the single triangle:  ComputeSurface gives its visible point.
+	bool FindTriangleIntersection( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	bool IntersectTriangle( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, ViewableHit& hit ) const;
+	bool TriangleIntersectsBefore( long t,
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
+
+	void CalcTriangleAABB( long t, AABB& retAABB ) const;
+	bool CalcTriangleExtentsInBox( long t, const AABB& boundingAABB, AABB& retAABB ) const;
+
+	// BuildKdTree builds a kd-tree over the triangles, for intersecting the whole mesh.
+	//	 Call it after the last triangle is added.
+	void BuildKdTree();
+	bool HasKdTree() const { return KdTreeBuilt; }
+	const KdTree& GetKdTree() const { return TriangleKdTree; }
+
+	// The whole mesh, as a single viewable object.
+	//   These use the kd-tree if it has been built.  Otherwise they test every 
+	//	 triangle, so are slow for large meshes.
+	virtual bool FindIntersectionNT (
+		const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+		double *intersectDistance, VisiblePoint& returnedPoint ) const;
+	bool Intersect( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+					double *intersectDistance, ViewableHit& hit ) const;
+	bool IntersectsBefore( const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance ) const;
+	void CalcBoundingPlanes( const VectorR3& u, double *minDot, double *maxDot ) const;
+	bool CalcPartials( const VisiblePoint& visPoint,
+					   VectorR3& retPartialU, VectorR3& retPartialV ) const;
+	ViewableType GetViewableType() const { return Viewable_TriangleMesh; }
+
+protected:
+	Array<VectorR3> Vertices;
+	Array<long> TriangleVerts;				// Three vertex indices for each triangle
+	Array<int> TriangleMaterials;			// Index into MaterialsFront and MaterialsBack
+	Array<const MaterialBase*> MaterialsFront;
+	Array<const MaterialBase*> MaterialsBack;	// Null pointer if not visible from back
+
+	Array<VectorR3> TriangleNormals;		// Precalculated non-unit normal N = AB x AC of each triangle
+	KdTree TriangleKdTree;
+	bool KdTreeBuilt;
+
+	void PreCalcInfo( long t );
+	bool TriangleRayHit( long t, const VectorR3& viewPos, const VectorR3& viewDir, double maxDistance,
+						 double* hitDist, double* u, double* v, bool* frontFace ) const;
+	void SetHitPoint( long t, const VectorR3& viewPos, const VectorR3& viewDir,
+					  double hitDist, double u, double v, bool frontFace, VisiblePoint& returnedPoint ) const;
+	void ComputeSurfaceNT( const VectorR3& viewPos, const VectorR3& viewDir, double intersectDistance,
+						   const ViewableHit& hit, VisiblePoint& returnedPoint ) const;
+};
+
+inline ViewableTriangleMesh::ViewableTriangleMesh()
+{
+	KdTreeBuilt = false;
+}
+
+inline long ViewableTriangleMesh::AddVertex( const VectorR3& v )
+{
+	long index = Vertices.SizeUsed();
+	Vertices.Push( v );
+	return index;
+}
+
+inline long ViewableTriangleMesh::AddTriangle( long vertA, long vertB, long vertC, const MaterialBase* material )
+{
+	return AddTriangle( vertA, vertB, vertC, material, material );
+}
+
+inline void ViewableTriangleMesh::GetTriangleVertexIndices( long t, long* vertA, long* vertB, long* vertC ) const
+{
+	*vertA = TriangleVerts[3*t];
+	*vertB = TriangleVerts[3*t+1];
+	*vertC = TriangleVerts[3*t+2];
+}
+
+inline void ViewableTriangleMesh::GetTriangleVertices( long t, VectorR3* vertA, VectorR3* vertB, VectorR3* vertC ) const
+{
+	*vertA = Vertices[TriangleVerts[3*t]];
+	*vertB = Vertices[TriangleVerts[3*t+1]];
+	*vertC = Vertices[TriangleVerts[3*t+2]];
+}
+
+#endif // VIEWABLETRIANGLEMESH_H
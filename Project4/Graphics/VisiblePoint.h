@@ -31,16 +31,16 @@
 class ViewableBase;
 
 //  VisiblePoint is a class storing information about a visible point.
+//  A texture map that changes the ambient and diffuse colors of the material does not
+//	 change the material:  the new colors are held in the visible point, and override 
+//	 the material's colors.  So a visible point never allocates memory, and is copied 
+//	 as plain data.  Lighting calculations use GetColorAmbient() and GetColorDiffuse().
 
 class VisiblePoint {
 	friend class ViewableBase;
 	
 public:
-	VisiblePoint() { FrontFace = true; MatNeedsFreeing = false; };
-	VisiblePoint(const VisiblePoint &p);
-	~VisiblePoint();
-
-	VisiblePoint& operator=(const VisiblePoint& p);
+	VisiblePoint() { FrontFace = true; HasColorOverride = false; HasUVDerivs = false; };
 
 	void SetPosition( const VectorR3& pos ) { Position = pos;}
 	void SetNormal( const VectorR3& normal ) { Normal = normal; }
@@ -54,7 +54,14 @@ public:
 	const VectorR3& GetPosition() const { return Position; }
 	const VectorR3& GetNormal() const { return Normal; }
 	const MaterialBase& GetMaterial() const { return *Mat; }
-	MaterialBase& GetMaterialMutable() { assert(MatNeedsFreeing); return *Mat; }
+
+	// The colors of the material, or the colors set by a texture map.
+	//	 Setting either color keeps the other one.  SetMaterial clears the colors set here.
+	void SetColorAmbient( const VectorR3& color );
+	void SetColorDiffuse( const VectorR3& color );
+	void SetColorAmbientDiffuse( const VectorR3& color );
+	const VectorR3& GetColorAmbient() const { return HasColorOverride ? ColorAmbient : Mat->GetColorAmbient(); }
+	const VectorR3& GetColorDiffuse() const { return HasColorOverride ? ColorDiffuse : Mat->GetColorDiffuse(); }
 
 	void SetUV( double u, double v ) { uvCoords.Set(u,v); }
 	void SetUV( const VectorR2& uv ) { uvCoords = uv; }
@@ -64,6 +71,18 @@ public:
 	const VectorR2& GetUV() const { return uvCoords; }
 	VectorR2& GetUV() { return uvCoords; }
 
+	// Derivatives of the (u,v) coordinates with respect to one sample spacing in the screen's
+	//  x and y directions, from ray differentials.  They give the footprint for filtering textures.
+	//  Points found by FindIntersection have none until the ray tracer sets them.
+	void SetUVDerivatives( const VectorR2& dUVdx, const VectorR2& dUVdy ) 
+		{ uvDerivX = dUVdx; uvDerivY = dUVdy; HasUVDerivs = true; }
+	void ClearUVDerivatives() { HasUVDerivs = false; }
+	bool HasUVDerivatives() const { return HasUVDerivs; }
+	const VectorR2& GetdUVdx() const { return uvDerivX; }
+	const VectorR2& GetdUVdy() const { return uvDerivY; }
+	VectorR2& GetdUVdx() { return uvDerivX; }
+	VectorR2& GetdUVdy() { return uvDerivY; }
+
 	// Face numbers allow different texture maps to be applied to different faces of an object.
 	// Typically, the front and back side of a face get the same face number.  However, they
 	//  get different texture maps, and also "FrontFace" can be used to distinguish front and back faces.
@@ -74,78 +93,57 @@ public:
 	void SetObject( const ViewableBase *object ) { TheObject = object; }
 	const ViewableBase& GetObject() const { return *TheObject; }
 
-	void MakeMaterialMutable();	
-
 private:
 	VectorR3 Position;
 	VectorR3 Normal;		// Outward Normal
-	MaterialBase* Mat;
+	const MaterialBase* Mat;
+	VectorR3 ColorAmbient;	// Override the material's colors, if HasColorOverride is true
+	VectorR3 ColorDiffuse;
+	bool HasColorOverride;
 	VectorR2 uvCoords;		// (u,v) coordinates for texture mapping & etc.
+	VectorR2 uvDerivX;		// Derivatives of uvCoords, valid if HasUVDerivs is true
+	VectorR2 uvDerivY;
+	bool HasUVDerivs;
 	int FaceNumber;			// Index of face number (non-negative).
 	const ViewableBase* TheObject;		// The object from which the visible point came.
 	bool FrontFace;			// Is it being viewed from the front side?
-	
-	bool MatNeedsFreeing;	// true if we are responsible for freeing the material.
+
+	void CopyMaterialColors();
 
 };
 
-inline VisiblePoint::VisiblePoint(const VisiblePoint& vp)
+inline void VisiblePoint::SetMaterial( const MaterialBase& material )
 {
-	MatNeedsFreeing = false;
-	*this = vp;
+	Mat = &material;
+	HasColorOverride = false;
 }
 
-inline VisiblePoint::~VisiblePoint() 
+inline void VisiblePoint::CopyMaterialColors()
 {
-	if ( MatNeedsFreeing ) {
-		delete Mat;
+	if ( !HasColorOverride ) {
+		ColorAmbient = Mat->GetColorAmbient();
+		ColorDiffuse = Mat->GetColorDiffuse();
+		HasColorOverride = true;
 	}
 }
 
-inline VisiblePoint& VisiblePoint::operator=(const VisiblePoint& vp) 
+inline void VisiblePoint::SetColorAmbient( const VectorR3& color )
 {
-	Position = vp.Position;
-	Normal = vp.Normal;
-	uvCoords = vp.uvCoords;
-	FaceNumber = vp.FaceNumber;
-	TheObject = vp.TheObject;
-	FrontFace = vp.FrontFace;
-
-	if ( MatNeedsFreeing ) {
-		delete Mat;
-	}
-
-	MatNeedsFreeing = vp.MatNeedsFreeing;
-	if (MatNeedsFreeing) {
-		Mat = vp.Mat->Clone();
-	} else {
-		Mat = vp.Mat;
-	}
-
-	return *this;
+	CopyMaterialColors();
+	ColorAmbient = color;
 }
 
-inline void VisiblePoint::SetMaterial( const MaterialBase& material )
+inline void VisiblePoint::SetColorDiffuse( const VectorR3& color )
 {
-	if ( MatNeedsFreeing ) {
-		delete Mat;
-	}
-	Mat = const_cast<MaterialBase*>(&material);
-	MatNeedsFreeing = false;
+	CopyMaterialColors();
+	ColorDiffuse = color;
 }
 
-// Mutable and deletable materials are the same thing (properties not separable)
-
-inline void VisiblePoint::MakeMaterialMutable( ) 
+inline void VisiblePoint::SetColorAmbientDiffuse( const VectorR3& color )
 {
-	if ( MatNeedsFreeing ) {
-		return;						// Material already mutable.
-	}
-	else {
-		Mat = Mat->Clone();
-		MatNeedsFreeing = true;
-	}
+	ColorAmbient = color;
+	ColorDiffuse = color;
+	HasColorOverride = true;
 }
 
-
 #endif // VISIBLEPOINT_H
@@ -34,6 +34,8 @@
 #include "../Graphics/ViewableSphere.h"
 #include "../Graphics/ViewableTorus.h"
 #include "../Graphics/ViewableTriangle.h"
+#include "../Graphics/ViewableTriangleMesh.h"
+#include "../Graphics/InstancedViewable.h"
 #include "GlShaderMgr.h"
 
 extern bool check_for_opengl_errors();
@@ -317,6 +319,12 @@ void OpenglRenderer::Load_Vbo_Ebo_Mats(const ViewableBase& object) {
     case ViewableBase::Viewable_Triangle:
         Load_Vbo_Ebo_Mats((const ViewableTriangle&)object);
         break;
+    case ViewableBase::Viewable_TriangleMesh:
+        Load_Vbo_Ebo_Mats((const ViewableTriangleMesh&)object);
+        break;
+    case ViewableBase::Viewable_Instance:
+        Load_Vbo_Ebo_Mats((const InstancedViewable&)object);
+        break;
     }
 
 }
@@ -504,6 +512,45 @@ void OpenglRenderer::Load_Vbo_Ebo_Mats(const ViewableTriangle& object)
     return;  
 }
 
+void OpenglRenderer::Load_Vbo_Ebo_Mats(const ViewableTriangleMesh& object) 
+{
+    // Each triangle gets its own three verts, since the normals are per triangle.
+    for (long t = 0; t < object.NumTriangles(); t++) {
+        AddRenderCommand(1, object.GetMaterialFront(t), object.GetMaterialBack(t));
+        unsigned int firstElt = VBOdata.size() / 6;         // Number of vertices in VBO already
+        VectorR3 vertA, vertB, vertC;
+        object.GetTriangleVertices(t, &vertA, &vertB, &vertC);
+        VectorR3 normal = object.GetTriangleNormal(t);
+        AddVertPosNormal(vertA, normal);
+        AddVertPosNormal(vertB, normal);
+        AddVertPosNormal(vertC, normal);
+        EBOdata.push_back(firstElt);
+        EBOdata.push_back(firstElt + 1);
+        EBOdata.push_back(firstElt + 2);
+    }
+}
+
+void OpenglRenderer::Load_Vbo_Ebo_Mats(const InstancedViewable& object)
+{
+    // Load the shared object, then move its new verts into place.
+    //   Normals are mapped by the transpose of the inverse of the placement.
+    size_t firstFloat = VBOdata.size();
+    Load_Vbo_Ebo_Mats(object.GetSharedObject());
+    const AffineMapR3& placement = object.GetPlacement();
+    AffineMapR3 inversePlacement = placement.Inverse();
+    for (size_t i = firstFloat; i < VBOdata.size(); i += 6) {
+        VectorR3 pos(VBOdata[i], VBOdata[i + 1], VBOdata[i + 2]);
+        VectorR3 normal(VBOdata[i + 3], VBOdata[i + 4], VBOdata[i + 5]);
+        placement.Transform(&pos);
+        inversePlacement.Transform3x3Transpose(&normal);
+        normal.Normalize();
+        for (int j = 0; j < 3; j++) {
+            VBOdata[i + j] = (float)pos[j];
+            VBOdata[i + 3 + j] = (float)normal[j];
+        }
+    }
+}
+
 void OpenglRenderer::AddRectangle(
     const VectorR3& vertA, const VectorR3& vertB,
     const VectorR3& vertC, const VectorR3& vertD,
@@ -43,6 +43,8 @@ class ViewableParallelogram;
 class ViewableSphere;
 class ViewableTorus;
 class ViewableTriangle;
+class ViewableTriangleMesh;
+class InstancedViewable;
 class MaterialBase;
 class SceneDescription;
 
@@ -164,6 +166,8 @@ private:
     void Load_Vbo_Ebo_Mats(const ViewableSphere& object);
     void Load_Vbo_Ebo_Mats(const ViewableTorus& object);
     void Load_Vbo_Ebo_Mats(const ViewableTriangle& object);
+    void Load_Vbo_Ebo_Mats(const ViewableTriangleMesh& object);
+    void Load_Vbo_Ebo_Mats(const InstancedViewable& object);
 
     int MeshResFlats() const { return MeshFlats ? MeshFlats : 1; }
 
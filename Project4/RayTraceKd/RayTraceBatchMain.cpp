@@ -0,0 +1,302 @@
+/*
+*
+* RayTrace Software Package, release 4.beta, May 2018.
+*
+* Author: Samuel R. Buss
+*
+* Software accompanying the book
+*		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+*		by S. Buss, Cambridge University Press, 2003.
+*
+* Software is "as-is" and carries no warranty.  It may be used without
+*   restriction, but if you modify it, please change the filenames to
+*   prevent confusion between different versions.  Please acknowledge
+*   all use of the software in any publications or products based on it.
+*
+* Bug reports: Sam Buss, sbuss@ucsd.edu.
+* Web page: http://math.ucsd.edu/~sbuss/MathCG
+*
+*/
+
+// RayTraceBatchMain.cpp
+//   A command line driver for the ray tracer, which needs no window or OpenGL context.
+//   Renders scenes loaded from .nff or .obj files, and writes each image to a .bmp file.
+//   Reports the time, the rays per second and the peak memory use for each image.
+//
+// Usage:  RayTraceBatch [options] scene1 [scene2 ...]
+// The options -size, -o and -jobs apply to the scenes that follow them.
+//   The other options apply to every scene, wherever they are given.
+// Options:
+//   -size W H      Image size in pixels for the scenes that follow (default 640 480).
+//   -o file.bmp    Output file for the next scene (default: the scene file name with .bmp).
+//   -jobs file     Read jobs from a file, one per line, as:   scene [W H [file.bmp]]
+//                  Blank lines and lines starting with '#' are skipped.
+//   -threads N     Number of rendering threads (default 0: one per hardware thread).
+//   -tile N        Width and height of the tiles rendered by each thread (default 16).
+//   -kdcache       Load the kd-tree from, or save it to, the scene file name with .kdtree.
+//   -adaptive N T  Adaptive sampling with at most N samples per pixel and threshold T
+//                  (default 0: four samples per pixel).
+//   -progressive N T  Progressive rendering: N passes of four samples per pixel, but stop
+//                  after T seconds (T = 0 for no time limit).  Gives a bounded render time;
+//                  if the time runs out during the first pass, some tiles are left black.
+//   -wavefront     Trace the rays a bounce at a time, in sorted queues (experimental).
+//   -noraydiff     No ray differentials:  look textures up at full resolution.
+
+// This tells the Visual C++ compiler to allow use of fopen and sscanf.
+#define _CRT_SECURE_NO_DEPRECATE 1
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../Graphics/PixelArray.h"
+#include "../RaytraceMgr/SceneDescription.h"
+#include "../DataStructs/KdTree.h"
+#include "../VrMath/MathMisc.h"
+#include "RayTraceStats.h"
+#include "RayTraceKd.h"
+
+// One image to render
+class RenderJob {
+public:
+    std::string SceneFile;
+    int Width;
+    int Height;
+    std::string OutputFile;         // Empty to use the scene file name with .bmp
+};
+
+// Wall clock time in seconds
+double BatchTime()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Peak memory used by the process so far, in megabytes
+double PeakMemoryMB()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0.0;
+    }
+    return (double)counters.PeakWorkingSetSize / (1024.0*1024.0);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.0;
+    }
+    return (double)usage.ru_maxrss / 1024.0;     // ru_maxrss is in kilobytes
+#endif
+}
+
+// Returns the file name with its extension replaced by newExtension (which includes the '.')
+std::string ReplaceExtension(const std::string& fileName, const char* newExtension)
+{
+    size_t dot = fileName.find_last_of('.');
+    size_t slash = fileName.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return fileName + newExtension;
+    }
+    return fileName.substr(0, dot) + newExtension;
+}
+
+// Reads jobs from a job file, and appends them to jobs.
+//   Returns false if the file cannot be read, or has a bad line.
+bool ReadJobFile(const char* fileName, int defaultWidth, int defaultHeight, std::vector<RenderJob>& jobs)
+{
+    FILE* infile = fopen(fileName, "r");
+    if (!infile) {
+        fprintf(stderr, "Cannot open job file %s.\n", fileName);
+        return false;
+    }
+    char line[1024];
+    int lineNum = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), infile)) {
+        lineNum++;
+        char sceneName[512];
+        char outputName[512];
+        int width = defaultWidth;
+        int height = defaultHeight;
+        outputName[0] = 0;
+        int numFields = sscanf(line, " %511s %d %d %511s", sceneName, &width, &height, outputName);
+        if (numFields <= 0 || sceneName[0] == '#') {
+            continue;       // Blank line or comment
+        }
+        if (numFields == 2 || width <= 0 || height <= 0) {
+            fprintf(stderr, "%s, line %d: bad job.\n", fileName, lineNum);
+            ok = false;
+            continue;
+        }
+        RenderJob job;
+        job.SceneFile = sceneName;
+        job.Width = width;
+        job.Height = height;
+        job.OutputFile = outputName;
+        jobs.push_back(job);
+    }
+    fclose(infile);
+    return ok;
+}
+
+// Settings for progressive rendering.  ProgressivePasses==0 means render with RayTraceView.
+int ProgressivePasses = 0;
+double ProgressiveTimeBudget = 0.0;
+
+// Loads, builds the kd-tree for, renders and saves one image.
+//   Returns false if the scene cannot be loaded.
+bool RenderOneJob(const RenderJob& job, bool useKdCache)
+{
+    SceneDescription scene;
+    double startTime = BatchTime();
+    if (!LoadSceneFile(job.SceneFile.c_str(), scene)) {
+        fprintf(stderr, "Cannot load scene %s.\n", job.SceneFile.c_str());
+        scene.DeleteAll();
+        return false;
+    }
+    double loadTime = BatchTime();
+
+    std::string kdTreeCacheFile = ReplaceExtension(job.SceneFile, ".kdtree");
+    KdTree& kdTree = myBuildKdTree(scene, useKdCache ? kdTreeCacheFile.c_str() : 0);
+    double kdTime = BatchTime();
+
+    PixelArray pixels(job.Width, job.Height);
+    SetViewForImage(scene, kdTree, pixels);
+    int numPasses = 1;
+    if (ProgressivePasses > 0) {
+        ProgressiveRayTrace progressive;
+        progressive.RenderPasses(scene, kdTree, pixels, ProgressiveTimeBudget, ProgressivePasses);
+        numPasses = progressive.GetNumPasses();
+    }
+    else {
+        RayTraceView(scene, kdTree, pixels);
+    }
+    double renderTime = BatchTime();
+
+    std::string outputFile = job.OutputFile.empty() ? ReplaceExtension(job.SceneFile, ".bmp") : job.OutputFile;
+    pixels.DumpBmp(outputFile.c_str());
+
+    double numRays = (double)GetRayTraceStats().GetNumberRaysTraced();
+    printf("%s: %dx%d, load %0.4f s, kd-tree %0.4f s, render %0.4f s (%d full passes), %0.0f rays/sec, peak memory %0.1f MB -> %s\n",
+        job.SceneFile.c_str(), job.Width, job.Height,
+        loadTime - startTime, kdTime - loadTime, renderTime - kdTime, numPasses,
+        numRays / Max(renderTime - kdTime, 1.0e-9), PeakMemoryMB(), outputFile.c_str());
+    fflush(stdout);
+
+    scene.DeleteAll();
+    return true;
+}
+
+void PrintUsage()
+{
+    fprintf(stderr, "Usage: RayTraceBatch [options] scene1 [scene2 ...]\n");
+    fprintf(stderr, "Options for the scenes that follow them:\n");
+    fprintf(stderr, "  -size W H      Image size (default 640 480).\n");
+    fprintf(stderr, "  -o file.bmp    Output file for the next scene.\n");
+    fprintf(stderr, "  -jobs file     Job file, one job per line:  scene [W H [file.bmp]]\n");
+    fprintf(stderr, "Options for all the scenes (if given twice, the last one is used):\n");
+    fprintf(stderr, "  -threads N     Number of rendering threads (default 0: one per hardware thread).\n");
+    fprintf(stderr, "  -tile N        Tile size in pixels (default 16).\n");
+    fprintf(stderr, "  -kdcache       Load or save kd-trees in scene.kdtree files.\n");
+    fprintf(stderr, "  -adaptive N T  Adaptive sampling, at most N samples per pixel, threshold T.\n");
+    fprintf(stderr, "  -progressive N T  At most N passes of four samples per pixel, and at most T seconds.\n");
+    fprintf(stderr, "  -wavefront     Wavefront tracing (experimental).\n");
+    fprintf(stderr, "  -noraydiff     No ray differentials (no texture filtering).\n");
+}
+
+int main(int argc, char** argv)
+{
+    int width = 640;
+    int height = 480;
+    int numThreads = 0;
+    int tileSize = 16;
+    bool useKdCache = false;
+    int adaptiveMaxSamples = 0;
+    double adaptiveThreshold = 1.0/64.0;
+    std::string nextOutputFile;
+    std::vector<RenderJob> jobs;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-size") == 0 && i + 2 < argc) {
+            width = atoi(argv[++i]);
+            height = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            nextOutputFile = argv[++i];
+        }
+        else if (strcmp(arg, "-jobs") == 0 && i + 1 < argc) {
+            if (!ReadJobFile(argv[++i], width, height, jobs)) {
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-threads") == 0 && i + 1 < argc) {
+            numThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-tile") == 0 && i + 1 < argc) {
+            tileSize = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-kdcache") == 0) {
+            useKdCache = true;
+        }
+        else if (strcmp(arg, "-adaptive") == 0 && i + 2 < argc) {
+            adaptiveMaxSamples = atoi(argv[++i]);
+            adaptiveThreshold = atof(argv[++i]);
+        }
+        else if (strcmp(arg, "-wavefront") == 0) {
+            SetWavefrontTracing(true);
+        }
+        else if (strcmp(arg, "-noraydiff") == 0) {
+            SetRayDifferentials(false);
+        }
+        else if (strcmp(arg, "-progressive") == 0 && i + 2 < argc) {
+            ProgressivePasses = atoi(argv[++i]);
+            ProgressiveTimeBudget = atof(argv[++i]);
+        }
+        else if (arg[0] == '-') {
+            PrintUsage();
+            return 1;
+        }
+        else {
+            RenderJob job;
+            job.SceneFile = arg;
+            job.Width = width;
+            job.Height = height;
+            job.OutputFile = nextOutputFile;
+            nextOutputFile.clear();
+            jobs.push_back(job);
+        }
+    }
+    if (jobs.empty() || width <= 0 || height <= 0 || numThreads < 0 || tileSize <= 0
+            || adaptiveMaxSamples < 0 || adaptiveThreshold <= 0.0
+            || ProgressivePasses < 0 || ProgressiveTimeBudget < 0.0) {
+        PrintUsage();
+        return 1;
+    }
+
+    SetRenderTiling(tileSize, numThreads);
+    SetAdaptiveSampling(adaptiveMaxSamples, adaptiveThreshold);
+    int numFailed = 0;
+    double totalTime = BatchTime();
+    for (size_t k = 0; k < jobs.size(); k++) {
+        if (!RenderOneJob(jobs[k], useKdCache)) {
+            numFailed++;
+        }
+    }
+    totalTime = BatchTime() - totalTime;
+    printf("Rendered %d of %d images in %0.4f seconds.\n", (int)jobs.size() - numFailed, (int)jobs.size(), totalTime);
+    return (numFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,354 @@
+/*
+*
+* RayTrace Software Package, release 4.beta, May 2018.
+*
+* Author: Samuel R. Buss
+*
+* Software accompanying the book
+*		3D Computer Graphics: A Mathematical Introduction with OpenGL,
+*		by S. Buss, Cambridge University Press, 2003.
+*
+* Software is "as-is" and carries no warranty.  It may be used without
+*   restriction, but if you modify it, please change the filenames to
+*   prevent confusion between different versions.  Please acknowledge
+*   all use of the software in any publications or products based on it.
+*
+* Bug reports: Sam Buss, sbuss@ucsd.edu.
+* Web page: http://math.ucsd.edu/~sbuss/MathCG
+*
+*/
+
+// RayTraceBenchMain.cpp
+//   Benchmark for the ray tracer and the kd-tree.  For each scene, times the
+//   loading, the kd-tree build and the rendering separately, and reports the
+//   RayTraceStats counters.  The results are written as JSON, for tracking
+//   performance from one version to the next.
+//   "isectTests" gives the intersection tests and successful tests for each type of object.
+//   The scenes are rendered at a fixed size, with the same jittered rays every run,
+//   so the counters and the image checksum only change if the rendering changes.
+//
+// Usage:  RayTraceBench [options] [scene1 scene2 ...]
+//   With no scenes given, runs the scenes bundled with RayTraceKd:
+//      balls_2_1.nff ... balls_5_1.nff, jacks_2_1.nff ... jacks_5_1.nff, f15.obj
+// Options:
+//   -size W H           Image size in pixels (default 320 240).
+//   -repeat N           Build and render each scene N times, and report the fastest times (default 3).
+//   -threads N          Number of threads (default 0: one per hardware thread).
+//   -tile N             Tile size in pixels (default 16).
+//   -objectcost C       Kd-tree cost of an object intersection (default 8.0).
+//   -split METHOD       Kd-tree split cost function: dr, drmod, mb or mbmod (default drmod).
+//                       dr = double recurse, mb = MacDonald-Booth, mod = modified coefficients.
+//   -bins N             Binned split selection with N bins (default 0: exact).
+//   -adaptive N T       Adaptive sampling with at most N samples per pixel and threshold T
+//                       (default 0: four samples per pixel).
+//   -wavefront          Trace the rays a bounce at a time, in sorted queues.
+//   -noraydiff          No ray differentials:  look textures up at full resolution.
+//   -json file          Output file for the JSON results (default RayTraceBench.json).
+
+// This tells the Visual C++ compiler to allow use of fopen.
+#define _CRT_SECURE_NO_DEPRECATE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "../Graphics/PixelArray.h"
+#include "../RaytraceMgr/SceneDescription.h"
+#include "../DataStructs/KdTree.h"
+#include "../DataStructs/ThreadPool.h"
+#include "RayTraceStats.h"
+#include "RayTraceKd.h"
+
+const char* DefaultScenes[] = {
+    "balls_2_1.nff", "balls_3_1.nff", "balls_4_1.nff", "balls_5_1.nff",
+    "jacks_2_1.nff", "jacks_3_1.nff", "jacks_4_1.nff", "jacks_5_1.nff",
+    "f15.obj" };
+const int NumDefaultScenes = sizeof(DefaultScenes) / sizeof(DefaultScenes[0]);
+
+// Benchmark settings
+int ImageWidth = 320;
+int ImageHeight = 240;
+int NumRepeats = 3;
+int NumThreads = 0;
+int TileSize = 16;
+double ObjectCost = 8.0;
+const char* SplitMethod = "drmod";
+int NumSplitBins = 0;
+int AdaptiveMaxSamples = 0;
+double AdaptiveThreshold = 1.0/64.0;
+bool Wavefront = false;
+bool RayDifferentials = true;
+
+// Wall clock time in seconds
+double BenchTime()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// FNV-1a hash of the image, to detect changes in the rendered pixels
+unsigned long long ImageChecksum(const PixelArray& pixels)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned char* bytes = (const unsigned char*)pixels.GetColorBuffer();
+    long numBytes = pixels.GetWidth()*pixels.GetHeight() * 3 * (long)sizeof(float);
+    for (long i = 0; i < numBytes; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Writes a string as a JSON string, with quotes and escapes.
+void WriteJsonString(FILE* out, const char* s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+            fputc(*s, out);
+        }
+        else if ((unsigned char)*s < 0x20) {
+            fprintf(out, "\\u%04x", (unsigned int)(unsigned char)*s);
+        }
+        else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Writes a JSON array of the counts of a histogram, with the last non-zero count last.
+void WriteJsonHistogram(FILE* out, const char* name, const long* counts, int size)
+{
+    while (size > 0 && counts[size - 1] == 0) {
+        size--;
+    }
+    fprintf(out, "      \"%s\": [", name);
+    for (int i = 0; i < size; i++) {
+        fprintf(out, "%s%ld", (i == 0) ? "" : ", ", counts[i]);
+    }
+    fprintf(out, "],\n");
+}
+
+// Ratio, or zero if the denominator is zero
+double SafeRatio(double numerator, double denominator)
+{
+    return (denominator != 0.0) ? numerator / denominator : 0.0;
+}
+
+// Loads, builds and renders one scene NumRepeats times, and writes its JSON object.
+//   Returns false if the scene cannot be loaded.
+bool BenchmarkScene(const char* sceneFile, FILE* jsonOut, bool firstScene)
+{
+    double bestLoadTime = 0.0, bestBuildTime = 0.0, bestRenderTime = 0.0;
+    long numObjects = 0;
+    unsigned long long checksum = 0;
+    RayTraceStats stats;
+    for (int rep = 0; rep < NumRepeats; rep++) {
+        SceneDescription scene;
+        double startTime = BenchTime();
+        if (!LoadSceneFile(sceneFile, scene)) {
+            fprintf(stderr, "Cannot load scene %s.\n", sceneFile);
+            scene.DeleteAll();
+            return false;
+        }
+        double loadTime = BenchTime();
+        KdTree& kdTree = myBuildKdTree(scene);
+        double buildTime = BenchTime();
+        PixelArray pixels(ImageWidth, ImageHeight);
+        SetViewForImage(scene, kdTree, pixels);
+        double renderStartTime = BenchTime();
+        RayTraceView(scene, kdTree, pixels);
+        double renderTime = BenchTime();
+
+        loadTime -= startTime;
+        buildTime -= (startTime + loadTime);
+        renderTime -= renderStartTime;
+        if (rep == 0 || loadTime < bestLoadTime) {
+            bestLoadTime = loadTime;
+        }
+        if (rep == 0 || buildTime < bestBuildTime) {
+            bestBuildTime = buildTime;
+        }
+        if (rep == 0 || renderTime < bestRenderTime) {
+            bestRenderTime = renderTime;
+        }
+        numObjects = NumKdTreeObjects();
+        checksum = ImageChecksum(pixels);
+        stats = GetRayTraceStats();
+        scene.DeleteAll();
+    }
+
+    double numRays = (double)stats.GetNumberRaysTraced();
+    fprintf(jsonOut, "%s    {\n", firstScene ? "" : ",\n");
+    fprintf(jsonOut, "      \"scene\": ");
+    WriteJsonString(jsonOut, sceneFile);
+    fprintf(jsonOut, ",\n");
+    fprintf(jsonOut, "      \"objects\": %ld,\n", numObjects);
+    fprintf(jsonOut, "      \"loadSeconds\": %0.6f,\n", bestLoadTime);
+    fprintf(jsonOut, "      \"buildSeconds\": %0.6f,\n", bestBuildTime);
+    fprintf(jsonOut, "      \"renderSeconds\": %0.6f,\n", bestRenderTime);
+    fprintf(jsonOut, "      \"raysPerSecond\": %0.1f,\n", SafeRatio(numRays, bestRenderTime));
+    fprintf(jsonOut, "      \"rays\": %ld,\n", stats.GetNumberRaysTraced());
+    fprintf(jsonOut, "      \"reflectionRays\": %ld,\n", stats.GetNumberReflectionRays());
+    fprintf(jsonOut, "      \"transmissionRays\": %ld,\n", stats.GetNumberXmitRays());
+    fprintf(jsonOut, "      \"shadowFeelers\": %ld,\n", stats.GetNumberShadowFeelers());
+    fprintf(jsonOut, "      \"kdNodesTraversed\": %ld,\n", stats.GetNumberKdNodesTraversed());
+    fprintf(jsonOut, "      \"kdLeavesTraversed\": %ld,\n", stats.GetNumberKdLeavesTraversed());
+    fprintf(jsonOut, "      \"kdObjectsTested\": %ld,\n", stats.GetNumberKdObjectsInLeaves());
+    fprintf(jsonOut, "      \"nodesPerRay\": %0.6f,\n", SafeRatio((double)stats.GetNumberKdNodesTraversed(), numRays));
+    fprintf(jsonOut, "      \"leavesPerRay\": %0.6f,\n", SafeRatio((double)stats.GetNumberKdLeavesTraversed(), numRays));
+    fprintf(jsonOut, "      \"objectsPerRay\": %0.6f,\n", SafeRatio((double)stats.GetNumberKdObjectsInLeaves(), numRays));
+    long raysAtDepth[RayTraceStats::MaxDepth];
+    for (int i = 0; i < RayTraceStats::MaxDepth; i++) {
+        raysAtDepth[i] = stats.GetNumberRaysAtDepth(i);
+    }
+    WriteJsonHistogram(jsonOut, "raysAtDepth", raysAtDepth, RayTraceStats::MaxDepth);
+    long nodesHistogram[RayTraceStats::KdNodesHistogramSize];
+    for (int i = 0; i < RayTraceStats::KdNodesHistogramSize; i++) {
+        nodesHistogram[i] = stats.GetKdNodesHistogram(i);
+    }
+    WriteJsonHistogram(jsonOut, "kdNodesHistogram", nodesHistogram, RayTraceStats::KdNodesHistogramSize);
+    fprintf(jsonOut, "      \"isectTests\": {");
+    bool firstType = true;
+    for (int i = 0; i < RayTraceStats::NumViewableTypes; i++) {
+        if (stats.GetNumberIsectTests(i) != 0) {
+            fprintf(jsonOut, "%s\"%s\": [%ld, %ld]", firstType ? "" : ", ", RayTraceStats::ViewableTypeName(i),
+                stats.GetNumberIsectTests(i), stats.GetNumberSuccessIsectTests(i));
+            firstType = false;
+        }
+    }
+    fprintf(jsonOut, "},\n");
+    fprintf(jsonOut, "      \"imageChecksum\": \"%016llx\"\n", checksum);
+    fprintf(jsonOut, "    }");
+
+    fprintf(stderr, "%-16s load %0.4f s  build %0.4f s  render %0.4f s  %0.0f rays/sec\n",
+        sceneFile, bestLoadTime, bestBuildTime, bestRenderTime, SafeRatio(numRays, bestRenderTime));
+    return true;
+}
+
+void PrintUsage()
+{
+    fprintf(stderr, "Usage: RayTraceBench [options] [scene1 scene2 ...]\n");
+    fprintf(stderr, "  -size W H       Image size (default 320 240).\n");
+    fprintf(stderr, "  -repeat N       Runs per scene; the fastest times are reported (default 3).\n");
+    fprintf(stderr, "  -threads N      Number of threads (default 0: one per hardware thread).\n");
+    fprintf(stderr, "  -tile N         Tile size in pixels (default 16).\n");
+    fprintf(stderr, "  -objectcost C   Kd-tree object cost (default 8.0).\n");
+    fprintf(stderr, "  -split METHOD   dr, drmod, mb or mbmod (default drmod).\n");
+    fprintf(stderr, "  -bins N         Binned split selection with N bins (default 0: exact).\n");
+    fprintf(stderr, "  -adaptive N T   Adaptive sampling, at most N samples per pixel, threshold T.\n");
+    fprintf(stderr, "  -wavefront      Wavefront tracing.\n");
+    fprintf(stderr, "  -noraydiff      No ray differentials (no texture filtering).\n");
+    fprintf(stderr, "  -json file      JSON output file (default RayTraceBench.json).\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* jsonFile = "RayTraceBench.json";
+    const char** scenes = DefaultScenes;
+    int numScenes = NumDefaultScenes;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-size") == 0 && i + 2 < argc) {
+            ImageWidth = atoi(argv[++i]);
+            ImageHeight = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-repeat") == 0 && i + 1 < argc) {
+            NumRepeats = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-threads") == 0 && i + 1 < argc) {
+            NumThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-tile") == 0 && i + 1 < argc) {
+            TileSize = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-objectcost") == 0 && i + 1 < argc) {
+            ObjectCost = atof(argv[++i]);
+        }
+        else if (strcmp(arg, "-split") == 0 && i + 1 < argc) {
+            SplitMethod = argv[++i];
+        }
+        else if (strcmp(arg, "-bins") == 0 && i + 1 < argc) {
+            NumSplitBins = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "-adaptive") == 0 && i + 2 < argc) {
+            AdaptiveMaxSamples = atoi(argv[++i]);
+            AdaptiveThreshold = atof(argv[++i]);
+        }
+        else if (strcmp(arg, "-wavefront") == 0) {
+            Wavefront = true;
+        }
+        else if (strcmp(arg, "-noraydiff") == 0) {
+            RayDifferentials = false;
+        }
+        else if (strcmp(arg, "-json") == 0 && i + 1 < argc) {
+            jsonFile = argv[++i];
+        }
+        else if (arg[0] == '-') {
+            PrintUsage();
+            return 1;
+        }
+        else {
+            // The remaining arguments are the scenes
+            scenes = (const char**)(argv + i);
+            numScenes = argc - i;
+            break;
+        }
+    }
+    bool doubleRecurse = (strcmp(SplitMethod, "dr") == 0 || strcmp(SplitMethod, "drmod") == 0);
+    bool modifiedCoefs = (strcmp(SplitMethod, "drmod") == 0 || strcmp(SplitMethod, "mbmod") == 0);
+    bool validSplit = doubleRecurse || modifiedCoefs || strcmp(SplitMethod, "mb") == 0;
+    if (ImageWidth <= 0 || ImageHeight <= 0 || NumRepeats <= 0 || NumThreads < 0 || TileSize <= 0
+            || ObjectCost <= 0.0 || NumSplitBins < 0 || !validSplit
+            || AdaptiveMaxSamples < 0 || AdaptiveThreshold <= 0.0) {
+        PrintUsage();
+        return 1;
+    }
+
+    SetRenderTiling(TileSize, NumThreads);
+    SetKdTreeParameters(ObjectCost, doubleRecurse, modifiedCoefs, NumSplitBins);
+    SetAdaptiveSampling(AdaptiveMaxSamples, AdaptiveThreshold);
+    SetWavefrontTracing(Wavefront);
+    SetRayDifferentials(RayDifferentials);
+
+    FILE* jsonOut = fopen(jsonFile, "w");
+    if (!jsonOut) {
+        fprintf(stderr, "Cannot open %s.\n", jsonFile);
+        return 1;
+    }
+    fprintf(jsonOut, "{\n");
+    fprintf(jsonOut, "  \"benchmark\": \"RayTraceBench\",\n");
+    fprintf(jsonOut, "  \"settings\": {\n");
+    fprintf(jsonOut, "    \"width\": %d,\n", ImageWidth);
+    fprintf(jsonOut, "    \"height\": %d,\n", ImageHeight);
+    fprintf(jsonOut, "    \"repeat\": %d,\n", NumRepeats);
+    fprintf(jsonOut, "    \"threads\": %d,\n", (NumThreads > 0) ? NumThreads : ThreadPool::HardwareThreads());
+    fprintf(jsonOut, "    \"tileSize\": %d,\n", TileSize);
+    fprintf(jsonOut, "    \"objectCost\": %g,\n", ObjectCost);
+    fprintf(jsonOut, "    \"split\": ");
+    WriteJsonString(jsonOut, SplitMethod);
+    fprintf(jsonOut, ",\n");
+    fprintf(jsonOut, "    \"splitBins\": %d,\n", NumSplitBins);
+    fprintf(jsonOut, "    \"adaptiveMaxSamples\": %d,\n", AdaptiveMaxSamples);
+    fprintf(jsonOut, "    \"adaptiveThreshold\": %g,\n", AdaptiveThreshold);
+    fprintf(jsonOut, "    \"wavefront\": %s,\n", Wavefront ? "true" : "false");
+    fprintf(jsonOut, "    \"rayDifferentials\": %s\n", RayDifferentials ? "true" : "false");
+    fprintf(jsonOut, "  },\n");
+    fprintf(jsonOut, "  \"scenes\": [\n");
+    int numFailed = 0;
+    bool firstScene = true;
+    for (int k = 0; k < numScenes; k++) {
+        if (BenchmarkScene(scenes[k], jsonOut, firstScene)) {
+            firstScene = false;
+        }
+        else {
+            numFailed++;
+        }
+    }
+    fprintf(jsonOut, "\n  ]\n}\n");
+    fclose(jsonOut);
+    fprintf(stderr, "Results written to %s.\n", jsonFile);
+    return (numFailed == 0) ? 0 : 1;
+}
@@ -21,27 +21,262 @@
 #ifndef RAY_TRACE_KD
 #define RAY_TRACE_KD 
 
-class VectorR3;
+#include "../VrMath/LinearR3.h"
+#include "../Graphics/VisiblePoint.h"
+#include "../Graphics/PixelArray.h"
+#include "../DataStructs/KdTree.h"
+#include "../DataStructs/Array.h"
+#include "RayTraceStats.h"
 class Light;
-class VisiblePoint;
-class KdTree;
 class SceneDescription;
-class PixelArray;
+
+// RayQueryContext holds the state of the ray currently being traced:
+//	  the scene and kd-tree, the ray itself, and the best hit found so far.
+//    It is passed to the kd-tree traversal callbacks as their userData.
+// Each thread that traces rays needs its own RayQueryContext.
+//	  The statistics are counted in Stats, which is shared only by contexts used by the same thread.
+class RayQueryContext {
+public:
+	RayQueryContext() 
+		: Scene(0), Tree(0), Stats(0), SkipTextureMaps(false), 
+		  BestObject(-1), TraverseAvoid(-1), BestHitDistance(0.0), BestIntersectDistance(0.0), ShadowDist(0.0),
+		  TempHit(), BestHit(), BestHitPoint(0) {}
+	RayQueryContext(const SceneDescription& scene, KdTree& kdTree, RayTraceStats& stats) 
+		: Scene(&scene), Tree(&kdTree), Stats(&stats), SkipTextureMaps(false), 
+		  BestObject(-1), TraverseAvoid(-1), BestHitDistance(0.0), BestIntersectDistance(0.0), ShadowDist(0.0),
+		  TempHit(), BestHit(), BestHitPoint(0) {}
+
+	const SceneDescription* Scene;
+	KdTree* Tree;
+	RayTraceStats* Stats;
+	bool SkipTextureMaps;		// Set to return hits without their texture maps applied.  (The renderer sets it, 
+								//	 and applies the texture map of the closest hit only.)
+
+	long BestObject;            // The kd-tree object at the closest intersection so far.
+	long TraverseAvoid;         // Object from which the ray is cast (to help avoid self-intersections)
+	double BestHitDistance;     // Distance to the closest intersection found so far.
+	double BestIntersectDistance;	// The distance returned by Intersect for the closest intersection
+	double ShadowDist;          // Distance from the light to the point being lit.
+	ViewableHit TempHit;        // Scratch space for intersection tests.
+	ViewableHit BestHit;        // What Intersect returned for the closest intersection so far.
+	VisiblePoint HitPoints[2];  // Where TempHit and BestHit have visible points computed (see ViewableHit::Point)
+	VisiblePoint* BestHitPoint; // Where the visible point of the closest intersection is returned.
+	VectorR3 StartPos;          // Starting position of the current ray into kdTree
+	VectorR3 StartPosAvoid;     // Starting position displaced forward slightly (to avoid self interesections)
+	VectorR3 TraverseDir;       // Direction of the ray.
+	KdTraverseScratch TraverseScratch;	// Stack and mailbox for the kd-tree traversals
+};
+
+// Ray differentials, as two auxiliary rays.  They are offset from the ray by one sample 
+//	 spacing in the x and y directions of the screen.
+class RayDifferential {
+public:
+	VectorR3 PosX, DirX;
+	VectorR3 PosY, DirY;
+};
+
+// Where the auxiliary rays of a RayDifferential hit the object that the ray hit.
+class HitDifferential {
+public:
+	VisiblePoint PointX, PointY;
+	VectorR3 DirX, DirY;		// Directions of the auxiliary rays
+};
 
 // Call this to build a KdTree.
-KdTree& myBuildKdTree(const SceneDescription& theKdTreeScene);
+//   If cacheFileName is given, the tree is loaded from that file when the file
+//	 holds a tree for the same scene objects.  Otherwise the tree is built, and saved to the file.
+KdTree& myBuildKdTree(const SceneDescription& theKdTreeScene, const char* cacheFileName = 0);
+// The number of objects in the kd-tree built by myBuildKdTree:  one for each viewable,
+//	 except that each triangle of a ViewableTriangleMesh is a separate object.
+long NumKdTreeObjects();
+
+// Parameters used by myBuildKdTree.
+//   objectCost - the cost of intersecting an object (default 8.0).
+//   doubleRecurse - true for double recurse splitting, false for MacDonald-Booth (default true).
+//   modifiedCoefs - use the modified coefficients for the split cost (default true).
+//   numSplitBins - 0 for exact split selection (the default), or the number of bins.
+void SetKdTreeParameters(double objectCost, bool doubleRecurse, bool modifiedCoefs, int numSplitBins = 0);
+
+// Loads a scene from a .nff or .obj file.  Returns false if it cannot be loaded.
+bool LoadSceneFile(const char* fileName, SceneDescription& theScene);
+// Sets the camera view to render the scene into thePixels.  Call after building the kd-tree.
+void SetViewForImage(SceneDescription& theScene, const KdTree& theKdTree, PixelArray& thePixels);
+
+// The primary hits (the G-buffer) of the first four samples of each pixel, and the results of
+//	 their shadow feelers.  When a cache is given to RayTraceView or ProgressiveRayTrace::RenderPasses,
+//	 pixels with cached hits are shaded without traversing the kd-tree for their primary rays or 
+//	 casting their shadow feelers, and the hits of the other pixels are cached.  Reflection and 
+//	 transmission rays are always traced.
+// Only the kd-tree object hit by each sample is cached.  The visible point is computed again,
+//	 by intersecting the sample's ray with that one object, when the pixel is shaded.
+// The cache stays valid after edits that move nothing:  changes to the colors of lights, or to
+//	 the properties of materials or texture maps.  Call Invalidate() after the camera view, the objects
+//	 or the light positions change, or after an object is given a different material, or a material
+//	 becomes transmissive or not.  A change of image size or of the number of lights invalidates
+//	 the cache automatically.
+// Memory use is 4*sizeof(long) bytes per pixel, plus four bytes per pixel for each light.
+class PrimaryHit {
+public:
+	static const long NotTraced = -2;
+	long Object;				// The kd-tree object hit, or -1 if none, or NotTraced
+};
+
+class PrimaryHitCache {
+public:
+	static const int SamplesPerPixel = 4;
+
+	PrimaryHitCache() : Width(0), Height(0), NumLights(0), IsCleared(false) {}
+
+	void Invalidate() { IsCleared = false; }
+
+	// Used by the renderer.  Prepare clears the cache if it was invalidated or the size changed.
+	void Prepare(int width, int height, int numLights);
+	PrimaryHit* GetPixelHits(int i, int j) { return &Hits[((long)j*Width + i)*SamplesPerPixel]; }
+	signed char* GetPixelNumLit(int i, int j) 
+		{ return NumLights==0 ? 0 : &NumLit[((long)j*Width + i)*SamplesPerPixel*NumLights]; }
+
+private:
+	Array<PrimaryHit> Hits;
+	Array<signed char> NumLit;		// For each sample and light: shadow feelers not blocked, or -1 if none cast
+	int Width, Height;
+	int NumLights;
+	bool IsCleared;
+};
+
+// Main ray tracing routine.  hitCache, if not null, is the cache of primary hits for the view.
+//	 When a cache is given, wavefront tracing is not used.
+void RayTraceView(const SceneDescription& theRayTraceScene, KdTree& theRayTraceKdTree, PixelArray& theRayTracePixels,
+				  PrimaryHitCache* hitCache = 0);
+
+// Settings for the multithreaded renderer used by RayTraceView.
+//   tileSize - width and height of the square tiles the image is split into (default 16).
+//   numThreads - number of worker threads; 0 means one per hardware thread (default 0).
+//	 myBuildKdTree also builds the kd-tree with this number of threads.
+void SetRenderTiling(int tileSize, int numThreads = 0);
+
+// Adaptive sampling for RayTraceView.  Pixels get more samples, in packets of four,
+//	 until the 95% confidence interval for each color component is within +/- threshold
+//	 of the mean, or the pixel has maxSamples samples.
+//   maxSamples - 0 (or 4 or less) for the fixed four samples per pixel (the default).
+//   threshold - in the units of the color components, which range from 0 to 1.
+void SetAdaptiveSampling(int maxSamples, double threshold = 1.0/64.0);
+
+// Wavefront tracing for RayTraceView (default false).  When it is on, the rays of each tile
+//	 are traced a bounce at a time, in queues sorted by direction and origin, instead of depth-first.
+//	 It gives the same images, apart from roundoff.  It is not used with adaptive sampling.
+//	 It is experimental, and is not faster than the default depth-first tracing.
+void SetWavefrontTracing(bool wavefront);
+
+// Ray differentials (default true).  When they are on, each ray carries two auxiliary rays from
+//	 the camera, which are reflected and refracted along with it.  Where they hit gives the 
+//	 footprint of the ray on a texture, so image textures are filtered with their mip maps.
+//	 When off, the textures are looked up at full resolution.
+void SetRayDifferentials(bool useDifferentials);
+
+// Progressive ray tracing.  Each pass adds four more samples to every pixel, and the
+//	 image is the average of all the samples so far.  The first pass gives the same image as RayTraceView.
+//	 RenderPasses can stop when a time budget runs out, and the next call resumes where it stopped.
+//	 Call Restart() whenever the scene or the camera view changes.  (A change of image size restarts automatically.)
+//	 With Restart(true), the tiles that have had no passes yet are left unchanged in thePixels 
+//	 (for instance, to show a reprojected image).  Otherwise they are black.
+//	 The adaptive sampling setting is not used.
+class ProgressiveRayTrace {
+public:
+	ProgressiveRayTrace() : SampleSums(0, 0) { Restart(); }
+
+	void Restart(bool keepImage = false) { NumPassesDone = 0; TilePasses.Reset(); KeepUnrenderedTiles = keepImage; }
+
+	// Renders passes until maxPasses passes are done, or until timeBudget seconds have passed.
+	//	 timeBudget <= 0 means no time limit.  The time is checked before each tile, so it can
+	//	 be exceeded by the time to render one tile.  The average so far is written into thePixels.
+	// Returns true if all maxPasses passes are done.
+	// hitCache, if not null, is used for the first pass, as by RayTraceView.
+	bool RenderPasses(const SceneDescription& theScene, KdTree& theKdTree, PixelArray& thePixels,
+		double timeBudget, int maxPasses, PrimaryHitCache* hitCache = 0);
+
+	int GetNumPasses() const { return NumPassesDone; }	// Number of complete passes
+	const RayTraceStats& GetStats() const { return Stats; }	// Statistics for all the passes so far
+
+private:
+	PixelArray SampleSums;		// Sum of the sample colors of each pixel
+	Array<int> TilePasses;		// Number of passes done for each tile
+	int NumPassesDone;			// Every tile has had at least this many passes
+	int TileSize;				// Tile size when the image was started
+	int NumTilesX;
+	bool KeepUnrenderedTiles;	// Leave the tiles with no passes unchanged in the image
+	RayTraceStats Stats;
+
+	static void RenderPassTile(long tileNum, int threadNum, void* userData);
+};
+
+// Reprojection of the image after the camera moves, so the viewer can show the new view quickly.
+//	 RecordView() traces the ray through the center of each pixel, and records the point and the 
+//	 object that it hits, or the direction of the ray if it misses.  After the camera moves, Reproject()
+//	 moves the color of each pixel of the image to where its point (or direction) is seen from the new
+//	 camera view (the nearest point wins).  A pixel keeps its moved color if no neighboring pixel has a 
+//	 much nearer moved point; a background pixel, if its neighbors are background too.  The other pixels
+//	 (newly visible ones, and ones at the edges of nearer surfaces) are ray traced with one sample,
+//	 so only they cost a ray.  The kept points and the new hits are recorded for the next call.
+//	 An object that was outside the recorded view, and moves in front of points that were seen,
+//	 is missed until the image is refined.
+// The moved colors are approximate, as specular highlights and reflections do not move with the 
+//	 points.  So the image should be refined afterwards, for instance by a ProgressiveRayTrace
+//	 restarted with Restart(true).
+// Call Invalidate() after any change to the scene other than the camera view.  A change of image
+//	 size invalidates automatically.
+class ReprojectionCache {
+public:
+	ReprojectionCache() : Width(0), Height(0), IsValid(false), NumPixelsTraced(0) {}
+
+	void Invalidate() { IsValid = false; }
+	bool HasView() const { return IsValid; }
+
+	// Records the hits for the current camera view.
+	void RecordView(const SceneDescription& theScene, KdTree& theKdTree);
+
+	// Reprojects thePixels, the image for the recorded view, into the current camera view.
+	// Returns false, and does nothing, if there is no recorded view of the same size.
+	bool Reproject(const SceneDescription& theScene, KdTree& theKdTree, PixelArray& thePixels);
+
+	long GetNumPixelsTraced() const { return NumPixelsTraced; }	// Pixels ray traced by the last Reproject()
+
+private:
+	Array<VectorR3> HitPos;		// For each pixel, the point hit by the ray through its center, or the moved point it kept.
+								//	 The direction of the ray if no object is hit.
+	Array<long> HitObject;		// The object hit, or -1 if none
+	Array<VectorR3> WarpColor;	// For each pixel, the moved color of the nearest point, if any
+	Array<VectorR3> WarpPos;	// The nearest point
+	Array<double> WarpDepth;	// Distance from the camera to the nearest point, or DBL_MAX if none
+	Array<long> WarpObject;		// The object of the nearest point, or -1 for the background
+	int Width, Height;
+	bool IsValid;
+	long NumPixelsTraced;
+
+	bool ReprojectKeepsPixel(int i, int j) const;
+	static void ReprojectTile(long tileNum, int threadNum, void* userData);
+};
 
-// Main ray tracing routine
-void RayTraceView(const SceneDescription& theRayTraceScene, KdTree& theRayTraceKdTree, PixelArray& theRayTracePixels);
+// Statistics (rays traced, kd-tree nodes traversed, etc.) from the most recent RayTraceView,
+//	 or from all the passes so far of the most recent ProgressiveRayTrace::RenderPasses.
+const RayTraceStats& GetRayTraceStats();
 
 // Internal routines for ray tracing
-long SeekIntersectionKd(const VectorR3& startPos, const VectorR3& direction,
+const int MaxTraceDepth = 5;		// TraceDepth of the rays from the camera.  Each reflection or transmission reduces it by one.
+long SeekIntersectionKd(RayQueryContext& context, const VectorR3& startPos, const VectorR3& direction,
     double *hitDist, VisiblePoint& returnedPoint,
     long avoidK = -1);
-void RayTrace(int TraceDepth, const VectorR3& pos, const VectorR3 dir,
-    VectorR3& returnedColor, long avoidK = -1);
-bool ShadowFeelerKd(const VectorR3& pos, const Light& light, VectorR3 displacement, long intersectNum = -1);
-void CalcAllDirectIllum(const VectorR3& viewPos, const VisiblePoint& visPoint,
-    VectorR3& returnedColor, long avoidK = -1);
+void SeekIntersectionKdPacket(RayQueryContext* contexts, KdPacketScratch& scratch, int numRays,
+    const VectorR3* pos, const VectorR3* dir,
+    double* hitDist, VisiblePoint* returnedPoints, long* hitObject,
+    const long* avoidK = 0, int rayDepth = 0);
+void RayTrace(RayQueryContext& context, int TraceDepth, const VectorR3& pos, const VectorR3 dir,
+    VectorR3& returnedColor, long avoidK = -1, const RayDifferential* diff = 0);
+void ShadeHit(RayQueryContext& context, int TraceDepth, const VectorR3& pos, const VectorR3& dir,
+    long intersectNum, const VisiblePoint& visPoint, VectorR3& returnedColor,
+    signed char* cachedNumLit = 0, bool reuseNumLit = false, const HitDifferential* hitDiff = 0);
+bool ApplyTextureAtHit(VisiblePoint& visPoint, const VectorR3& dir, const RayDifferential* diff, HitDifferential* hitDiff);
+bool ShadowFeelerKd(RayQueryContext& context, const VectorR3& pos, const Light& light, VectorR3 displacement, long intersectNum = -1);
+void CalcAllDirectIllum(RayQueryContext& context, const VectorR3& viewPos, const VisiblePoint& visPoint,
+    VectorR3& returnedColor, long avoidK = -1, signed char* cachedNumLit = 0, bool reuseNumLit = false);
 
 #endif // RAY_TRACE_KD
\ No newline at end of file
@@ -56,6 +56,7 @@ unsigned int TheFrameTexture = 0;   // Texture map to hold the frame buffer cont
 GLFWwindow* WindowID;
 
 bool NeedsRayTracing = true;   // Set if the scene has changed and needs to be re-raytraced.
+                               // Stays set until the last progressive pass is done.
 bool NeedsRerendering = true;   // Set if the scene needs to rerendered in OpenGL
 bool RayTraceMode = false;		// Set true for RayTraciing,  false for rendering with OpenGL
                                 // Rendering with OpenGL does not support all features, esp., texture mapping
@@ -69,20 +70,59 @@ SceneDescription FileScene;			// Scene that is loaded from an .obj or .nff file.
 const double fovy = 0.35;           // Field of view "y"
 CameraView SavedCameraView;
 
+// Progressive ray tracing: the window shows the image after each time slice,
+//   and keyboard and window events are handled between the time slices.
+ProgressiveRayTrace ProgressiveRender;
+const int NumProgressivePasses = 16;        // Four rays per pixel per pass
+const double ProgressiveTimeSlice = 0.1;    // Seconds between window updates
+double RayTraceTime = 0.0;                  // Time spent on the current image so far
+PrimaryHitCache HitCache;                   // Primary hits, kept while only the lighting changes
+
+// Reprojection mode:  when the camera moves in ray trace mode, the image is reprojected
+//   into the new view, and then refined by progressive ray tracing.
+bool ReprojectionMode = false;
+ReprojectionCache Reprojection;             // Hits of the center rays, for the current view
+
+// Call when the ray traced image becomes out of date.
+void RestartRayTracing()
+{
+    NeedsRayTracing = true;
+    ProgressiveRender.Restart();
+    RayTraceTime = 0.0;
+    HitCache.Invalidate();
+    Reprojection.Invalidate();
+}
+
+// Call when only the colors of the lights or materials have changed.
+//   The cached primary hits are reused, and the image is re-shaded in ray trace mode.
+void RestartShading()
+{
+    ProgressiveRender.Restart();
+    RayTraceTime = 0.0;
+    NeedsRayTracing = true;
+    NeedsRerendering = RayTraceMode;
+}
+
 // myRenderScene() chooses between using OpenGL or ray-tracing to render the scene
 void myRenderScene()
 {
     if (WindowWidth > 0 && WindowHeight > 0 && NeedsRerendering) {
         if (RayTraceMode) {
             if (NeedsRayTracing) {
-                // Here the actual ray tracing of the whole scene is done.
+                // Here the ray tracing of the scene is done, one time slice at a time.
                 double rtTime = glfwGetTime();
 
-                RayTraceView(*ActiveScene, *ActiveKdTree, *pixels);                     // Render with ray tracing
-
-                rtTime = glfwGetTime() - rtTime;
-                printf("  Ray Trace time: %0.4f seconds.\n", rtTime);
-                NeedsRayTracing = false;
+                bool finished = ProgressiveRender.RenderPasses(*ActiveScene, *ActiveKdTree, *pixels,
+                                    ProgressiveTimeSlice, NumProgressivePasses, &HitCache);     // Render with ray tracing
+
+                if (ReprojectionMode && !Reprojection.HasView()) {
+                    Reprojection.RecordView(*ActiveScene, *ActiveKdTree);
+                }
+                RayTraceTime += glfwGetTime() - rtTime;
+                if (finished) {
+                    printf("  Ray Trace time: %0.4f seconds, %d passes.\n", RayTraceTime, NumProgressivePasses);
+                    NeedsRayTracing = false;
+                }
             }
             // Blit ray tracing results from "pixels" from the draw frame buffer to the screen's frame buffer.
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
@@ -103,11 +143,12 @@ void myRenderScene()
             check_for_opengl_errors();
         }
     }
-    NeedsRerendering = false;
+    NeedsRerendering = RayTraceMode && NeedsRayTracing;    // Continue with the next progressive pass
 }
 
 void InitializeSceneGeometry()
 {
+    const char* kdTreeCacheFile = 0;    // File to save the kd-Tree in, for scenes loaded from files
 // Define the lights, materials, textures and viewable objects.
 // One of the following four lines should un-commented to select the way
 //		the scene is loaded into the SceneDescription.
@@ -124,6 +165,7 @@ void InitializeSceneGeometry()
 #elif MODE==2
     LoadObjFile("f15.obj", FileScene);
     ActiveScene = &FileScene;
+    kdTreeCacheFile = "f15.kdtree";
     // The next lines specify scene attributes not given in the obj file.
     ActiveScene->SetBackGroundColor(0.0, 0.0, 0.0);
     ActiveScene->SetGlobalAmbientLight(0.6, 0.6, 0.2);
@@ -136,13 +178,14 @@ void InitializeSceneGeometry()
 #else
     LoadNffFile("jacks_5_1.nff", FileScene);
     ActiveScene = &FileScene;
+    kdTreeCacheFile = "jacks_5_1.kdtree";
     // The NFF file includes camera view information, no need to add it here.
     // You may add more scene elements here if you wish
 #endif
 
     // Build the kd-Tree.
     double kdTime = glfwGetTime();
-    ActiveKdTree = &myBuildKdTree(*ActiveScene);
+    ActiveKdTree = &myBuildKdTree(*ActiveScene, kdTreeCacheFile);
     kdTime = glfwGetTime() - kdTime;
     printf("       kd-Tree build time %0.4f seconds.\n", kdTime);
     if (!ActiveScene->GetCameraView().CameraViewHasBeenSet()) {
@@ -179,7 +222,7 @@ void window_size_callback(GLFWwindow* /*window*/, int width, int height) {
 
     OpenglDraw.InitView(*ActiveScene);;
 
-    NeedsRayTracing = true;
+    RestartRayTracing();
     NeedsRerendering = true;
     RayTraceMode = false;
 
@@ -213,6 +256,22 @@ void key_callback(GLFWwindow* /*window*/, int key, int /*scancode*/, int action,
         NeedsRerendering = !RayTraceMode;   // Switching from OpenGL mode to RayTrace mode
         RayTraceMode = true;
         return;
+    case GLFW_KEY_L:
+        // Brighten (or with shift, dim) all the lights.  Re-shades without retracing the primary rays.
+        {
+            double scale = (mods&GLFW_MOD_SHIFT) ? 0.8 : 1.25;
+            for (int k = 0; k < ActiveScene->NumLights(); k++) {
+                Light& light = ActiveScene->GetLight(k);
+                light.SetColorDiffuse(scale*light.GetColorDiffuse());
+                light.SetColorSpecular(scale*light.GetColorSpecular());
+            }
+        }
+        RestartShading();
+        return;
+    case GLFW_KEY_P:
+        ReprojectionMode = !ReprojectionMode;
+        printf("Reprojection mode is %s.\n", ReprojectionMode ? "on" : "off");
+        return;
     case GLFW_KEY_R:
         // Reset view
         ActiveScene->GetCameraView() = SavedCameraView;
@@ -260,9 +319,19 @@ void key_callback(GLFWwindow* /*window*/, int key, int /*scancode*/, int action,
     default:
         return;
     }
-    RayTraceMode = false;
+    // The camera view has changed
+    if (RayTraceMode && ReprojectionMode && Reprojection.Reproject(*ActiveScene, *ActiveKdTree, *pixels)) {
+        // Show the reprojected image, and refine it with progressive ray tracing.
+        ProgressiveRender.Restart(true);
+        RayTraceTime = 0.0;
+        HitCache.Invalidate();
+        NeedsRayTracing = true;
+    }
+    else {
+        RayTraceMode = false;
+        RestartRayTracing();
+    }
     NeedsRerendering = true;
-    NeedsRayTracing = true;
     OpenglDraw.InitView(*ActiveScene);
 }
 
@@ -345,11 +414,13 @@ int main() {
     printf("Using GLEW version %s.\n", glewGetString(GLEW_VERSION));
 
     printf("------------------------------\n");
-    fprintf(stdout, "Press 'g' or space bar to start ray tracing. (And then wait!)\n");
+    fprintf(stdout, "Press 'g' or space bar to start ray tracing. (The image improves over %d passes.)\n", NumProgressivePasses);
     fprintf(stdout, "Press 'G' to return to OpenGL render mode.\n");
     fprintf(stdout, "Arrow keys change view orientation (and use OpenGL).\n");
     fprintf(stdout, "SHIFT + Arrow keys translate the scene (and use OpenGL).\n");
     fprintf(stdout, "Home/End keys alter view distance --- resizing keeps it same view size.\n");
+    fprintf(stdout, "Press 'l' or 'L' to brighten or dim the lights.\n");
+    fprintf(stdout, "Press 'p' to toggle reprojection mode:  the view can then be changed while ray tracing.\n");
 
     setup_callbacks();
 
@@ -361,7 +432,12 @@ int main() {
     // Loop while program is not terminated.
     while (!glfwWindowShouldClose(WindowID)) {
         myRenderScene();				// Ray Trace or Render as needed
-        glfwWaitEvents();				// Use this if no animation.
+        if (NeedsRerendering) {
+            glfwPollEvents();           // Progressive ray tracing is not finished
+        }
+        else {
+            glfwWaitEvents();           // Use this if no animation.
+        }
     }
 
     glfwTerminate();
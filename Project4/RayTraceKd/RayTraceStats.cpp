@@ -21,6 +21,7 @@
 // RayTraceStats.cpp
 // Ray Trace Statistics
 
+#include <assert.h>
 #include "RayTraceStats.h"
 #include "../DataStructs/Stack.h"
 #include "../DataStructs/KdTree.h"
@@ -34,15 +35,76 @@ void RayTraceStats::Init()
 	NumberIsectTests = 0;
 	NumberSuccessIsectTests = 0;
 
+	for ( int i=0; i<MaxDepth; i++ ) {
+		RaysAtDepth[i] = 0;
+	}
+	for ( int i=0; i<NumViewableTypes; i++ ) {
+		IsectTestsByType[i] = 0;
+		SuccessIsectTestsByType[i] = 0;
+	}
+
 	NumberKdNodesTraversed = 0;
 	NumberKdLeavesTraversed = 0;
 	NumberKdObjectsInLeaves = 0;
+	for ( int i=0; i<KdNodesHistogramSize; i++ ) {
+		KdNodesHistogram[i] = 0;
+	}
+}
+
+void RayTraceStats::Merge( const RayTraceStats& other )
+{
+	NumberRaysTraced += other.NumberRaysTraced;
+	NumberReflectionRays += other.NumberReflectionRays;
+	NumberXmitRays += other.NumberXmitRays;
+	NumberShadowFeelers += other.NumberShadowFeelers;
+	NumberIsectTests += other.NumberIsectTests;
+	NumberSuccessIsectTests += other.NumberSuccessIsectTests;
+	for ( int i=0; i<MaxDepth; i++ ) {
+		RaysAtDepth[i] += other.RaysAtDepth[i];
+	}
+	for ( int i=0; i<NumViewableTypes; i++ ) {
+		IsectTestsByType[i] += other.IsectTestsByType[i];
+		SuccessIsectTestsByType[i] += other.SuccessIsectTestsByType[i];
+	}
 
+	NumberKdNodesTraversed += other.NumberKdNodesTraversed;
+	NumberKdLeavesTraversed += other.NumberKdLeavesTraversed;
+	NumberKdObjectsInLeaves += other.NumberKdObjectsInLeaves;
+	for ( int i=0; i<KdNodesHistogramSize; i++ ) {
+		KdNodesHistogram[i] += other.KdNodesHistogram[i];
+	}
 }
 
-void RayTraceStats::GetKdRunData( const KdTree& kdTree )
+const char* RayTraceStats::ViewableTypeName( int viewableType )
 {
-	kdTree.Stats_GetAll( &NumberKdNodesTraversed, &NumberKdLeavesTraversed, &NumberKdObjectsInLeaves );
+	static const char* names[NumViewableTypes] = {
+		"BezierSet", "Cone", "Cylinder", "Ellipsoid", "Parallelepiped",
+		"Parallelogram", "Sphere", "Torus", "Triangle", "TriangleMesh", "Instance" };
+	assert ( 0<=viewableType && viewableType<NumViewableTypes );
+	return names[viewableType];
+}
+
+// Prints the non-zero entries of a histogram, eight to a line.
+//	 The last entry counts everything past the end of the histogram.
+static void PrintHistogram( FILE* out, const long* counts, int size )
+{
+	int numOnLine = 0;
+	for ( int i=0; i<size; i++ ) {
+		if ( counts[i]==0 ) {
+			continue;
+		}
+		if ( numOnLine==0 ) {
+			fprintf( out, "     " );
+		}
+		fprintf( out, " %2d%s:%ld", i, (i==size-1) ? "+" : "", counts[i] );
+		if ( ++numOnLine==8 ) {
+			fprintf( out, "\n" );
+			numOnLine = 0;
+		}
+	}
+	if ( numOnLine!=0 ) {
+		fprintf( out, "\n" );
+	}
 }
 
 void RayTraceStats::PrintStats( FILE* out )
@@ -51,9 +113,35 @@ void RayTraceStats::PrintStats( FILE* out )
 	fprintf( out, "Run time statistics:\n");
 	fprintf( out, "  Number of rays traced = %ld.\n", NumberRaysTraced );
 #endif
+#if TrackRaysTraced
+	fprintf( out, "  Rays by depth (excluding shadow feelers):\n" );
+	PrintHistogram( out, RaysAtDepth, MaxDepth );
+#endif
+#if TrackReflectionRays
+	fprintf( out, "  Number of reflection rays = %ld.\n", NumberReflectionRays );
+#endif
+#if TrackXmitRays
+	fprintf( out, "  Number of transmission rays = %ld.\n", NumberXmitRays );
+#endif
 #if TrackShadowFeelers
 	fprintf( out, "  Number of shadow feelers = %ld.\n", NumberShadowFeelers );
 #endif
+#if TrackIsectTests
+	fprintf( out, "  Intersection tests = %ld.", NumberIsectTests );
+#if TrackSuccessIsectTests
+	fprintf( out, "  Successful = %ld.", NumberSuccessIsectTests );
+#endif
+	fprintf( out, "\n" );
+	for ( int i=0; i<NumViewableTypes; i++ ) {
+		if ( IsectTestsByType[i]!=0 ) {
+			fprintf( out, "     %-15s %ld", ViewableTypeName(i), IsectTestsByType[i] );
+#if TrackSuccessIsectTests
+			fprintf( out, "  (%ld successful)", SuccessIsectTestsByType[i] );
+#endif
+			fprintf( out, "\n" );
+		}
+	}
+#endif
 #if TrackKdTraversal
 	fprintf( out, "  KdTree: Nodes traversed, %ld.  Non-empty leaves traversed, %ld.\n", 
 				NumberKdNodesTraversed, NumberKdLeavesTraversed );
@@ -65,6 +153,8 @@ void RayTraceStats::PrintStats( FILE* out )
 				(double)NumberKdNodesTraversed/numRays, 
 				(double)NumberKdLeavesTraversed/numRays,
 				(double)NumberKdObjectsInLeaves/numRays );
+	fprintf( out, "  Kd traversals by number of nodes visited:\n" );
+	PrintHistogram( out, KdNodesHistogram, KdNodesHistogramSize );
 #endif
 }
 
@@ -79,6 +169,10 @@ void RayTraceStats::PrintKdStats( const KdTree& kdTree, FILE* out )
 	long sumNodeDepths = 0;
 	long numEmptyLeaves = 0;
 	long numObjectsAtLeaves = 0;
+	long leafSizes[LeafHistogramSize];		// Number of non-empty leaves by number of objects
+	for ( int k=0; k<LeafHistogramSize; k++ ) {
+		leafSizes[k] = 0;
+	}
 
 	// Traverse the tree, gathering data
 	Stack<long> treeNodeStack;
@@ -94,21 +188,22 @@ void RayTraceStats::PrintKdStats( const KdTree& kdTree, FILE* out )
 		}
 		sumNodeDepths += level;
 		numAtDepth[Min((long)127,level)]++;
-		const KdTreeNode& thisNode = kdTree.GetNode(i);
+		const KdPackedNode& thisNode = kdTree.GetNode(i);
 		if ( thisNode.IsLeaf() ) {
 			numLeaves++;
 			sumLeafDepths += level;
 			numObjectsAtLeaves += thisNode.GetNumObjects();
+			leafSizes[Min((long)LeafHistogramSize-1,(long)thisNode.GetNumObjects())]++;
 		}
 		else {
-			if ( !thisNode.RightChildEmpty() ) {
+			if ( !kdTree.GetNode(thisNode.RightChildIndex()).IsEmptyLeaf() ) {
 				treeNodeStack.Push( thisNode.RightChildIndex() );
 				levelStack.Push( level+1 );
 			}
 			else {
 				numEmptyLeaves++;
 			}
-			if ( !thisNode.LeftChildEmpty() ) {
+			if ( !kdTree.GetNode(thisNode.LeftChildIndex()).IsEmptyLeaf() ) {
 				treeNodeStack.Push( thisNode.LeftChildIndex() );
 				levelStack.Push ( level+1 );
 			}
@@ -128,6 +223,8 @@ void RayTraceStats::PrintKdStats( const KdTree& kdTree, FILE* out )
 	fprintf( out, "       Depth: %ld.\n", maxDepth);
 	fprintf( out, "       Mean depths: All nodes, %.5lf.  Leaf nodes, %.5lf.\n", 
 					(double)sumNodeDepths/(double)(numNodes), (double)sumLeafDepths/(double)(numLeaves) );
+	fprintf( out, "       Leaves by number of objects:\n" );
+	PrintHistogram( out, leafSizes, LeafHistogramSize );
 #endif
 
 }
@@ -21,20 +21,46 @@
 
 // RayTraceStats.h
 //  A class for maintaining statistics about ray tracing
+//
+//  Each rendering thread counts into its own RayTraceStats, with no locking,
+//	and the threads' statistics are merged at the end of the frame.
+//  Each of the Track* settings below can be set to 0 to compile out its counters.
+//	They can also be set on the compiler command line.
 
+#ifndef RAYTRACESTATS_H
+#define RAYTRACESTATS_H
 
 #include <stdio.h>
+#include "../Graphics/ViewableBase.h"
 class KdTree;
 
+#ifndef TrackRaysTraced
 #define TrackRaysTraced 1
+#endif
+#ifndef TrackReflectionRays
 #define TrackReflectionRays 1
+#endif
+#ifndef TrackXmitRays
 #define TrackXmitRays 1
+#endif
+#ifndef TrackKdTraversals			// Also used by KdTree.h
 #define TrackKdTraversals 1
+#endif
+#ifndef TrackShadowFeelers
 #define TrackShadowFeelers 1
+#endif
+#ifndef TrackIsectTests
 #define TrackIsectTests 1
+#endif
+#ifndef TrackSuccessIsectTests
 #define TrackSuccessIsectTests 1
+#endif
+#ifndef TrackKdProperties
 #define TrackKdProperties 1
+#endif
+#ifndef TrackKdTraversal
 #define TrackKdTraversal 1
+#endif
 
 class RayTraceStats
 {
@@ -42,23 +68,50 @@ public:
 	RayTraceStats() { Init(); }
 	~RayTraceStats() {}
 
+	static const int MaxDepth = 16;					// Rays at depth MaxDepth-1 or more are counted together
+	static const int KdNodesHistogramSize = 64;		// Traversals of KdNodesHistogramSize-1 or more nodes are counted together
+	static const int LeafHistogramSize = 32;		// Leaves with LeafHistogramSize-1 or more objects are counted together
+	static const int NumViewableTypes = ViewableBase::Viewable_Instance+1;
+
 	void Init();
 
+	// Add the counts from another RayTraceStats into this one.
+	//   Used to combine the statistics gathered by separate threads.
+	void Merge( const RayTraceStats& other );
+
 	void PrintStats( FILE* out = stdout );
 
 	void AddRayTraced();
+	void AddRayAtDepth( int depth );		// depth is 0 for rays from the camera
 	void AddReflectionRay();
 	void AddXmitRay();
 	void AddShadowFeeler();
-	void AddIsectTest();
-	void AddSuccessIsectTest();
+	void AddIsectTest( const ViewableBase& object );
+	void AddSuccessIsectTest( const ViewableBase& object );
 	
-	void AddKdNodeTraversed();
-	void AddKdLeavesTraversed();
-	void AddKdObjectsInLeavesTraversed( int numObjects = 1 );
+	// Adds the counts for one kd-tree traversal.  
+	//	 The counts come from the KdTraverseScratch used by the traversal.
+	void AddKdTraversal( long numNodes, long numLeaves, long numObjects );
+
+	long GetNumberRaysTraced() const { return NumberRaysTraced; }
+	long GetNumberReflectionRays() const { return NumberReflectionRays; }
+	long GetNumberXmitRays() const { return NumberXmitRays; }
+	long GetNumberShadowFeelers() const { return NumberShadowFeelers; }
+	long GetNumberIsectTests() const { return NumberIsectTests; }
+	long GetNumberSuccessIsectTests() const { return NumberSuccessIsectTests; }
+	long GetNumberKdNodesTraversed() const { return NumberKdNodesTraversed; }
+	long GetNumberKdLeavesTraversed() const { return NumberKdLeavesTraversed; }
+	long GetNumberKdObjectsInLeaves() const { return NumberKdObjectsInLeaves; }
+
+	long GetNumberRaysAtDepth( int depth ) const { return RaysAtDepth[depth]; }
+	long GetNumberIsectTests( int viewableType ) const { return IsectTestsByType[viewableType]; }
+	long GetNumberSuccessIsectTests( int viewableType ) const { return SuccessIsectTestsByType[viewableType]; }
+	// Number of kd-tree traversals that visited numNodes interior nodes.
+	long GetKdNodesHistogram( int numNodes ) const { return KdNodesHistogram[numNodes]; }
+
+	static const char* ViewableTypeName( int viewableType );
 
 public:
-	void GetKdRunData( const KdTree& kdTree );
 	static void PrintKdStats( const KdTree& kdTree, FILE* out = stdout );
 
 private:
@@ -68,11 +121,15 @@ private:
 	long NumberShadowFeelers;
 	long NumberIsectTests;
 	long NumberSuccessIsectTests;
+	long RaysAtDepth[MaxDepth];
+	long IsectTestsByType[NumViewableTypes];
+	long SuccessIsectTestsByType[NumViewableTypes];
 
 	// KdTree operations
 	long NumberKdNodesTraversed;
 	long NumberKdLeavesTraversed;
 	long NumberKdObjectsInLeaves;
+	long KdNodesHistogram[KdNodesHistogramSize];
 
 };
 
@@ -83,6 +140,13 @@ inline void RayTraceStats::AddRayTraced()
 #endif
 }
 
+inline void RayTraceStats::AddRayAtDepth( int depth )
+{
+#if TrackRaysTraced
+	RaysAtDepth[ depth<MaxDepth ? depth : MaxDepth-1 ]++;
+#endif
+}
+
 inline void RayTraceStats::AddReflectionRay()
 {
 #if TrackReflectionRays
@@ -104,37 +168,30 @@ inline void RayTraceStats::AddShadowFeeler()
 #endif
 }
 
-inline void RayTraceStats::AddIsectTest()
+inline void RayTraceStats::AddIsectTest( const ViewableBase& object )
 {
 #if TrackIsectTests
 	NumberIsectTests++;
+	IsectTestsByType[object.GetViewableType()]++;
 #endif
 }
 
-inline void RayTraceStats::AddSuccessIsectTest()
+inline void RayTraceStats::AddSuccessIsectTest( const ViewableBase& object )
 {
 #if TrackSuccessIsectTests
 	NumberSuccessIsectTests++;
+	SuccessIsectTestsByType[object.GetViewableType()]++;
 #endif
 }
 
-inline void RayTraceStats::AddKdNodeTraversed()
-{
-#if TrackKdTraversals
-	NumberKdNodesTraversed++;
-#endif
-}
-
-inline void RayTraceStats::AddKdLeavesTraversed()
+inline void RayTraceStats::AddKdTraversal( long numNodes, long numLeaves, long numObjects )
 {
 #if TrackKdTraversals
-	NumberKdNodesTraversed++;
+	NumberKdNodesTraversed += numNodes;
+	NumberKdLeavesTraversed += numLeaves;
+	NumberKdObjectsInLeaves += numObjects;
+	KdNodesHistogram[ numNodes<KdNodesHistogramSize ? numNodes : KdNodesHistogramSize-1 ]++;
 #endif
 }
 
-inline void RayTraceStats::AddKdObjectsInLeavesTraversed( int numObjects )
-{
-#if TrackKdTraversals
-	NumberKdNodesTraversed += numObjects;
-#endif
-}
+#endif // RAYTRACESTATS_H
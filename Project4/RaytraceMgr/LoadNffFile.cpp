@@ -30,7 +30,7 @@
 #include "../Graphics/ViewableCone.h"
 #include "../Graphics/ViewableCylinder.h"
 #include "../Graphics/ViewableSphere.h"
-#include "../Graphics/ViewableTriangle.h"
+#include "../Graphics/ViewableTriangleMesh.h"
 
 const int numCommands = 14;
 const char* nffCommandList[numCommands] = 
@@ -315,6 +315,11 @@ bool NffFileLoader::Load( const char* filename, SceneDescription& theScene )
 
 bool NffFileLoader::ProcessFaceNFF( int numVerts, const Material* mat, FILE* infile )
 {
+	// The polygon is added to the mesh as a fan of triangles.
+	if ( Mesh==0 ) {
+		Mesh = new ViewableTriangleMesh();
+		ScenePtr->AddViewable( Mesh );
+	}
 	VectorR3 firstVert, prevVert, thisVert;
 	if ( !ReadVertexR3(firstVert, infile) ) {
 		return false;
@@ -322,18 +327,16 @@ bool NffFileLoader::ProcessFaceNFF( int numVerts, const Material* mat, FILE* inf
 	if ( !ReadVertexR3(prevVert, infile) ) {
 		return false;
 	}
+	long firstIdx = Mesh->AddVertex( firstVert );
+	long prevIdx = Mesh->AddVertex( prevVert );
 	int i;
 	for ( i=2; i<numVerts; i++ ) {
 		if ( !ReadVertexR3(thisVert, infile) ) {
 			return false;
 		}
-		ViewableTriangle* vt = new ViewableTriangle();
-		vt->Init( firstVert, prevVert, thisVert );
-		if ( vt->IsWellFormed() ) {
-			vt->SetMaterial( mat );
-			ScenePtr->AddViewable( vt );
-		}
-		prevVert = thisVert;
+		long thisIdx = Mesh->AddVertex( thisVert );
+		Mesh->AddTriangle( firstIdx, prevIdx, thisIdx, mat );	// Not added if it has zero area
+		prevIdx = thisIdx;
 	}
 	return true;
 }
@@ -447,6 +450,7 @@ int NffFileLoader::GetCommandNumber( char *cmd ) {
 
 void NffFileLoader::Reset()
 {
+	Mesh = 0;
 	for ( long i=0; i<UnsupportedCmds.SizeUsed(); i++ ) {
 		delete UnsupportedCmds[i];
 	}
@@ -30,6 +30,7 @@
 class SceneDescription;
 class ObjFileLoader;
 class CameraView;
+class ViewableTriangleMesh;
 
 // This is the preferred method for loading from nff (neutral file format) files.
 //    Filename should usually end with ".nff".
@@ -76,6 +77,7 @@ private:
 							int screenWidth, int screenHeight, double nearClipping);
 
 	bool ProcessFaceNFF( int numVerts, const Material* mat, FILE* infile );
+	ViewableTriangleMesh* Mesh;			// Holds the polygons.  Null until the first polygon.
 	void ProcessConeCylNFF( const VectorR3& baseCenter, double baseRadius, 
 							const VectorR3& topCenter, double topRadius );
 	static bool ReadVertexR3( VectorR3& vertReturned, FILE* infile );
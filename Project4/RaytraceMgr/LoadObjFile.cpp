@@ -27,6 +27,7 @@
 
 #include "../Graphics/ViewableParallelogram.h"
 #include "../Graphics/ViewableTriangle.h"
+#include "../Graphics/ViewableTriangleMesh.h"
 
 const int numCommands = 4;
 const char* commandList[numCommands] = 
@@ -90,6 +91,7 @@ bool ObjFileLoader::Load( const char* filename, SceneDescription& theScene )
 		case 0:   // 'v' command
 			{
 				VectorR4* vertData = Vertices.Push();
+				MeshVertexNums.Push( -1 );
 				ok = ReadVectorR4Hg ( args, vertData );
 			}
 			break;
@@ -301,7 +303,7 @@ bool ObjFileLoader::ProcessFace( char* inbuf)
 		return false;
 	}
 
-	// Create the ViewableTriangles
+	// Create the triangles, in the mesh
 
 	// Textures: At the moment, we do not support materials, so it does not 
 	//		make any sense to support textures and texture coordinates.
@@ -324,6 +326,10 @@ bool ObjFileLoader::ProcessFace( char* inbuf)
 		}
 	}
 	// Otherwise, add as (numVertsInFace-2) many triangles.
+	if ( Mesh==0 ) {
+		Mesh = new ViewableTriangleMesh();
+		ScenePtr->AddViewable( Mesh );
+	}
 	int startIdx = 0;
 	int stepIdx = 1;
 	for ( i=0; i<numVertsInFace-2; i++ ) {
@@ -338,18 +344,11 @@ bool ObjFileLoader::ProcessFace( char* inbuf)
 			return false;
 		}
 		else {
-			vA.SetFromHg( Vertices[i1] );
-			vB.SetFromHg( Vertices[i2] );
-			vC.SetFromHg( Vertices[i3] );
 			startIdx = idx3;
 			assert ( 0 <= idx2 && idx2 < numVertsInFace );
 			assert ( 0 <= idx3 && idx3 < numVertsInFace );
-			ViewableTriangle* vt = new ViewableTriangle();
-			vt->Init( vA, vB, vC );
-			if ( vt->IsWellFormed() ) {
-				// If triangle has non-zero area, add it.
-				ScenePtr->AddViewable( vt );
-			}
+			// Added only if the triangle has non-zero area.
+			Mesh->AddTriangle( GetMeshVertex(i1), GetMeshVertex(i2), GetMeshVertex(i3), &Material::Default );
 		}
 	}
 #else
@@ -404,9 +403,23 @@ int ObjFileLoader::NextTriVertIdx( int start, int* step, int totalNum )
 	return retIdx;
 }
 
+// Returns the vertex number in the mesh of the i-th vertex (numbered from 0)
+//	 of the file, and adds it to the mesh the first time.
+long ObjFileLoader::GetMeshVertex( long i )
+{
+	if ( MeshVertexNums[i]<0 ) {
+		VectorR3 v;
+		v.SetFromHg( Vertices[i] );
+		MeshVertexNums[i] = Mesh->AddVertex( v );
+	}
+	return MeshVertexNums[i];
+}
+
 void ObjFileLoader::Reset()
 {
 	Vertices.Reset();
+	MeshVertexNums.Reset();
+	Mesh = 0;
 	TextureCoords.Reset();
 	// VertexNormals.Reset();
 	for ( long i=0; i<UnsupportedCmds.SizeUsed(); i++ ) {
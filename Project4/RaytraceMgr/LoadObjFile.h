@@ -29,6 +29,7 @@
 
 class SceneDescription;
 class ObjFileLoader;
+class ViewableTriangleMesh;
 
 // This is the preferred method for loading from obj files.
 //    Filename should end with ".obj".
@@ -82,6 +83,11 @@ private:
 	Array<VectorR2> TextureCoords;		// Texture coordinates not supported yet
 	Array<VectorR3> VertexNormals;		// Vertex normals not supported yet
 
+	// The triangles are put in one mesh, which shares the vertices of the file.
+	ViewableTriangleMesh* Mesh;			// Null until the first triangle
+	Array<long> MeshVertexNums;			// Vertex number in Mesh for each vertex, or -1
+	long GetMeshVertex( long i );
+
 	Array<char*> UnsupportedCmds;
 
 };
@@ -80,4 +80,12 @@ void SceneDescription::DeleteAllViewables()
 	}
 }
 
+void SceneDescription::DeleteAllSharedViewables()
+{
+	long i;
+	for ( i=NumSharedViewables(); i>0; i-- ) {
+		delete SharedViewableArray.Pop();
+	}
+}
+
 
@@ -128,10 +128,21 @@ public:
 	Array<ViewableBase*>& GetViewableArray() { return ViewableArray; }
 	const Array<ViewableBase*>& GetViewableArray() const { return ViewableArray; }
 
+	// Shared viewables are placed in the scene by InstancedViewable objects, and are not
+	//	 rendered by themselves.
+	//	 The scene owns them, and deletes them with the viewables.
+	int NumSharedViewables() const { return SharedViewableArray.SizeUsed(); }
+	int AddSharedViewable( ViewableBase* newViewable );
+	ViewableBase& GetSharedViewable( int i ) { return *SharedViewableArray[i]; }
+	const ViewableBase& GetSharedViewable( int i ) const { return *SharedViewableArray[i]; }
+	Array<ViewableBase*>& GetSharedViewableArray() { return SharedViewableArray; }
+	const Array<ViewableBase*>& GetSharedViewableArray() const { return SharedViewableArray; }
+
 	void DeleteAllLights();
 	void DeleteAllTextures();
 	void DeleteAllMaterials();
 	void DeleteAllViewables();
+	void DeleteAllSharedViewables();
 	void DeleteAll();
 
 private:
@@ -151,6 +162,7 @@ private:
 	Array<TextureMapBase*> TextureArray;
 
 	Array<ViewableBase*> ViewableArray;
+	Array<ViewableBase*> SharedViewableArray;
 
 };
 
@@ -205,6 +217,13 @@ inline int SceneDescription::AddViewable( ViewableBase* newViewable )
 	return index;
 }
 
+inline int SceneDescription::AddSharedViewable( ViewableBase* newViewable ) 
+{ 
+	int index = (int)SharedViewableArray.SizeUsed();
+	SharedViewableArray.Push( newViewable );
+	return index;
+}
+
 inline TextureAffineXform* SceneDescription::NewTextureAffineXform() 
 { 
 	TextureAffineXform* newTex = new TextureAffineXform();
@@ -361,6 +380,7 @@ inline void SceneDescription::DeleteAll()
 	DeleteAllTextures();
 	DeleteAllMaterials();
 	DeleteAllViewables();
+	DeleteAllSharedViewables();		// After the instances that use them
 }
 
 #endif // SCENE_DESCRIPTION_H
\ No newline at end of file
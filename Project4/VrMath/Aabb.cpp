@@ -56,7 +56,7 @@ double AABB::SurfaceArea() const
 // Find intersection points with a ray.
 bool AABB::RayEntryExit( const VectorR3& startPos, const VectorR3& dir,
 						double *entryDist, int *entryFaceId,
-						double *exitDist, int *exitFaceId )
+						double *exitDist, int *exitFaceId ) const
 {
 	VectorR3 dirInv;
 	int signDirX = Sign(dir.x);
@@ -78,7 +78,7 @@ bool AABB::RayEntryExit( const VectorR3& startPos, const VectorR3& dir,
 bool AABB::RayEntryExit( const VectorR3& startPos, 
 					   int signDirX, int signDirY, int signDirZ, const VectorR3& dirInv,
 					   double *entryDist, int *entryFaceId,
-					   double *exitDist, int *exitFaceId )
+					   double *exitDist, int *exitFaceId ) const
 {
 	double& maxEnterDist=*entryDist;
 	int& maxEnterAxis = *entryFaceId;
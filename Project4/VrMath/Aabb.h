@@ -85,11 +85,11 @@ public:
 	// Find intersection points with a ray.
 	bool RayEntryExit( const VectorR3& startPos, const VectorR3& dir,
 					   double *entryDist, int *entryFaceId,
-					   double *exitDist, int *exitFaceId );
+					   double *exitDist, int *exitFaceId ) const;
 	bool RayEntryExit( const VectorR3& startPos, 
 					   int signDirX, int signDirY, int signDirZ, const VectorR3& dirInv,
 					   double *entryDist, int *entryFaceId,
-					   double *exitDist, int *exitFaceId );
+					   double *exitDist, int *exitFaceId ) const;
 
 private:
 	VectorR3 BoxMin;		// Lower corner (min value for all three coordinates)
@@ -708,7 +708,7 @@ AffineMapR3 AffineMapR3::Inverse() const				// Returns inverse
 	sd33 *= detInv;
 	double sd41 = -(m14*sd11 + m24*sd21 + m34*sd31);
 	double sd42 = -(m14*sd12 + m24*sd22 + m34*sd32);
-	double sd43 = -(m14*sd12 + m24*sd23 + m34*sd33);
+	double sd43 = -(m14*sd13 + m24*sd23 + m34*sd33);
 
 	return( AffineMapR3( sd11, sd12, sd13,
 						 sd21, sd22, sd23,
@@ -1811,6 +1811,12 @@ inline LinearMapR3 LinearMapR3::Transpose() const	// Returns the transpose
 // * AffineMapR3 class - inlined functions				*
 // * * * * * * * * * * * * * * * * * * * * * * * * * * **
 
+inline AffineMapR3::AffineMapR3()
+{
+	SetIdentity();
+	return;
+}
+
 inline AffineMapR3::AffineMapR3( double a11, double a21, double a31, 
 				  double a12, double a22, double a32,
 				  double a13, double a23, double a33, 
@@ -299,8 +299,8 @@ double GaussianGenerator::ComputeNextTwoValues()
 	double x, y;
 	double R;		// Radius squared
 	do {
-		x = (2.0/(double)RAND_MAX)*((double)rand()) - 1.0;  // Crappy random number generator, but OK for now
-		y = (2.0/(double)RAND_MAX)*((double)rand()) - 1.0;
+		x = Uniform.Rand();
+		y = Uniform.Rand();
 		R = x*x+y*y;
 	} while ( R>1.0 || R==0.0 );
 
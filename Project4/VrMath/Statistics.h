@@ -18,6 +18,7 @@ class WeightedMeanAndVarianceComputer;
 class UniformGenerator;
 class GaussianGenerator;
 class HomogenousR2UniformGenerator;
+class CounterBasedGenerator;
 
 
 // Factorial (long integer valued)
@@ -172,6 +173,8 @@ private:
 // ***************************************************************
 // Generate uniformly distributed values
 //	in the specified range.
+// Uses the PCG32 generator.  Each UniformGenerator has its own
+//  state, so separate threads should use separate generators.
 // ***************************************************************
 
 class UniformGenerator
@@ -182,13 +185,16 @@ public:
 	UniformGenerator( double min, double max );
 
 	void SetMinMax( double min, double max );
+	void SetSeed( unsigned long long seed );
 
-	double Rand();
+	double Rand();					// Value in [min,max)
+	unsigned int RandBits();		// 32 random bits
 
 private:
 	double MinValue;
 	double DeltaValue;		// equals MaxValue-MinValue
 
+	unsigned long long State;	// PCG32 state
 };
 
 // ***************************************************************
@@ -198,6 +204,7 @@ private:
 
 class GaussianGenerator
 {
+public:
 	// Defaults to mean zero and variance one
 	GaussianGenerator( double mean = 0.0, double stddev = 1.0 );
 
@@ -215,6 +222,7 @@ private:
 
 	bool NextComputed;
 	double NextValue;
+	UniformGenerator Uniform;		// Values in [-1,1)
 
 	double ComputeNextTwoValues();
 };
@@ -229,6 +237,36 @@ public:
 	void Rand( double &alpha, double &beta, double &gamma );
 };
 
+// ***************************************************************
+// Counter-based random numbers, using the Philox4x32-10 generator.
+//	 A value is computed from a key (for instance, a pixel number),
+//	 a sample number and a dimension number, with no state carried
+//	 from one value to the next.  So the values can be computed in
+//	 any order, by any number of threads, and are always the same
+//	 for the same seed, key, sample and dimension.
+//	 Rand4 gives the four dimensions 4*dimBlock, ..., 4*dimBlock+3
+//	 with one evaluation of Philox.
+// ***************************************************************
+
+class CounterBasedGenerator
+{
+public:
+	CounterBasedGenerator( unsigned int seed = 0 ) { SetSeed(seed); }
+
+	void SetSeed( unsigned int seed ) { Seed = seed; }
+	unsigned int GetSeed() const { return Seed; }
+
+	// Values in [0,1)
+	double Rand( unsigned int key, unsigned int sample, unsigned int dimension ) const;
+	void Rand4( unsigned int key, unsigned int sample, unsigned int dimBlock, double ret[4] ) const;
+
+	// 32 random bits for each of the four dimensions in the block.
+	void RandBits4( unsigned int key, unsigned int sample, unsigned int dimBlock, unsigned int ret[4] ) const;
+
+private:
+	unsigned int Seed;
+};
+
 // ************************************************
 // Inlined functions
 // ************************************************
@@ -454,11 +492,13 @@ inline long WeightedMeanAndVarianceComputer::Finalize()
 inline UniformGenerator::UniformGenerator()
 {
 	SetMinMax(0.0, 1.0);
+	SetSeed(0);
 }
 
 inline UniformGenerator::UniformGenerator( double min, double max)
 {
 	SetMinMax(min, max);
+	SetSeed(0);
 }
 
 inline void UniformGenerator::SetMinMax( double min, double max)
@@ -468,9 +508,27 @@ inline void UniformGenerator::SetMinMax( double min, double max)
 	assert( DeltaValue>0.0);
 }
 
+inline void UniformGenerator::SetSeed( unsigned long long seed )
+{
+	State = 0;
+	RandBits();
+	State += seed;
+	RandBits();
+}
+
+// PCG32: a 64 bit linear congruential step, with a permuted output
+inline unsigned int UniformGenerator::RandBits()
+{
+	unsigned long long oldState = State;
+	State = oldState*6364136223846793005ULL + 1442695040888963407ULL;
+	unsigned int xorShifted = (unsigned int)(((oldState >> 18) ^ oldState) >> 27);
+	unsigned int rot = (unsigned int)(oldState >> 59);
+	return (xorShifted >> rot) | (xorShifted << ((32-rot) & 31));
+}
+
 inline double UniformGenerator::Rand()
 {
-	double r = ((double)rand())/((double)RAND_MAX);		// Crappy random number generator but OK for now.
+	double r = (double)RandBits()*(1.0/4294967296.0);		// In [0,1)
 	return DeltaValue*r + MinValue;
 }
 
@@ -485,11 +543,12 @@ inline GaussianGenerator::GaussianGenerator( double mean, double stddev )
 
 inline void GaussianGenerator::SetMeanAndVariance( double mean, double stddev )
 {
-	assert( StdDevValue>0.0 );
+	assert( stddev>0.0 );
 
 	MeanValue = mean;
 	StdDevValue = stddev;
 	NextComputed = false;
+	Uniform.SetMinMax( -1.0, 1.0 );
 }
 
 inline double GaussianGenerator::Rand()
@@ -503,5 +562,53 @@ inline double GaussianGenerator::Rand()
 	}
 }
 
+// ************************************************
+// Inlined members for CounterBasedGenerator
+// ************************************************
+
+inline void CounterBasedGenerator::RandBits4( unsigned int key, unsigned int sample, 
+											  unsigned int dimBlock, unsigned int ret[4] ) const
+{
+	// Philox4x32 with 10 rounds.  The counter is (key, sample, dimBlock, 0),
+	//	  and the Philox key is (Seed, 0).
+	unsigned int c0 = key;
+	unsigned int c1 = sample;
+	unsigned int c2 = dimBlock;
+	unsigned int c3 = 0;
+	unsigned int k0 = Seed;
+	unsigned int k1 = 0;
+	for ( int round=0; round<10; round++ ) {
+		unsigned long long prod0 = 0xD2511F53ULL*(unsigned long long)c0;
+		unsigned long long prod1 = 0xCD9E8D57ULL*(unsigned long long)c2;
+		c0 = (unsigned int)(prod1 >> 32) ^ c1 ^ k0;
+		c1 = (unsigned int)prod1;
+		c2 = (unsigned int)(prod0 >> 32) ^ c3 ^ k1;
+		c3 = (unsigned int)prod0;
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+	ret[0] = c0;
+	ret[1] = c1;
+	ret[2] = c2;
+	ret[3] = c3;
+}
+
+inline void CounterBasedGenerator::Rand4( unsigned int key, unsigned int sample, 
+										  unsigned int dimBlock, double ret[4] ) const
+{
+	unsigned int bits[4];
+	RandBits4( key, sample, dimBlock, bits );
+	for ( int i=0; i<4; i++ ) {
+		ret[i] = (double)bits[i]*(1.0/4294967296.0);
+	}
+}
+
+inline double CounterBasedGenerator::Rand( unsigned int key, unsigned int sample, unsigned int dimension ) const
+{
+	unsigned int bits[4];
+	RandBits4( key, sample, dimension>>2, bits );
+	return (double)bits[dimension&3]*(1.0/4294967296.0);
+}
+
 #endif // STATISTICS_H
 